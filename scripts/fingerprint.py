@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Print the fingerprints a door keys its caches and audit log by, so the
+# audit lines of a badge can be found without the door storing its UID.
+# Fingerprints are SipHash-2-4 of the UID bytes under FINGERPRINT_KEY, which
+# is separate from AES_KEY so this never needs the door's root key. See
+# src/UidFingerprint.h.
+#
+#   scripts/fingerprint.py --fingerprint-key 000102...0f 04A1B2C3 04112233445566
+#   grep "$(scripts/fingerprint.py --fingerprint-key ... 04A1B2C3 | cut -d' ' -f2)" AUDIT.CSV
+
+import argparse
+import struct
+
+MASK = (1 << 64) - 1
+
+
+def rotate(x, bits):
+    return ((x << bits) | (x >> (64 - bits))) & MASK
+
+
+def sip_round(v):
+    v[0] = (v[0] + v[1]) & MASK
+    v[1] = rotate(v[1], 13) ^ v[0]
+    v[0] = rotate(v[0], 32)
+    v[2] = (v[2] + v[3]) & MASK
+    v[3] = rotate(v[3], 16) ^ v[2]
+    v[0] = (v[0] + v[3]) & MASK
+    v[3] = rotate(v[3], 21) ^ v[0]
+    v[2] = (v[2] + v[1]) & MASK
+    v[1] = rotate(v[1], 17) ^ v[2]
+    v[2] = rotate(v[2], 32)
+
+
+def siphash24(key, data):
+    k0, k1 = struct.unpack("<QQ", key)
+    v = [k0 ^ 0x736F6D6570736575, k1 ^ 0x646F72616E646F6D, k0 ^ 0x6C7967656E657261, k1 ^ 0x7465646279746573]
+    whole = len(data) & ~7
+    blocks = [struct.unpack("<Q", data[i : i + 8])[0] for i in range(0, whole, 8)]
+    blocks.append(int.from_bytes(data[whole:], "little") | (len(data) & 0xFF) << 56)
+    for m in blocks:
+        v[3] ^= m
+        sip_round(v)
+        sip_round(v)
+        v[0] ^= m
+    v[2] ^= 0xFF
+    for _ in range(4):
+        sip_round(v)
+    return v[0] ^ v[1] ^ v[2] ^ v[3]
+
+
+def fingerprint(key, uid):
+    return siphash24(key, uid) or 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("uids", nargs="+", help="card UIDs in hex, 4, 7 or 10 bytes")
+    parser.add_argument("--fingerprint-key", required=True, help="FINGERPRINT_KEY in hex")
+    args = parser.parse_args()
+
+    key = bytes.fromhex(args.fingerprint_key)
+    if len(key) != 16:
+        parser.error("keys are 16 bytes")
+
+    for text in args.uids:
+        uid = bytes.fromhex(text)
+        if len(uid) not in (4, 7, 10):
+            parser.error("%s is not a 4, 7 or 10 byte UID" % text)
+        print("%s %016X" % (text.upper(), fingerprint(key, uid)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+# Simulate a fleet of authorization proxies (src/AuthProxy.h) through a
+# morning rush and print the request rate they put on the server with fixed
+# cache expiry, with jittered expiry, and with jittered expiry plus early
+# refresh of hot grants. Badges arrive within a short window, then keep
+# tapping the doors of their floor at random intervals, so fixed TTLs make
+# their cached grants expire together and come back to the server as a burst.
+# Refreshing trades more requests for a flatter rate.
+#
+#   scripts/herd_sim.py
+#   scripts/herd_sim.py --floors 100 --rush 60 --minutes 30
+#
+# The defaults follow the proxy's build flags.
+
+import argparse
+import heapq
+import random
+
+TICK = 0.1  # Seconds
+WINDOW = 10  # Seconds per rate sample
+
+
+class Proxy:
+    def __init__(self, args, jitter, refresh_ahead, rng):
+        self.args = args
+        self.jitter = jitter
+        self.refresh_ahead = refresh_ahead
+        self.rng = rng
+        self.cache = {}  # (door, badge) -> [expires, hits, refresh_at]
+        self.last_refresh = {}  # door -> time
+        self.busy_until = 0.0
+
+    def ttl(self):
+        ttl = self.args.grant_ttl
+        return ttl - ttl * self.rng.randint(0, self.jitter) / 100
+
+    def store(self, key, now):
+        if key not in self.cache and len(self.cache) >= self.args.cache_entries:
+            del self.cache[min(self.cache, key=lambda k: self.cache[k][0])]
+        expires = now + self.ttl()
+        self.cache[key] = [expires, 0, expires - self.rng.uniform(0, self.refresh_ahead)]
+
+    # A tap, returns True if it went to the server
+    def tap(self, key, now):
+        entry = self.cache.get(key)
+        if entry and entry[0] > now:
+            entry[1] += 1
+            return False
+        self.store(key, now)
+        self.busy_until = now + self.args.round_trip
+        return True
+
+    # One revalidation while idle, returns True if one was sent
+    def refresh(self, now):
+        if self.refresh_ahead <= 0 or self.busy_until > now:
+            return False
+
+        due = None
+        for key, (expires, hits, refresh_at) in self.cache.items():
+            door = key[0]
+            if (hits >= self.args.min_hits and refresh_at <= now < expires and
+                    now - self.last_refresh.get(door, -1e9) >= self.args.refresh_interval and
+                    (due is None or expires < self.cache[due][0])):
+                due = key
+        if due is None:
+            return False
+
+        self.last_refresh[due[0]] = now
+        self.store(due, now)
+        self.busy_until = now + self.args.round_trip
+        return True
+
+
+def simulate(args, jitter, refresh_ahead):
+    rng = random.Random(args.seed)
+    proxies = [Proxy(args, jitter, refresh_ahead, rng) for _ in range(args.floors)]
+
+    # Arrival taps during the rush, then taps every mean_interval on average
+    events = []
+    for floor in range(args.floors):
+        for badge in range(args.badges):
+            heapq.heappush(events, (rng.uniform(0, args.rush), floor, badge))
+
+    end = args.minutes * 60
+    per_second = [0] * (int(end) + 1)
+    t = 0.0
+    while t < end:
+        tapped = set()
+        while events and events[0][0] <= t:
+            when, floor, badge = heapq.heappop(events)
+            door = rng.randrange(args.doors)
+            if proxies[floor].tap((door, badge), when):
+                per_second[int(when)] += 1
+            tapped.add(floor)
+            heapq.heappush(events, (when + rng.expovariate(1 / args.mean_interval), floor, badge))
+
+        for floor, proxy in enumerate(proxies):
+            if floor not in tapped and proxy.refresh(t):
+                per_second[int(t)] += 1
+        t += TICK
+
+    # Requests per 10 s window after the rush itself, where every badge has
+    # to reach the server once whatever the expiry
+    windows = [sum(per_second[i:i + WINDOW]) for i in range(int(args.rush), int(end) - WINDOW + 1, WINDOW)]
+    mean = sum(windows) / len(windows)
+    spread = (sum((w - mean) ** 2 for w in windows) / len(windows)) ** 0.5
+    return sum(per_second), mean, max(windows), spread
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--floors", type=int, default=40, help="proxies in the fleet")
+    parser.add_argument("--doors", type=int, default=2, help="door UUIDs per floor")
+    parser.add_argument("--badges", type=int, default=6, help="badges per floor")
+    parser.add_argument("--rush", type=float, default=20, help="seconds over which badges arrive")
+    parser.add_argument("--mean-interval", type=float, default=10, help="mean seconds between taps of a badge")
+    parser.add_argument("--minutes", type=float, default=10)
+    parser.add_argument("--cache-entries", type=int, default=16)
+    parser.add_argument("--grant-ttl", type=float, default=60)
+    parser.add_argument("--jitter", type=int, default=20, help="PROXY_TTL_JITTER_PERCENT")
+    parser.add_argument("--refresh-ahead", type=float, default=30, help="PROXY_REFRESH_AHEAD_S")
+    parser.add_argument("--min-hits", type=int, default=2, help="PROXY_REFRESH_MIN_HITS")
+    parser.add_argument("--refresh-interval", type=float, default=10, help="PROXY_REFRESH_INTERVAL_MS in seconds")
+    parser.add_argument("--round-trip", type=float, default=0.05, help="server round trip in seconds")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print(f"{'expiry':<22}{'requests':>10}{'mean/10s':>10}{'peak/10s':>10}{'stddev/10s':>12}")
+    for name, jitter, ahead in (("fixed TTL", 0, 0),
+                                ("jittered", args.jitter, 0),
+                                ("jittered + refresh", args.jitter, args.refresh_ahead)):
+        total, mean, peak, spread = simulate(args, jitter, ahead)
+        print(f"{name:<22}{total:>10}{mean:>10.1f}{peak:>10}{spread:>12.1f}")
+
+
+if __name__ == "__main__":
+    main()
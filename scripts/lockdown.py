@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+# Send an emergency command to every door on the lockdown multicast group and
+# measure how fast it propagates: prints each door's acknowledgement with the
+# round trip from sending to the acknowledgement and the time the door took
+# to apply the command. See src/LockdownListener.h for the packet format.
+#
+#   scripts/lockdown.py --command-key 000102...0f lock
+#   scripts/lockdown.py --command-key ... revoke --uid 04A1B2C3
+#
+# Needs the "cryptography" package.
+
+import argparse
+import socket
+import struct
+import time
+
+from cryptography.hazmat.primitives.ciphers import algorithms
+from cryptography.hazmat.primitives.cmac import CMAC
+
+COMMANDS = {"lock": 1, "unlock": 2, "resume": 3, "revoke": 4}
+VERSION = 1
+ACK_FORMAT = ">2sBBQI36s"
+
+
+def cmac(key, message):
+    mac = CMAC(algorithms.AES(key))
+    mac.update(message)
+    return mac.finalize()
+
+
+def build_command(key, command, sequence, uid):
+    body = struct.pack(">2sBBQB10s", b"LK", VERSION, command, sequence, len(uid), uid)
+    return body + cmac(key, body)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("command", choices=sorted(COMMANDS))
+    parser.add_argument("--uid", default="", help="card UID in hex, for revoke")
+    parser.add_argument("--command-key", required=True, help="COMMAND_KEY in hex")
+    parser.add_argument("--group", default="239.255.42.1")
+    parser.add_argument("--port", type=int, default=5007)
+    parser.add_argument("--wait", type=float, default=1.0, help="seconds to collect acknowledgements")
+    parser.add_argument("--sequence", type=int, help="defaults to the current time in milliseconds")
+    args = parser.parse_args()
+
+    key = bytes.fromhex(args.command_key)
+    uid = bytes.fromhex(args.uid)
+    if args.command == "revoke" and not 4 <= len(uid) <= 10:
+        parser.error("revoke needs a --uid of 4 to 10 bytes")
+    sequence = args.sequence if args.sequence is not None else int(time.time() * 1000)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 2)
+    sock.bind(("", 0))
+
+    packet = build_command(key, COMMANDS[args.command], sequence, uid)
+    sent = time.monotonic()
+    sock.sendto(packet, (args.group, args.port))
+    print("Sent %s, sequence %016x" % (args.command, sequence))
+
+    latencies = []
+    deadline = sent + args.wait
+    while True:
+        remaining = deadline - time.monotonic()
+        if remaining <= 0:
+            break
+        sock.settimeout(remaining)
+        try:
+            data, address = sock.recvfrom(128)
+        except socket.timeout:
+            break
+        received = time.monotonic()
+
+        size = struct.calcsize(ACK_FORMAT)
+        if len(data) != size + 16 or cmac(key, data[:size]) != data[size:]:
+            print("  %s: invalid acknowledgement" % address[0])
+            continue
+        magic, version, result, ack_sequence, apply_us, uuid = struct.unpack(ACK_FORMAT, data[:size])
+        if magic != b"LA" or ack_sequence != sequence:
+            continue
+
+        latency_ms = (received - sent) * 1000
+        latencies.append(latency_ms)
+        print("  %-15s %-36s %s  round trip %6.1f ms, applied in %6.2f ms" % (
+            address[0], uuid.rstrip(b"\0").decode(), "ok" if result else "failed", latency_ms, apply_us / 1000))
+
+    if latencies:
+        latencies.sort()
+        print("%d doors, median %.1f ms, slowest %.1f ms" % (
+            len(latencies), latencies[len(latencies) // 2], latencies[-1]))
+    else:
+        print("No acknowledgements")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,94 @@
+# PlatformIO post-build step: prints the per-subsystem static RAM map that the
+# firmware declares through RAM_BUDGET (src/MemoryBudget.h) and fails the build
+# when the subsystem limits add up to more than BUDGET_TOTAL_RAM (the same
+# check as the firmware's static_assert), or when the linked image's .data and
+# .bss exceed BUDGET_IMAGE_RAM or its flash BUDGET_TOTAL_FLASH.
+
+Import("env")
+
+import os
+import re
+import struct
+
+ENTRY_SYMBOL = "memoryMap"
+ENTRY_SYMBOL_NAMES = (ENTRY_SYMBOL, "_ZL%d%s" % (len(ENTRY_SYMBOL), ENTRY_SYMBOL))
+ENTRY_FORMAT = "<12sII"
+SHF_WRITE = 0x1
+SHF_ALLOC = 0x2
+SHT_SYMTAB = 2
+SHT_NOBITS = 8
+
+
+def read_budget_totals(project_dir):
+    totals = {}
+    with open(os.path.join(project_dir, "src", "MemoryBudget.h")) as header:
+        for match in re.finditer(r"#define (BUDGET_TOTAL_\w+) (\d+)", header.read()):
+            totals[match.group(1)] = int(match.group(2))
+    return totals
+
+
+def read_sections(elf):
+    shoff = struct.unpack_from("<I", elf, 0x20)[0]
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+    sections = []
+    for i in range(shnum):
+        fields = struct.unpack_from("<IIIIIIIIII", elf, shoff + i * shentsize)
+        sections.append({
+            "name_offset": fields[0], "type": fields[1], "flags": fields[2],
+            "addr": fields[3], "offset": fields[4], "size": fields[5], "link": fields[6],
+        })
+    names = sections[shstrndx]
+    for section in sections:
+        start = names["offset"] + section["name_offset"]
+        section["name"] = elf[start:elf.index(b"\0", start)].decode()
+    return sections
+
+
+def find_symbol(elf, sections, wanted_names):
+    for symtab in (s for s in sections if s["type"] == SHT_SYMTAB):
+        strtab = sections[symtab["link"]]
+        for offset in range(symtab["offset"], symtab["offset"] + symtab["size"], 16):
+            name, value, size, _, _, shndx = struct.unpack_from("<IIIBBH", elf, offset)
+            start = strtab["offset"] + name
+            if elf[start:elf.index(b"\0", start)].decode() in wanted_names:
+                return value, size, sections[shndx]
+    return None
+
+
+def memory_map(target, source, env):
+    with open(str(target[0]), "rb") as f:
+        elf = f.read()
+    sections = read_sections(elf)
+    totals = read_budget_totals(env.subst("$PROJECT_DIR"))
+
+    print("Static RAM budget (used / limit bytes):")
+    symbol = find_symbol(elf, sections, ENTRY_SYMBOL_NAMES)
+    used_total = limit_total = 0
+    if symbol:
+        value, size, section = symbol
+        base = section["offset"] + value - section["addr"]
+        for offset in range(base, base + size, struct.calcsize(ENTRY_FORMAT)):
+            name, used, limit = struct.unpack_from(ENTRY_FORMAT, elf, offset)
+            name = name.split(b"\0")[0].decode()
+            used_total += used
+            limit_total += limit
+            print("  %-12s %6d / %6d  %3d%%" % (name, used, limit, used * 100 // limit))
+        print("  %-12s %6d / %6d  (limits %d)" % ("Subsystems", used_total, totals["BUDGET_TOTAL_RAM"], limit_total))
+    else:
+        print("  %s not found in firmware image" % ENTRY_SYMBOL)
+
+    ram = sum(s["size"] for s in sections
+              if s["flags"] & SHF_ALLOC and s["flags"] & SHF_WRITE and s["name"].startswith((".data", ".bss")))
+    flash = sum(s["size"] for s in sections
+                if s["flags"] & SHF_ALLOC and s["type"] != SHT_NOBITS)
+    print("  %-12s %6d / %6d" % ("RAM image", ram, totals["BUDGET_IMAGE_RAM"]))
+    print("  %-12s %6d / %6d" % ("Flash total", flash, totals["BUDGET_TOTAL_FLASH"]))
+
+    if (limit_total > totals["BUDGET_TOTAL_RAM"] or ram > totals["BUDGET_IMAGE_RAM"] or
+            flash > totals["BUDGET_TOTAL_FLASH"]):
+        print("Firmware exceeds its memory budget!")
+        return 1
+    return 0
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", memory_map)
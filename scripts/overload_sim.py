@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+# Simulate a fleet of doors against a server whose capacity drops for a
+# while, e.g. a slow database, and compare doors that keep sending every tap
+# with doors that follow the overload signals of src/ServerLoad.h: 503 with
+# Retry-After, X-Server-Load, and backing off after repeated timeouts, with
+# trusted badges granted locally meanwhile.
+#
+#   scripts/overload_sim.py
+#   scripts/overload_sim.py --doors 500 --capacity 40 --degraded 0.2
+#
+# Requests the server takes longer than the door timeout to answer are still
+# processed; that wasted work is what keeps an overloaded server down.
+
+import argparse
+import collections
+import random
+
+TICK = 0.1  # Seconds
+REQUEST_TIMEOUT = 5.0
+SHED_PERCENT = 80  # OVERLOAD_SHED_PERCENT
+LOAD_HOLD = 30.0  # ServerLoad::LOAD_HOLD_MS
+TIMEOUT_BACKOFF = 5.0  # ServerLoad::TIMEOUT_BACKOFF_S
+MAX_BACKOFF = 300.0  # OVERLOAD_MAX_BACKOFF_S
+
+
+class Door:
+    def __init__(self):
+        self.backoff_until = 0.0
+        self.load = 0
+        self.load_time = -1e9
+        self.timeouts = 0
+
+    def backing_off(self, now):
+        return now < self.backoff_until
+
+    def overloaded(self, now):
+        return self.backing_off(now) or (self.load >= SHED_PERCENT and now - self.load_time < LOAD_HOLD)
+
+    def response(self, now, load, retry_after):
+        self.timeouts = 0
+        self.load, self.load_time = load, now
+        if retry_after:
+            self.backoff_until = now + min(retry_after, MAX_BACKOFF)
+
+    def timeout(self, now):
+        self.timeouts = min(self.timeouts + 1, 8)
+        if self.timeouts >= 2:
+            self.backoff_until = now + min(TIMEOUT_BACKOFF * 2 ** (self.timeouts - 2), MAX_BACKOFF)
+
+
+def simulate(args, shedding):
+    rng = random.Random(args.seed)
+    doors = [Door() for _ in range(args.doors)]
+    queue = collections.deque()  # (sent, door, tap time)
+    pending = {}  # door -> sent time of its outstanding request
+    taps = [(rng.expovariate(args.tap_rate), d, 0) for d in range(args.doors)]
+    stats = collections.Counter()
+    budget = 0.0
+    recovered = None
+
+    t = 0.0
+    while t < args.minutes * 60:
+        capacity = args.capacity
+        if args.degrade_at <= t < args.degrade_at + args.degrade_for:
+            capacity *= args.degraded
+        wait = len(queue) / capacity
+
+        # Taps due now, a failed tap is retried by its user a few seconds later
+        due = [tap for tap in taps if tap[0] <= t]
+        taps = [tap for tap in taps if tap[0] > t]
+        for when, d, retry in due:
+            if not retry:
+                taps.append((when + rng.expovariate(args.tap_rate), d, 0))
+            door = doors[d]
+            trusted = rng.random() < args.trusted
+            stats["taps"] += 1
+
+            if shedding and door.overloaded(t) and trusted:
+                stats["local grants"] += 1
+                continue
+            if (shedding and door.backing_off(t)) or d in pending:
+                stats["busy"] += 1
+                continue
+
+            # Admission control, a 503 costs the server next to nothing
+            if shedding and wait > args.admit_wait:
+                stats["rejected"] += 1
+                door.response(t, 100, args.retry_after)
+                stats["busy"] += 1
+                continue
+
+            stats["sent"] += 1
+            queue.append((t, d, retry))
+            pending[d] = t
+
+        # Doors give up on requests older than the timeout
+        for d, sent in list(pending.items()):
+            if t - sent > REQUEST_TIMEOUT:
+                del pending[d]
+                stats["timeouts"] += 1
+                if shedding:
+                    doors[d].timeout(t)
+                if rng.random() < args.retap:
+                    taps.append((t + 3.0, d, 1))
+
+        # Server works through its queue in order, idle capacity is lost
+        budget = min(budget + capacity * TICK, capacity * TICK + 1)
+        while queue and budget >= 1:
+            budget -= 1
+            sent, d, _ = queue.popleft()
+            stats["processed"] += 1
+            if pending.get(d) == sent:
+                del pending[d]
+                stats["decided"] += 1
+                load = min(100, int(100 * wait / args.admit_wait)) if shedding else 0
+                doors[d].response(t, load, 0)
+            else:
+                stats["wasted"] += 1
+
+        if t >= args.degrade_at + args.degrade_for and recovered is None and len(queue) / capacity < 1:
+            recovered = t - args.degrade_at - args.degrade_for
+        t += TICK
+
+    stats["recovery s"] = round(recovered, 1) if recovered is not None else -1
+    return stats
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--doors", type=int, default=200)
+    parser.add_argument("--tap-rate", type=float, default=0.05, help="taps per second at each door")
+    parser.add_argument("--trusted", type=float, default=0.6, help="share of taps by badges with a trusted signed grant")
+    parser.add_argument("--retap", type=float, default=0.5, help="chance a user taps again after a timeout")
+    parser.add_argument("--capacity", type=float, default=20, help="requests per second the server handles")
+    parser.add_argument("--degraded", type=float, default=0.25, help="share of capacity left while degraded")
+    parser.add_argument("--degrade-at", type=float, default=120, help="seconds")
+    parser.add_argument("--degrade-for", type=float, default=300, help="seconds")
+    parser.add_argument("--admit-wait", type=float, default=2.0, help="queue wait at which the server answers 503")
+    parser.add_argument("--retry-after", type=float, default=10, help="Retry-After of the server's 503")
+    parser.add_argument("--minutes", type=float, default=15)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rows = ("taps", "sent", "processed", "wasted", "decided", "timeouts", "rejected", "local grants", "busy",
+            "recovery s")
+    results = {"no shedding": simulate(args, False), "shedding": simulate(args, True)}
+    print(f"{'':<14}" + "".join(f"{name:>14}" for name in results))
+    for row in rows:
+        print(f"{row:<14}" + "".join(f"{stats[row]:>14}" for stats in results.values()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,109 @@
+#ifndef AuditLog_h
+#define AuditLog_h
+
+#include <Arduino.h>
+
+#include "StorageService.h"
+#include "UidFingerprint.h"
+
+#ifndef AUDIT_BUFFER_SIZE
+#define AUDIT_BUFFER_SIZE 512 // One SD sector of lines held in RAM
+#endif
+#ifndef AUDIT_FLUSH_INTERVAL_MS
+#define AUDIT_FLUSH_INTERVAL_MS 10000
+#endif
+
+// Append-only audit trail on the SD card, one CSV line per event:
+// unix time,event,badge fingerprint (hex),detail
+// Lines are collected in RAM and handed to the storage service a sector at
+// a time, at the latest AUDIT_FLUSH_INTERVAL_MS after the oldest one. On a
+// power failure the buffer is written by the emergency flush (see
+// PowerMonitor).
+class AuditLog
+{
+private:
+    static constexpr const char *PATH = "/AUDIT.CSV";
+    static const size_t LINE_SIZE = 128;
+    static_assert(AUDIT_BUFFER_SIZE <= StorageService::SECTOR_SIZE, "Audit buffer must fit one storage append");
+
+    StorageService &storage;
+    char buffer[AUDIT_BUFFER_SIZE];
+    size_t length = 0;
+    unsigned long oldest = 0;
+
+public:
+    explicit AuditLog(StorageService &storage) : storage(storage)
+    {
+    }
+
+    // badge is a UID fingerprint, 0 for events without a badge
+    void record(uint32_t time, const char *event, uint64_t badge, const char *detail)
+    {
+        char badgeHex[UidFingerprint::HEX_SIZE];
+        UidFingerprint::format(badge, badgeHex);
+
+        char line[LINE_SIZE];
+        int lineLength = snprintf(line, sizeof(line), "%lu,%s,%s,%s\r\n", (unsigned long)time, event, badgeHex,
+                                  detail ? detail : "");
+        lineLength = min(lineLength, (int)sizeof(line) - 1);
+        if (lineLength < 2)
+        {
+            return;
+        }
+        if (lineLength == (int)sizeof(line) - 1)
+        {
+            memcpy(line + lineLength - 2, "\r\n", 2); // Truncated, keep the line ending
+        }
+
+        if (length + lineLength > sizeof(buffer) && !flush(true))
+        {
+            Serial.println(F("Audit buffer full, event dropped"));
+            return;
+        }
+        if (length == 0)
+        {
+            oldest = millis();
+        }
+        memcpy(buffer + length, line, lineLength);
+        length += lineLength;
+    }
+
+    // Write the buffered lines once the oldest has waited long enough
+    void service()
+    {
+        if (length > 0 && millis() - oldest >= AUDIT_FLUSH_INTERVAL_MS)
+        {
+            flush();
+        }
+    }
+
+    // Queue all buffered lines as one append to the log file. Fails while
+    // the storage service has no room, the lines are kept for the next try.
+    // With waitForRoom the storage service is run until queued requests,
+    // such as capture chunks, have made room, as for a full buffer. Call
+    // it only where the storage service may run, i.e. with the SPI bus.
+    bool flush(bool waitForRoom = false)
+    {
+        if (length == 0)
+        {
+            return true;
+        }
+        while (!storage.append(PATH, buffer, length))
+        {
+            if (!waitForRoom || storage.depth() == 0)
+            {
+                return false;
+            }
+            storage.service();
+        }
+        length = 0;
+        return true;
+    }
+
+    size_t pending() const
+    {
+        return length;
+    }
+};
+
+#endif
@@ -0,0 +1,778 @@
+#ifndef AuthProxy_h
+#define AuthProxy_h
+
+#include <Arduino.h>
+#include <WiFiS3.h>
+#include <ArduinoJson.h>
+
+#include "BridgeTransport.h"
+#include "HttpHeaders.h"
+#include "KeyStore.h"
+#include "SecureRandom.h"
+#include "ServerLoad.h"
+
+#ifndef PROXY_PORT
+#define PROXY_PORT 8080
+#endif
+#ifndef PROXY_CACHE_ENTRIES
+#define PROXY_CACHE_ENTRIES 16
+#endif
+#ifndef PROXY_GRANT_TTL_S
+#define PROXY_GRANT_TTL_S 60 // Longest time a revoked badge is still granted from the cache
+#endif
+#ifndef PROXY_DENY_TTL_S
+#define PROXY_DENY_TTL_S 10
+#endif
+#ifndef PROXY_TTL_JITTER_PERCENT
+#define PROXY_TTL_JITTER_PERCENT 20 // Entries expire between this much before their TTL and the TTL
+#endif
+#ifndef PROXY_REFRESH_AHEAD_S
+#define PROXY_REFRESH_AHEAD_S 30 // Hot grants are revalidated at a random point this long before they expire
+#endif
+#ifndef PROXY_REFRESH_MIN_HITS
+#define PROXY_REFRESH_MIN_HITS 2 // Cache hits that make a grant hot
+#endif
+#ifndef PROXY_REFRESH_INTERVAL_MS
+#define PROXY_REFRESH_INTERVAL_MS 10000 // At most one revalidation per door UUID in this time
+#endif
+#ifndef PROXY_OVERLOAD_GRACE_S
+#define PROXY_OVERLOAD_GRACE_S 300 // Extra cache lifetime while the server is overloaded
+#endif
+
+// Authorization proxy for a floor of doors. Doors send their usual encrypted
+// JSON request here instead of to the server. The proxy decrypts the UID with
+// the shared request keys, answers repeated lookups of a badge at the same
+// door UUID from a short-lived decision cache, merges identical lookups that
+// arrive while one is already upstream, and forwards the rest unchanged over
+// one keep-alive connection to the server. Requests it cannot decrypt are
+// forwarded without caching.
+//
+// Expiry is jittered so badges cached together during a rush do not all go
+// back to the server at once, and grants that keep being hit are revalidated
+// shortly before they expire, one at a time while the upstream connection is
+// idle and at most once per PROXY_REFRESH_INTERVAL_MS for each door UUID.
+//
+// While the server signals overload (see ServerLoad) cached decisions are
+// used for PROXY_OVERLOAD_GRACE_S past their expiry, revalidation stops, and
+// during a Retry-After period doors are answered 503 by the proxy itself.
+class AuthProxy
+{
+public:
+    static const uint8_t MAX_DOORS = 4;   // Door connections served at once
+    static const uint8_t KNOWN_DOORS = 8; // Door UUIDs remembered for revalidation
+    static const size_t REQUEST_SIZE = 512;  // As the door's own response buffer
+    static const size_t RESPONSE_SIZE = 512;
+    static const size_t CACHED_BODY_SIZE = 48;
+    static const size_t JSON_BUFFER_SIZE = 192;
+
+    struct Stats
+    {
+        uint32_t requests;
+        uint32_t cacheHits;
+        uint32_t merged;
+        uint32_t upstream;
+        uint32_t refreshed;
+        uint32_t shed;
+        uint32_t failed;
+    };
+
+private:
+    static const size_t AES_BLOCK_SIZE = 16;
+    static const unsigned long DOOR_TIMEOUT_MS = 2000;     // To receive a whole request
+    static const unsigned long UPSTREAM_TIMEOUT_MS = 4000; // Below the doors' own timeout
+
+    // A badge at a door UUID. Doors sharing a UUID share decisions.
+    struct LookupKey
+    {
+        uint32_t door; // KnownDoor id of the door UUID, 0 if the request was not decrypted
+        uint8_t uidSize;
+        uint8_t uidByte[10];
+    };
+
+    enum DoorState : uint8_t
+    {
+        DOOR_FREE,
+        DOOR_READING,  // Receiving the request
+        DOOR_QUEUED,   // Waiting for the upstream connection
+        DOOR_ATTACHED, // Waiting for the answer to the request upstream
+    };
+
+    struct Door
+    {
+        WiFiClient client;
+        DoorState state;
+        unsigned long since;
+        size_t length;
+        size_t bodyOffset;
+        LookupKey key;
+        char request[REQUEST_SIZE];
+    };
+
+    struct CacheEntry
+    {
+        LookupKey key;
+        unsigned long expires;   // millis()
+        unsigned long refreshAt; // millis(), for hot grants
+        uint16_t status;         // 0 marks a free entry
+        uint8_t hits;          // Since the entry was stored
+        char body[CACHED_BODY_SIZE];
+    };
+
+    // UUID of a door seen recently, needed to rebuild its request
+    struct KnownDoor
+    {
+        uint32_t id; // Given when the UUID is stored, never reused; 0 marks a free slot
+        unsigned long lastSeen;
+        unsigned long lastRefresh;
+        char uuid[37];
+    };
+
+    const char *serverAddress;
+    int serverPort;
+    WiFiServer server;
+    KeyStore keyStore;
+    BridgeTransport upstream;
+    char upstreamResponse[RESPONSE_SIZE];
+    bool upstreamBusy = false;
+    LookupKey upstreamKey;
+    ServerLoad serverLoad;
+    Door doors[MAX_DOORS];
+    CacheEntry cache[PROXY_CACHE_ENTRIES];
+    KnownDoor knownDoors[KNOWN_DOORS];
+    uint32_t nextDoorId = 1;
+    Stats stats = {0, 0, 0, 0, 0, 0, 0};
+
+    static bool sameKey(const LookupKey &a, const LookupKey &b)
+    {
+        return a.door != 0 && a.door == b.door && a.uidSize == b.uidSize &&
+               memcmp(a.uidByte, b.uidByte, a.uidSize) == 0;
+    }
+
+    static const char *reasonPhrase(uint16_t status)
+    {
+        switch (status)
+        {
+        case 200:
+            return "OK";
+        case 401:
+            return "Unauthorized";
+        case 403:
+            return "Forbidden";
+        case 502:
+            return "Bad Gateway";
+        case 503:
+            return "Service Unavailable";
+        case 504:
+            return "Gateway Timeout";
+        default:
+            return "Bad Request";
+        }
+    }
+
+    // Decrypt the UID of a door request to key the cache, leaves key.door at
+    // 0 when the request uses a key the proxy does not hold
+    LookupKey lookupKey(const char *body)
+    {
+        LookupKey key;
+        memset(&key, 0, sizeof(key));
+
+        StaticJsonDocument<JSON_BUFFER_SIZE> doc;
+        if (deserializeJson(doc, (const char *)body))
+        {
+            return key;
+        }
+
+        const char *uuid = doc["UUID"] | "";
+        int keyId = doc["kid"] | -1;
+        const char *ivHex = doc["iv"] | "";
+        const char *content = doc["content"] | "";
+
+        uint8_t iv[AES_BLOCK_SIZE];
+        uint8_t block[AES_BLOCK_SIZE];
+        if (keyId < 0 || strlen(ivHex) != 2 * AES_BLOCK_SIZE || strlen(content) != 2 * AES_BLOCK_SIZE ||
+            !parseHex(ivHex, iv, AES_BLOCK_SIZE) || !parseHex(content, block, AES_BLOCK_SIZE) ||
+            !keyStore.decrypt(keyId, block, AES_BLOCK_SIZE, iv))
+        {
+            return key;
+        }
+
+        // UID of 4 to 10 bytes followed by PKCS7 padding
+        uint8_t padLength = block[AES_BLOCK_SIZE - 1];
+        if (padLength < AES_BLOCK_SIZE - sizeof(key.uidByte) || padLength > AES_BLOCK_SIZE - 4)
+        {
+            return key;
+        }
+        for (size_t i = AES_BLOCK_SIZE - padLength; i < AES_BLOCK_SIZE; i++)
+        {
+            if (block[i] != padLength)
+            {
+                return key;
+            }
+        }
+
+        key.uidSize = AES_BLOCK_SIZE - padLength;
+        memcpy(key.uidByte, block, key.uidSize);
+        key.door = rememberDoor(uuid);
+        return key;
+    }
+
+    KnownDoor *findDoor(uint32_t id)
+    {
+        for (KnownDoor &known : knownDoors)
+        {
+            if (known.id == id)
+            {
+                return &known;
+            }
+        }
+        return nullptr;
+    }
+
+    // Keep the UUID of a door, replacing the one not seen for longest, and
+    // return its id. Doors are told apart by the whole UUID; a replaced slot
+    // gets a new id, so cache entries of the door it held never match again.
+    // Returns 0 for a UUID that cannot be kept, which is then not cached.
+    uint32_t rememberDoor(const char *uuid)
+    {
+        KnownDoor *known = nullptr;
+        for (KnownDoor &candidate : knownDoors)
+        {
+            if (candidate.id != 0 && strcmp(candidate.uuid, uuid) == 0)
+            {
+                known = &candidate;
+                break;
+            }
+        }
+        if (!known)
+        {
+            if (uuid[0] == '\0' || strlen(uuid) >= sizeof(known->uuid))
+            {
+                return 0;
+            }
+
+            known = &knownDoors[0];
+            for (KnownDoor &candidate : knownDoors)
+            {
+                if (candidate.id == 0)
+                {
+                    known = &candidate;
+                    break;
+                }
+                if ((long)(candidate.lastSeen - known->lastSeen) < 0)
+                {
+                    known = &candidate;
+                }
+            }
+
+            known->id = nextDoorId++;
+            if (nextDoorId == 0)
+            {
+                nextDoorId = 1;
+            }
+            known->lastRefresh = millis() - PROXY_REFRESH_INTERVAL_MS;
+            strcpy(known->uuid, uuid);
+        }
+        known->lastSeen = millis();
+        return known->id;
+    }
+
+    // A TTL shortened by a random part of PROXY_TTL_JITTER_PERCENT, never
+    // lengthened, so the TTL stays the bound on how long a decision is reused
+    static unsigned long jitteredTtlMs(unsigned long ttlS)
+    {
+        unsigned long ttlMs = ttlS * 1000UL;
+        return ttlMs - ttlMs / 100 * random(PROXY_TTL_JITTER_PERCENT + 1);
+    }
+
+    CacheEntry *findCached(const LookupKey &key)
+    {
+        long graceMs = serverLoad.overloaded() ? PROXY_OVERLOAD_GRACE_S * 1000L : 0;
+        for (CacheEntry &entry : cache)
+        {
+            if (entry.status != 0 && sameKey(entry.key, key))
+            {
+                if ((long)(millis() - entry.expires) >= graceMs)
+                {
+                    entry.status = 0;
+                    return nullptr;
+                }
+                if (entry.hits < 255)
+                {
+                    entry.hits++;
+                }
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Keep a grant or denial, replacing the entry that expires first
+    void storeDecision(const LookupKey &key, uint16_t status, const char *body)
+    {
+        unsigned long ttl;
+        if (status == 200)
+            ttl = PROXY_GRANT_TTL_S;
+        else if (status == 401 || status == 403)
+            ttl = PROXY_DENY_TTL_S;
+        else
+            return;
+
+        CacheEntry *entry = nullptr;
+        for (CacheEntry &candidate : cache)
+        {
+            if (candidate.status != 0 && sameKey(candidate.key, key))
+            {
+                entry = &candidate;
+                break;
+            }
+            if (!entry || candidate.status == 0 ||
+                (entry->status != 0 && (long)(candidate.expires - entry->expires) < 0))
+            {
+                entry = &candidate;
+            }
+        }
+
+        // A body that does not fit is not cached, a stale entry for the
+        // badge is dropped so a denial always replaces a grant
+        size_t bodyLength = strlen(body);
+        if (bodyLength >= CACHED_BODY_SIZE)
+        {
+            if (sameKey(entry->key, key))
+            {
+                entry->status = 0;
+            }
+            return;
+        }
+
+        entry->key = key;
+        entry->status = status;
+        entry->hits = 0;
+        entry->expires = millis() + jitteredTtlMs(ttl);
+        entry->refreshAt = entry->expires - random(PROXY_REFRESH_AHEAD_S * 1000L + 1);
+        memcpy(entry->body, body, bodyLength + 1);
+    }
+
+    void closeDoor(Door &door)
+    {
+        door.client.stop();
+        door.state = DOOR_FREE;
+    }
+
+    // Answer a door with a short response of our own and close it. A 503
+    // carries the time left before the server may be asked again.
+    void respond(Door &door, uint16_t status, const char *body)
+    {
+        char retryAfter[32] = "";
+        if (status == 503)
+        {
+            snprintf(retryAfter, sizeof(retryAfter), "Retry-After: %lu\r\n", max(serverLoad.retryAfterS(), 1UL));
+        }
+
+        char response[192];
+        int length = snprintf(response, sizeof(response),
+                              "HTTP/1.1 %u %s\r\nContent-Type: text/plain\r\nContent-Length: %u\r\n"
+                              "%sConnection: close\r\n\r\n%s",
+                              status, reasonPhrase(status), (unsigned)strlen(body), retryAfter, body);
+        door.client.write((const uint8_t *)response, min((size_t)length, sizeof(response) - 1));
+        closeDoor(door);
+    }
+
+    void acceptDoors()
+    {
+        WiFiClient client = server.available();
+        if (!client)
+        {
+            return;
+        }
+
+        for (Door &door : doors)
+        {
+            if (door.state != DOOR_FREE && door.client == client)
+            {
+                return;
+            }
+        }
+
+        for (Door &door : doors)
+        {
+            if (door.state == DOOR_FREE)
+            {
+                door.client = client;
+                door.state = DOOR_READING;
+                door.since = millis();
+                door.length = 0;
+                door.bodyOffset = 0;
+                return;
+            }
+        }
+
+        // All slots busy, the door retries on its next tap
+        const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        client.write((const uint8_t *)busy, sizeof(busy) - 1);
+        client.stop();
+        stats.failed++;
+    }
+
+    void readDoor(Door &door)
+    {
+        int n = door.client.read((uint8_t *)door.request + door.length, REQUEST_SIZE - 1 - door.length);
+        if (n > 0)
+        {
+            door.length += n;
+            door.request[door.length] = '\0';
+        }
+
+        if (door.bodyOffset == 0)
+        {
+            const char *end = strstr(door.request, "\r\n\r\n");
+            door.bodyOffset = end ? end + 4 - door.request : 0;
+        }
+
+        if (door.bodyOffset > 0)
+        {
+            const char *contentLength = findHttpHeader(door.request, "Content-Length");
+            size_t expected = door.bodyOffset + (contentLength ? atoi(contentLength) : 0);
+            if (expected >= REQUEST_SIZE)
+            {
+                respond(door, 400, "");
+                stats.failed++;
+                return;
+            }
+            if (door.length >= expected)
+            {
+                handleRequest(door);
+                return;
+            }
+        }
+
+        if (door.length >= REQUEST_SIZE - 1 || millis() - door.since > DOOR_TIMEOUT_MS)
+        {
+            respond(door, 400, "");
+            stats.failed++;
+        }
+    }
+
+    void handleRequest(Door &door)
+    {
+        stats.requests++;
+        door.key = lookupKey(door.request + door.bodyOffset);
+        door.since = millis();
+
+        CacheEntry *cached = findCached(door.key);
+        if (cached)
+        {
+            stats.cacheHits++;
+            respond(door, cached->status, cached->body);
+            return;
+        }
+
+        if (upstreamBusy && sameKey(door.key, upstreamKey))
+        {
+            stats.merged++;
+            door.state = DOOR_ATTACHED;
+            return;
+        }
+        door.state = DOOR_QUEUED;
+    }
+
+    // Send the oldest queued request upstream, with every queued request for
+    // the same badge attached to it
+    void forwardNext()
+    {
+        Door *next = nullptr;
+        for (Door &door : doors)
+        {
+            if (door.state == DOOR_QUEUED && (!next || (long)(door.since - next->since) < 0))
+            {
+                next = &door;
+            }
+        }
+        if (!next)
+        {
+            return;
+        }
+
+        // An answer may have arrived while it was queued
+        CacheEntry *cached = findCached(next->key);
+        if (cached)
+        {
+            stats.cacheHits++;
+            respond(*next, cached->status, cached->body);
+            return;
+        }
+
+        // The server asked for a pause, pass that on instead of the request
+        if (serverLoad.backingOff())
+        {
+            stats.shed++;
+            respond(*next, 503, "");
+            return;
+        }
+
+        upstreamKey = next->key;
+        next->state = DOOR_ATTACHED;
+        for (Door &door : doors)
+        {
+            if (door.state == DOOR_QUEUED && sameKey(door.key, upstreamKey))
+            {
+                stats.merged++;
+                door.state = DOOR_ATTACHED;
+            }
+        }
+
+        if (!sendUpstream(next->request + next->bodyOffset, findHttpHeader(next->request, "X-Trace"), false))
+        {
+            answerAttached(502);
+            return;
+        }
+        stats.upstream++;
+    }
+
+    // Send a request body to the server, reusing the upstream connection
+    // while the server keeps it open. The door's X-Trace header is passed on
+    // so server timings can be matched to the tap. Revalidations are marked
+    // so the server can tell them from taps.
+    bool sendUpstream(const char *body, const char *trace, bool revalidation)
+    {
+        if (!upstream.connected())
+        {
+            upstream.stop();
+            if (!upstream.connect(serverAddress, serverPort))
+            {
+                Serial.println("Proxy upstream connection failed!");
+                return false;
+            }
+        }
+
+        upstream.print("POST / HTTP/1.1\r\nHost: ");
+        upstream.print(serverAddress);
+        upstream.print("\r\nContent-Type: application/json\r\nContent-Length: ");
+        upstream.print(strlen(body));
+        if (trace)
+        {
+            upstream.print("\r\nX-Trace: ");
+            upstream.write((const uint8_t *)trace, strcspn(trace, "\r\n"));
+        }
+        upstream.print(revalidation ? "\r\nX-Revalidate: 1" : "");
+        upstream.print("\r\nConnection: keep-alive\r\n\r\n");
+        upstream.print(body);
+        if (!upstream.sendBuffered())
+        {
+            upstream.stop();
+            return false;
+        }
+
+        upstreamBusy = true;
+        upstream.beginResponse(UPSTREAM_TIMEOUT_MS);
+        return true;
+    }
+
+    // Revalidate the hot grant closest to expiry once its refresh point has
+    // passed, so its doors keep being answered from the cache. Refresh points
+    // are spread over the last PROXY_REFRESH_AHEAD_S of each entry, so grants
+    // cached together are not revalidated together. Only called while no
+    // door request is waiting, and never while the server is overloaded.
+    void refreshNext()
+    {
+        if (serverLoad.overloaded())
+        {
+            return;
+        }
+
+        CacheEntry *due = nullptr;
+        KnownDoor *dueDoor = nullptr;
+        for (CacheEntry &entry : cache)
+        {
+            if (entry.status != 200 || entry.hits < PROXY_REFRESH_MIN_HITS ||
+                (long)(millis() - entry.refreshAt) < 0 || (long)(millis() - entry.expires) >= 0 ||
+                (due && (long)(entry.expires - due->expires) >= 0))
+            {
+                continue;
+            }
+
+            KnownDoor *known = findDoor(entry.key.door);
+            if (known && millis() - known->lastRefresh >= PROXY_REFRESH_INTERVAL_MS)
+            {
+                due = &entry;
+                dueDoor = known;
+            }
+        }
+        if (!due)
+        {
+            return;
+        }
+
+        // Rebuild the door's request under the current key
+        uint8_t iv[AES_BLOCK_SIZE];
+        uint8_t block[AES_BLOCK_SIZE];
+        if (!SecureRandom::fillBlock(iv))
+        {
+            return;
+        }
+        uint8_t padLength = AES_BLOCK_SIZE - due->key.uidSize;
+        memcpy(block, due->key.uidByte, due->key.uidSize);
+        memset(block + due->key.uidSize, padLength, padLength);
+
+        char ivHex[2 * AES_BLOCK_SIZE + 1];
+        char content[2 * AES_BLOCK_SIZE + 1];
+        writeHex(ivHex, iv, AES_BLOCK_SIZE);
+        ivHex[2 * AES_BLOCK_SIZE] = '\0';
+        keyStore.encrypt(block, AES_BLOCK_SIZE, iv);
+        writeHex(content, block, AES_BLOCK_SIZE);
+        content[2 * AES_BLOCK_SIZE] = '\0';
+
+        StaticJsonDocument<JSON_BUFFER_SIZE> doc;
+        doc["UUID"] = (const char *)dueDoor->uuid;
+        doc["kid"] = keyStore.currentKeyId();
+        doc["iv"] = (const char *)ivHex;
+        doc["content"] = (const char *)content;
+
+        char body[JSON_BUFFER_SIZE];
+        if (serializeJson(doc, body, sizeof(body)) >= sizeof(body) - 1)
+        {
+            return;
+        }
+
+        // A failed refresh is not retried before the interval, the entry
+        // then simply expires
+        dueDoor->lastRefresh = millis();
+        upstreamKey = due->key;
+        if (sendUpstream(body, nullptr, true))
+        {
+            stats.refreshed++;
+        }
+    }
+
+    // Answer every door waiting on the upstream request with an error
+    void answerAttached(uint16_t status)
+    {
+        for (Door &door : doors)
+        {
+            if (door.state == DOOR_ATTACHED)
+            {
+                stats.failed++;
+                respond(door, status, "");
+            }
+        }
+    }
+
+    void serviceUpstream()
+    {
+        BridgeTransport::ResponseStatus status = upstream.pollResponse(upstreamResponse, RESPONSE_SIZE);
+        if (status == BridgeTransport::RESPONSE_PENDING)
+        {
+            return;
+        }
+
+        upstreamBusy = false;
+        if (status == BridgeTransport::RESPONSE_TIMEOUT)
+        {
+            Serial.println("Proxy upstream timeout!");
+            upstream.stop();
+            serverLoad.recordTimeout();
+            answerAttached(504);
+            return;
+        }
+        if (!upstream.responseComplete())
+        {
+            // Cut off by the buffer, the timeout or a close, or without a
+            // Content-Length to tell: neither relayed, cached nor trusted for
+            // key rotations, and the rest of it must not reach the next request
+            Serial.println("Proxy upstream response incomplete!");
+            upstream.stop();
+            answerAttached(502);
+            return;
+        }
+        serverLoad.update(upstreamResponse);
+
+        const char *connection = findHttpHeader(upstreamResponse, "Connection");
+        if (connection && strncasecmp(connection, "close", 5) == 0)
+        {
+            upstream.stop();
+        }
+
+        // Follow key rotations so later requests can still be decrypted
+        keyStore.applyRotationHeaders(upstreamResponse);
+
+        const char *body = strstr(upstreamResponse, "\r\n\r\n");
+        if (upstreamKey.door != 0 && body && strncmp(upstreamResponse, "HTTP/1.", 7) == 0)
+        {
+            storeDecision(upstreamKey, atoi(upstreamResponse + 9), body + 4);
+        }
+
+        // Relay the server's answer as is, headers included
+        size_t length = strlen(upstreamResponse);
+        for (Door &door : doors)
+        {
+            if (door.state == DOOR_ATTACHED)
+            {
+                door.client.write((const uint8_t *)upstreamResponse, length);
+                closeDoor(door);
+            }
+        }
+    }
+
+public:
+    AuthProxy(const char *host, int port, uint16_t listenPort)
+        : serverAddress(host), serverPort(port), server(listenPort)
+    {
+        memset(&upstreamKey, 0, sizeof(upstreamKey));
+        memset(cache, 0, sizeof(cache));
+        memset(knownDoors, 0, sizeof(knownDoors));
+        for (Door &door : doors)
+        {
+            door.state = DOOR_FREE;
+        }
+    }
+
+    // Load the request keys and start listening, call once WiFi is up
+    void begin()
+    {
+        keyStore.begin();
+        server.begin();
+
+        // Proxies restarted together after a power cut must not jitter alike
+        uint8_t seed[AES_BLOCK_SIZE];
+        if (SecureRandom::fillBlock(seed))
+        {
+            uint32_t value;
+            memcpy(&value, seed, sizeof(value));
+            randomSeed(value);
+        }
+    }
+
+    // Accept and read door requests, answer from the cache or forward them,
+    // and revalidate hot grants in between. Never waits, call from loop().
+    void service()
+    {
+        acceptDoors();
+
+        for (Door &door : doors)
+        {
+            if (door.state == DOOR_READING)
+            {
+                readDoor(door);
+            }
+        }
+
+        if (upstreamBusy)
+        {
+            serviceUpstream();
+        }
+        if (!upstreamBusy)
+        {
+            forwardNext();
+        }
+        if (!upstreamBusy)
+        {
+            refreshNext();
+        }
+    }
+
+    const Stats &statistics() const
+    {
+        return stats;
+    }
+};
+
+#endif
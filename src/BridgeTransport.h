@@ -0,0 +1,296 @@
+#ifndef BridgeTransport_h
+#define BridgeTransport_h
+
+#include <Arduino.h>
+#include <WiFiS3.h>
+
+// Largest single read the WiFiS3 modem bridge answers in one transaction
+#ifndef BRIDGE_RX_CHUNK_SIZE
+#define BRIDGE_RX_CHUNK_SIZE 256
+#endif
+
+// Request transport for the UNO R4 WiFi. Every WiFiClient call is an AT
+// command exchange with the ESP32-S3 over UART, so outgoing data is collected
+// in RAM and sent with one write, and the response is pulled in large chunks
+// with a backing-off wait instead of spinning on available(). Responses can
+// be collected without blocking through beginResponse() and pollResponse().
+class BridgeTransport : public Print
+{
+public:
+    static const size_t TX_BUFFER_SIZE = 384;
+    static const size_t RX_CHUNK_SIZE = BRIDGE_RX_CHUNK_SIZE;
+    static const unsigned long MIN_POLL_INTERVAL_MS = 1;
+    static const unsigned long MAX_POLL_INTERVAL_MS = 16;
+
+    enum ResponseStatus
+    {
+        RESPONSE_PENDING,
+        RESPONSE_COMPLETE,
+        RESPONSE_TIMEOUT
+    };
+
+private:
+    WiFiClient client;
+    uint8_t txBuffer[TX_BUFFER_SIZE];
+    size_t txLength = 0;
+    bool txFailed = false;
+    uint16_t transactions = 0;
+
+    // Progress of the response being collected
+    size_t rxLength = 0;
+    size_t rxHeaderEnd = 0;
+    long rxContentLength = -1;
+    bool rxComplete = false;
+    unsigned long rxStart = 0;
+    unsigned long rxFirstByte = 0;
+    unsigned long rxTimeout = 0;
+    unsigned long rxNextPoll = 0;
+    unsigned long rxPollInterval = MIN_POLL_INTERVAL_MS;
+
+    // Find the end of the HTTP header block, returns 0 if not yet received
+    static size_t findHeaderEnd(const char *data, size_t length)
+    {
+        for (size_t i = 3; i < length; i++)
+        {
+            if (data[i - 3] == '\r' && data[i - 2] == '\n' && data[i - 1] == '\r' && data[i] == '\n')
+            {
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+    // Parse Content-Length from a header block, returns -1 if absent
+    static long parseContentLength(const char *data, size_t headerLength)
+    {
+        static const char name[] = "content-length:";
+        const size_t nameLength = sizeof(name) - 1;
+
+        for (size_t i = 0; i + nameLength < headerLength; i++)
+        {
+            if (i > 0 && data[i - 1] != '\n')
+            {
+                continue;
+            }
+
+            size_t j = 0;
+            while (j < nameLength && tolower((unsigned char)data[i + j]) == name[j])
+            {
+                j++;
+            }
+
+            if (j == nameLength)
+            {
+                return strtol(data + i + nameLength, nullptr, 10);
+            }
+        }
+        return -1;
+    }
+
+public:
+    bool connect(const char *host, uint16_t port)
+    {
+        txLength = 0;
+        txFailed = false;
+        transactions++;
+        return client.connect(host, port);
+    }
+
+    // Connect to an address resolved beforehand, without a DNS lookup
+    bool connect(const IPAddress &address, uint16_t port)
+    {
+        txLength = 0;
+        txFailed = false;
+        transactions++;
+        return client.connect(address, port);
+    }
+
+    // Buffer a byte for the next send
+    size_t write(uint8_t c) override
+    {
+        return write(&c, 1);
+    }
+
+    // Buffer data for the next send, pushing a full buffer across the bridge
+    size_t write(const uint8_t *data, size_t size) override
+    {
+        size_t written = 0;
+        while (written < size)
+        {
+            if (txLength == TX_BUFFER_SIZE)
+            {
+                sendBuffered();
+            }
+
+            size_t chunk = min(size - written, TX_BUFFER_SIZE - txLength);
+            memcpy(txBuffer + txLength, data + written, chunk);
+            txLength += chunk;
+            written += chunk;
+        }
+        return written;
+    }
+
+    using Print::write;
+
+    // Send everything buffered so far in a single bridge write
+    bool sendBuffered()
+    {
+        if (txLength == 0)
+        {
+            return !txFailed;
+        }
+
+        transactions++;
+        size_t sent = client.write(txBuffer, txLength);
+        if (sent != txLength)
+        {
+            txFailed = true;
+        }
+        txLength = 0;
+        return !txFailed;
+    }
+
+    void flush() override
+    {
+        sendBuffered();
+    }
+
+    // Start collecting an HTTP response, see pollResponse()
+    void beginResponse(unsigned long timeoutMs)
+    {
+        rxLength = 0;
+        rxHeaderEnd = 0;
+        rxContentLength = -1;
+        rxComplete = false;
+        rxTimeout = timeoutMs;
+        rxStart = millis();
+        rxNextPoll = rxStart;
+        rxPollInterval = MIN_POLL_INTERVAL_MS;
+    }
+
+    // Make at most one read attempt towards the response started with
+    // beginResponse(), never waits. Reading stops once the body announced by
+    // Content-Length is complete, the server closes, or the buffer is full.
+    ResponseStatus pollResponse(char *buffer, size_t size)
+    {
+        if ((long)(millis() - rxNextPoll) < 0)
+        {
+            return RESPONSE_PENDING;
+        }
+
+        transactions++;
+        int n = client.read((uint8_t *)buffer + rxLength, min(size - 1 - rxLength, RX_CHUNK_SIZE));
+
+        if (n > 0)
+        {
+            if (rxLength == 0)
+            {
+                rxFirstByte = millis();
+            }
+            rxLength += n;
+            buffer[rxLength] = '\0';
+            rxPollInterval = MIN_POLL_INTERVAL_MS;
+            rxNextPoll = millis();
+
+            if (rxHeaderEnd == 0)
+            {
+                rxHeaderEnd = findHeaderEnd(buffer, rxLength);
+                if (rxHeaderEnd > 0)
+                {
+                    rxContentLength = parseContentLength(buffer, rxHeaderEnd);
+                }
+            }
+
+            bool bodyComplete = rxHeaderEnd > 0 && rxContentLength >= 0 &&
+                                rxLength >= rxHeaderEnd + (size_t)rxContentLength;
+            rxComplete = bodyComplete;
+            if (bodyComplete || rxLength >= size - 1)
+            {
+                return RESPONSE_COMPLETE;
+            }
+            return RESPONSE_PENDING;
+        }
+
+        buffer[rxLength] = '\0';
+
+        // Only ask the modem about the socket state once data has started
+        // arriving, a server that has not answered yet is simply waited on
+        if (rxLength > 0)
+        {
+            transactions++;
+            if (!client.connected())
+            {
+                return RESPONSE_COMPLETE;
+            }
+        }
+
+        if (millis() - rxStart > rxTimeout)
+        {
+            return rxLength > 0 ? RESPONSE_COMPLETE : RESPONSE_TIMEOUT;
+        }
+
+        rxNextPoll = millis() + rxPollInterval;
+        rxPollInterval = min(rxPollInterval * 2, MAX_POLL_INTERVAL_MS);
+        return RESPONSE_PENDING;
+    }
+
+    // Blocking variant of pollResponse(). Returns the number of bytes read,
+    // or -1 on timeout with nothing read.
+    int readResponse(char *buffer, size_t size, unsigned long timeoutMs)
+    {
+        beginResponse(timeoutMs);
+
+        ResponseStatus status;
+        while ((status = pollResponse(buffer, size)) == RESPONSE_PENDING)
+        {
+            yield();
+        }
+
+        if (status == RESPONSE_TIMEOUT)
+        {
+            return -1;
+        }
+        return rxLength;
+    }
+
+    // millis() at which the first bytes of the current response arrived
+    unsigned long firstByteTime() const
+    {
+        return rxFirstByte;
+    }
+
+    // Whether the response collected by pollResponse() holds the whole body
+    // announced by Content-Length. False when it ended because the buffer
+    // filled, on timeout or close, or without a Content-Length header.
+    bool responseComplete() const
+    {
+        return rxComplete;
+    }
+
+    // Whether the connection is still open, e.g. to reuse it for the next
+    // request on a keep-alive connection
+    bool connected()
+    {
+        transactions++;
+        return client.connected();
+    }
+
+    void stop()
+    {
+        transactions++;
+        client.stop();
+        txLength = 0;
+    }
+
+    void resetTransactionCount()
+    {
+        transactions = 0;
+    }
+
+    uint16_t transactionCount() const
+    {
+        return transactions;
+    }
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef CaptureDeduplicator_h
+#define CaptureDeduplicator_h
+
+#include <Arduino.h>
+
+// Cheap JPEG fingerprint fed byte by byte from the camera FIFO: an FNV-1a
+// hash of the first bytes of entropy-coded data after the SOS header. Only
+// the JPEG headers and the start of the scan are ever read.
+class FrameFingerprint
+{
+public:
+    static const uint16_t SCAN_HASH_BYTES = 256;  // Scan bytes covered by the hash
+    static const uint16_t MAX_PREFIX_BYTES = 2048; // Give up if no scan starts before this
+
+private:
+    enum State
+    {
+        FIND_SOS,
+        SOS_LENGTH_HIGH,
+        SOS_LENGTH_LOW,
+        SKIP_SOS_HEADER,
+        HASH_SCAN,
+        DONE
+    };
+
+    State state = FIND_SOS;
+    uint8_t lastByte = 0;
+    uint16_t remaining = 0;
+    uint16_t consumed = 0;
+    uint32_t value = 0;
+
+public:
+    void begin()
+    {
+        state = FIND_SOS;
+        lastByte = 0;
+        remaining = 0;
+        consumed = 0;
+        value = 2166136261UL;
+    }
+
+    // Feed the next frame byte, returns true once no more bytes are needed
+    bool feed(uint8_t b)
+    {
+        consumed++;
+        switch (state)
+        {
+        case FIND_SOS:
+            if (lastByte == 0xFF && b == 0xDA)
+            {
+                state = SOS_LENGTH_HIGH;
+            }
+            break;
+        case SOS_LENGTH_HIGH:
+            remaining = (uint16_t)b << 8;
+            state = SOS_LENGTH_LOW;
+            break;
+        case SOS_LENGTH_LOW:
+            // The segment length counts its own two bytes
+            remaining = (remaining | b) - 2;
+            state = remaining > 0 ? SKIP_SOS_HEADER : HASH_SCAN;
+            if (state == HASH_SCAN)
+            {
+                remaining = SCAN_HASH_BYTES;
+            }
+            break;
+        case SKIP_SOS_HEADER:
+            if (--remaining == 0)
+            {
+                state = HASH_SCAN;
+                remaining = SCAN_HASH_BYTES;
+            }
+            break;
+        case HASH_SCAN:
+            value = (value ^ b) * 16777619UL;
+            if (--remaining == 0)
+            {
+                state = DONE;
+            }
+            break;
+        case DONE:
+            break;
+        }
+
+        lastByte = b;
+        if (state != DONE && state != HASH_SCAN && consumed >= MAX_PREFIX_BYTES)
+        {
+            state = DONE;
+            value = 0;
+        }
+        return state == DONE;
+    }
+
+    // Hash of the first scan segment, 0 when the frame had none
+    uint32_t hash() const
+    {
+        return state == DONE ? value : 0;
+    }
+};
+
+// Remembers the last few incident captures per badge, so a badge tapped
+// again and again in front of the same scene does not produce a new pair of
+// files every time.
+class CaptureDeduplicator
+{
+public:
+    static const uint8_t RECENT_CAPTURES = 4;
+    static const unsigned long WINDOW_MS = 600000;   // 10 minutes
+    static const uint8_t SIZE_TOLERANCE_PERCENT = 3; // JPEG size may differ this much
+
+    struct Capture
+    {
+        uint64_t badge; // UID fingerprint, 0 marks a free slot
+        uint32_t jpegSize;
+        uint32_t scanHash;
+        unsigned long time;
+        char basePath[20];
+    };
+
+private:
+    Capture captures[RECENT_CAPTURES];
+    uint8_t next = 0;
+
+public:
+    CaptureDeduplicator()
+    {
+        memset(captures, 0, sizeof(captures));
+    }
+
+    // Path of an earlier capture of the same badge and scene, or nullptr
+    const char *findDuplicate(uint64_t badge, uint32_t jpegSize, uint32_t scanHash, unsigned long now) const
+    {
+        if (scanHash == 0)
+        {
+            return nullptr;
+        }
+
+        for (const Capture &capture : captures)
+        {
+            if (capture.badge != badge)
+            {
+                continue;
+            }
+
+            uint32_t difference = capture.jpegSize > jpegSize ? capture.jpegSize - jpegSize : jpegSize - capture.jpegSize;
+            if (now - capture.time <= WINDOW_MS && capture.scanHash == scanHash &&
+                difference * 100 <= capture.jpegSize * SIZE_TOLERANCE_PERCENT)
+            {
+                return capture.basePath;
+            }
+        }
+        return nullptr;
+    }
+
+    void remember(uint64_t badge, uint32_t jpegSize, uint32_t scanHash, unsigned long now, const char *basePath)
+    {
+        Capture &capture = captures[next];
+        next = (next + 1) % RECENT_CAPTURES;
+
+        capture.badge = badge;
+        capture.jpegSize = jpegSize;
+        capture.scanHash = scanHash;
+        capture.time = now;
+        strncpy(capture.basePath, basePath, sizeof(capture.basePath) - 1);
+        capture.basePath[sizeof(capture.basePath) - 1] = '\0';
+    }
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef Cmac_h
+#define Cmac_h
+
+#include <Arduino.h>
+#include <ArduinoBearSSL.h>
+
+// AES-128-CMAC (RFC 4493) over short messages, built on the BearSSL CBC
+// encryptor: CMAC is the last block of CBC-MAC after the final block is
+// masked with a subkey derived from the key.
+class Cmac
+{
+public:
+    static const size_t BLOCK_SIZE = 16;
+    static const size_t MAX_MESSAGE_SIZE = 64;
+
+private:
+    br_aes_ct_cbcenc_keys schedule;
+    uint8_t subkey1[BLOCK_SIZE];
+    uint8_t subkey2[BLOCK_SIZE];
+
+    // Doubling in GF(2^128) as used for the CMAC subkeys
+    static void doubleBlock(const uint8_t *in, uint8_t *out)
+    {
+        uint8_t carry = in[0] >> 7;
+        for (size_t i = 0; i < BLOCK_SIZE - 1; i++)
+        {
+            out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+        }
+        out[BLOCK_SIZE - 1] = (in[BLOCK_SIZE - 1] << 1) ^ (carry ? 0x87 : 0x00);
+    }
+
+public:
+    void begin(const uint8_t *key)
+    {
+        br_aes_ct_cbcenc_init(&schedule, key, BLOCK_SIZE);
+
+        uint8_t zero[BLOCK_SIZE] = {0};
+        uint8_t iv[BLOCK_SIZE] = {0};
+        br_aes_ct_cbcenc_run(&schedule, iv, zero, BLOCK_SIZE);
+        doubleBlock(zero, subkey1);
+        doubleBlock(subkey1, subkey2);
+    }
+
+    // Tag of a message of at most MAX_MESSAGE_SIZE bytes
+    bool compute(const void *message, size_t size, uint8_t *tag) const
+    {
+        if (size > MAX_MESSAGE_SIZE)
+        {
+            return false;
+        }
+
+        uint8_t buffer[MAX_MESSAGE_SIZE];
+        size_t blocks = size == 0 ? 1 : (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t padded = blocks * BLOCK_SIZE;
+        memcpy(buffer, message, size);
+
+        // A complete last block is masked with K1, a padded one with K2
+        const uint8_t *subkey = subkey1;
+        if (size != padded)
+        {
+            memset(buffer + size, 0, padded - size);
+            buffer[size] = 0x80;
+            subkey = subkey2;
+        }
+        for (size_t i = 0; i < BLOCK_SIZE; i++)
+        {
+            buffer[padded - BLOCK_SIZE + i] ^= subkey[i];
+        }
+
+        uint8_t iv[BLOCK_SIZE] = {0};
+        br_aes_ct_cbcenc_run(&schedule, iv, buffer, padded);
+        memcpy(tag, buffer + padded - BLOCK_SIZE, BLOCK_SIZE);
+        return true;
+    }
+
+    // Check a tag in constant time
+    bool verify(const void *message, size_t size, const uint8_t *tag) const
+    {
+        uint8_t expected[BLOCK_SIZE];
+        if (!compute(message, size, expected))
+        {
+            return false;
+        }
+
+        uint8_t difference = 0;
+        for (size_t i = 0; i < BLOCK_SIZE; i++)
+        {
+            difference |= expected[i] ^ tag[i];
+        }
+        return difference == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef DecisionCache_h
+#define DecisionCache_h
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include "PersistentLayout.h"
+
+#ifndef DECISION_CACHE_ENTRIES
+#define DECISION_CACHE_ENTRIES 16
+#endif
+
+// Recent grants the server signed for a badge. A badge that was approved
+// repeatedly and still holds a valid signed decision is trusted for a
+// provisional grant when the server is slow. Badges are UID fingerprints
+// (see UidFingerprint) and times are RTC seconds, so the cache can be saved
+// to data flash without UIDs and stays meaningful after a restart.
+class DecisionCache
+{
+public:
+    static const uint8_t TRUSTED_APPROVALS = 2;     // Approvals needed before a badge is trusted
+    static const uint32_t RECENT_APPROVAL_S = 86400; // Last approval must be this recent
+
+    struct Entry
+    {
+        uint64_t badge; // 0 marks a free entry
+        uint32_t lastApproved;
+        uint32_t validUntil;
+        uint8_t approvals;
+    };
+
+private:
+    static const uint32_t RECORD_MAGIC = 0x44434332; // "DCC2"
+
+    Entry entries[DECISION_CACHE_ENTRIES];
+
+    static_assert(EEPROM_DECISION_CACHE_ADDR + 2 * sizeof(uint32_t) + sizeof(Entry) * DECISION_CACHE_ENTRIES <=
+                      EEPROM_DECISION_CACHE_END,
+                  "Decision cache does not fit its data flash record");
+
+    Entry *find(uint64_t badge)
+    {
+        for (Entry &entry : entries)
+        {
+            if (entry.badge == badge)
+            {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    DecisionCache()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        memset(entries, 0, sizeof(entries));
+    }
+
+    // Remember a signed grant, replacing the least recently approved badge
+    void recordGrant(uint64_t badge, uint32_t now, uint32_t validUntil)
+    {
+        Entry *entry = find(badge);
+        if (!entry)
+        {
+            entry = &entries[0];
+            for (Entry &candidate : entries)
+            {
+                if (candidate.badge == 0)
+                {
+                    entry = &candidate;
+                    break;
+                }
+                if (candidate.lastApproved < entry->lastApproved)
+                {
+                    entry = &candidate;
+                }
+            }
+
+            memset(entry, 0, sizeof(Entry));
+            entry->badge = badge;
+        }
+
+        if (entry->approvals < 255)
+        {
+            entry->approvals++;
+        }
+        entry->lastApproved = now;
+        entry->validUntil = validUntil;
+    }
+
+    // Drop a badge after a denial
+    void revoke(uint64_t badge)
+    {
+        Entry *entry = find(badge);
+        if (entry)
+        {
+            memset(entry, 0, sizeof(Entry));
+        }
+    }
+
+    // Whether the badge may be granted provisionally. graceS extends the
+    // signed validity, e.g. while the server asks devices to shed load.
+    bool isTrusted(uint64_t badge, uint32_t now, uint32_t graceS = 0)
+    {
+        Entry *entry = find(badge);
+        return entry && entry->approvals >= TRUSTED_APPROVALS &&
+               now < entry->validUntil + graceS && now - entry->lastApproved <= RECENT_APPROVAL_S;
+    }
+
+    void save()
+    {
+        uint32_t magic = RECORD_MAGIC;
+        uint32_t checksum = recordChecksum(entries, sizeof(entries));
+        EEPROM.put(EEPROM_DECISION_CACHE_ADDR, magic);
+        EEPROM.put(EEPROM_DECISION_CACHE_ADDR + sizeof(magic), entries);
+        EEPROM.put(EEPROM_DECISION_CACHE_ADDR + sizeof(magic) + sizeof(entries), checksum);
+    }
+
+    bool load()
+    {
+        uint32_t magic, checksum;
+        EEPROM.get(EEPROM_DECISION_CACHE_ADDR, magic);
+        EEPROM.get(EEPROM_DECISION_CACHE_ADDR + sizeof(magic), entries);
+        EEPROM.get(EEPROM_DECISION_CACHE_ADDR + sizeof(magic) + sizeof(entries), checksum);
+
+        if (magic != RECORD_MAGIC || checksum != recordChecksum(entries, sizeof(entries)))
+        {
+            clear();
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef DnsCache_h
+#define DnsCache_h
+
+#include <Arduino.h>
+#include <WiFiS3.h>
+
+#ifndef DNS_CACHE_TTL_S
+#define DNS_CACHE_TTL_S 300 // The modem's resolver does not report record TTLs
+#endif
+#ifndef DNS_REFRESH_AHEAD_S
+#define DNS_REFRESH_AHEAD_S 60
+#endif
+// A failed lookup is not cheap: WiFi.hostByName() blocks the caller until
+// the modem's resolver gives up, several seconds while DNS is down. Retries
+// start DNS_RETRY_S apart and the wait doubles with every further failure,
+// up to DNS_RETRY_MAX_S, so an outage costs a stall now and then rather
+// than one every DNS_RETRY_S.
+#ifndef DNS_RETRY_S
+#define DNS_RETRY_S 30
+#endif
+#ifndef DNS_RETRY_MAX_S
+#define DNS_RETRY_MAX_S 480
+#endif
+
+// Cached address of one host name. Every WiFiClient::connect() by name
+// resolves through the modem first, adding a DNS round trip to each request
+// and failing outright while DNS is down. The cache resolves once, refreshes
+// ahead of expiry from refresh() while the caller is idle, and keeps serving
+// the last known address when a refresh fails or the address expires, so
+// only the very first lookup can stall a request. A literal IP address is
+// never resolved. Times are millis().
+class DnsCache
+{
+private:
+    const char *host = nullptr;
+    IPAddress address;
+    bool literal = false;
+    bool known = false;
+    bool refreshDue = false;
+    unsigned long resolvedAt = 0;
+    unsigned long lastAttempt = 0;
+    unsigned long lastResolveMs = 0;
+    uint16_t failures = 0; // Consecutive failed lookups
+
+    bool resolve()
+    {
+        lastAttempt = millis();
+        IPAddress resolved;
+        bool ok = WiFi.hostByName(host, resolved) == 1 && resolved != IPAddress(0, 0, 0, 0);
+        lastResolveMs = millis() - lastAttempt;
+        if (!ok)
+        {
+            failures++;
+            Serial.print("DNS lookup of ");
+            Serial.print(host);
+            Serial.println(known ? " failed, using the last known address" : " failed");
+            return false;
+        }
+
+        if (!known || resolved != address)
+        {
+            Serial.print("DNS: ");
+            Serial.print(host);
+            Serial.print(" is ");
+            Serial.println(resolved.toString());
+        }
+        address = resolved;
+        known = true;
+        refreshDue = false;
+        failures = 0;
+        resolvedAt = lastAttempt;
+        return true;
+    }
+
+    // Wait after the last attempt before the next one
+    unsigned long retryInterval() const
+    {
+        uint16_t doublings = failures > 1 ? min(failures - 1, 8) : 0;
+        return min((DNS_RETRY_S * 1000UL) << doublings, DNS_RETRY_MAX_S * 1000UL);
+    }
+
+public:
+    void begin(const char *name)
+    {
+        host = name;
+        literal = address.fromString(name);
+        known = literal;
+    }
+
+    // Address to connect to. Resolves on the spot only when no address is
+    // known yet; an expired one is still served and left to refresh().
+    // resolveMs is the time spent resolving, 0 for a cache hit.
+    bool lookup(IPAddress &out, unsigned long &resolveMs)
+    {
+        resolveMs = 0;
+        if (!literal && !known)
+        {
+            resolve();
+            resolveMs = lastResolveMs;
+        }
+        out = address;
+        return known;
+    }
+
+    // Resolve ahead of expiry, call while idle. Returns true if a lookup
+    // ran, its time is in lastLookupMs().
+    bool refresh()
+    {
+        if (literal || host == nullptr)
+        {
+            return false;
+        }
+        bool expiring = !known || refreshDue ||
+                        millis() - resolvedAt >= (DNS_CACHE_TTL_S - DNS_REFRESH_AHEAD_S) * 1000UL;
+        if (!expiring || (lastAttempt != 0 && millis() - lastAttempt < retryInterval()))
+        {
+            return false;
+        }
+        resolve();
+        return true;
+    }
+
+    // The cached address refused a connection, e.g. the server moved.
+    // It is still used until a refresh succeeds.
+    void connectFailed()
+    {
+        refreshDue = !literal;
+    }
+
+    unsigned long lastLookupMs() const
+    {
+        return lastResolveMs;
+    }
+
+    // Whether the address is past its TTL, served because DNS fails
+    bool stale() const
+    {
+        return !literal && known && millis() - resolvedAt >= DNS_CACHE_TTL_S * 1000UL;
+    }
+
+    uint16_t failedLookups() const
+    {
+        return failures;
+    }
+};
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef FirmwareUpdater_h
+#define FirmwareUpdater_h
+
+#include <Arduino.h>
+#include <ArduinoBearSSL.h>
+#include <WiFiFileSystem.h>
+#include <WiFiS3.h>
+
+#include "MemoryBudget.h"
+
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION 1
+#endif
+
+// Stages a new sketch image in the inactive region (the ESP32-S3 modem's
+// flash) while the door keeps serving taps, then switches to it at a quiet
+// moment. The sketch downloads the image itself in short slices, hashes
+// every chunk and appends that same chunk to the staging file on the
+// modem's file system, one bridge transaction each. Offers come with a
+// SHA-256 digest the server signed (see RFIDAuth::firmwareOffer()), so the
+// file the modem later installs is exactly the bytes that were hashed, and
+// only a file matching the signed digest can be switched to.
+class FirmwareUpdater
+{
+public:
+    static const size_t URL_SIZE = 96;
+    static const size_t DIGEST_SIZE = br_sha256_SIZE;
+    static const unsigned long QUIET_TIME_MS = 30000;
+
+    enum State
+    {
+        IDLE,
+        DOWNLOADING,
+        STAGED,
+        FAILED
+    };
+
+private:
+    static constexpr const char *STAGE_PATH = "/update.bin";
+    static const size_t CHUNK_SIZE = 256; // Image bytes hashed and staged per service() call
+    static const unsigned long DOWNLOAD_TIMEOUT_MS = 10000;
+
+    OTAUpdate ota;
+    WiFiFileSystem modemFiles;
+    State state = IDLE;
+    uint16_t version = 0;
+    char url[URL_SIZE];
+    uint8_t expectedDigest[DIGEST_SIZE];
+    unsigned long lastData = 0;
+
+    WiFiClient client;
+    br_sha256_context sha;
+    uint32_t imageBytes = 0;
+    uint8_t headerMatch = 0; // Bytes of the "\r\n\r\n" ending the HTTP headers seen
+    char status[13];
+
+    // Request the image over plain HTTP, "http://host[:port]/path"
+    bool requestImage()
+    {
+        if (strncmp(url, "http://", 7) != 0)
+        {
+            return false;
+        }
+        const char *host = url + 7;
+        const char *path = strchr(host, '/');
+        size_t hostLength = path ? (size_t)(path - host) : strlen(host);
+        char hostName[64];
+        const char *colon = (const char *)memchr(host, ':', hostLength);
+        size_t nameLength = colon ? (size_t)(colon - host) : hostLength;
+        if (nameLength == 0 || nameLength >= sizeof(hostName))
+        {
+            return false;
+        }
+        memcpy(hostName, host, nameLength);
+        hostName[nameLength] = '\0';
+        uint16_t port = colon ? atoi(colon + 1) : 80;
+
+        if (!client.connect(hostName, port))
+        {
+            return false;
+        }
+        client.print("GET ");
+        client.print(path ? path : "/");
+        client.print(" HTTP/1.0\r\nHost: ");
+        client.print(hostName);
+        client.print("\r\nConnection: close\r\n\r\n");
+
+        br_sha256_init(&sha);
+        imageBytes = 0;
+        headerMatch = 0;
+        lastData = millis();
+        return true;
+    }
+
+    // Take the next slice of the response, skipping the HTTP headers. The
+    // image bytes are hashed and appended to the staging file as they are.
+    void downloadSlice()
+    {
+        uint8_t chunk[CHUNK_SIZE];
+        int length = client.available() > 0 ? client.read(chunk, sizeof(chunk)) : 0;
+        if (length > 0)
+        {
+            lastData = millis();
+        }
+
+        // Skip the headers, keeping the "HTTP/1.x 200" status line start
+        int offset = 0;
+        while (headerMatch < 4 && offset < length)
+        {
+            char c = chunk[offset++];
+            if (imageBytes < sizeof(status) - 1)
+            {
+                status[imageBytes++] = c;
+            }
+            headerMatch = c == "\r\n\r\n"[headerMatch] ? headerMatch + 1 : (c == '\r' ? 1 : 0);
+            if (headerMatch == 4)
+            {
+                status[imageBytes] = '\0';
+                imageBytes = 0;
+                if (strncmp(status + 8, " 200", 4) != 0)
+                {
+                    return finishDownload(false, "image server refused");
+                }
+            }
+        }
+        if (headerMatch == 4 && offset < length)
+        {
+            size_t size = length - offset;
+            if (modemFiles.writefile(STAGE_PATH, (const char *)chunk + offset, size, WIFI_FILE_APPEND) != size)
+            {
+                return finishDownload(false, "staging file write failed");
+            }
+            br_sha256_update(&sha, chunk + offset, size);
+            imageBytes += size;
+        }
+
+        if (length <= 0 && !client.connected())
+        {
+            uint8_t digest[DIGEST_SIZE];
+            br_sha256_out(&sha, digest);
+            uint8_t difference = 0;
+            for (size_t i = 0; i < DIGEST_SIZE; i++)
+            {
+                difference |= digest[i] ^ expectedDigest[i];
+            }
+            if (headerMatch != 4 || imageBytes == 0 || difference != 0)
+            {
+                finishDownload(false, "digest mismatch");
+            }
+            else
+            {
+                // The container checksum as well, before it can be switched to
+                finishDownload(ota.verify() == 0, "container checksum mismatch");
+            }
+        }
+        else if (millis() - lastData > DOWNLOAD_TIMEOUT_MS)
+        {
+            finishDownload(false, "image server timed out");
+        }
+    }
+
+    void finishDownload(bool ok, const char *reason)
+    {
+        client.stop();
+        if (ok)
+        {
+            Serial.print("Firmware version ");
+            Serial.print(version);
+            Serial.println(" staged and verified");
+            state = STAGED;
+        }
+        else
+        {
+            Serial.print("Firmware image rejected: ");
+            Serial.println(reason);
+            modemFiles.writefile(STAGE_PATH, "", 0, WIFI_FILE_DELETE);
+            state = FAILED;
+        }
+    }
+
+public:
+    State getState() const
+    {
+        return state;
+    }
+
+    // Start staging an image the server offered with its signed SHA-256
+    // digest, ignores versions that are not newer than the running one or
+    // already being staged
+    void offer(uint16_t offeredVersion, const char *imageUrl, const uint8_t *digest)
+    {
+        if (offeredVersion <= FIRMWARE_VERSION || (offeredVersion == version && state != FAILED))
+        {
+            return;
+        }
+
+        strncpy(url, imageUrl, URL_SIZE - 1);
+        url[URL_SIZE - 1] = '\0';
+        memcpy(expectedDigest, digest, DIGEST_SIZE);
+        version = offeredVersion;
+
+        Serial.print("Staging firmware version ");
+        Serial.print(version);
+        Serial.print(" from ");
+        Serial.println(url);
+
+        // Start from an empty staging file
+        modemFiles.mount();
+        if (ota.begin(STAGE_PATH) != 0 || modemFiles.writefile(STAGE_PATH, "", 0, WIFI_FILE_WRITE) != 0)
+        {
+            Serial.println("Firmware staging area unavailable!");
+            state = FAILED;
+            return;
+        }
+
+        if (!requestImage())
+        {
+            Serial.println("Firmware download could not start!");
+            state = FAILED;
+            return;
+        }
+        state = DOWNLOADING;
+    }
+
+    // Hash and stage the next slice of the image, one bridge transaction
+    // each way
+    void service()
+    {
+        if (state == DOWNLOADING)
+        {
+            downloadSlice();
+        }
+    }
+
+    bool readyToSwitch() const
+    {
+        return state == STAGED;
+    }
+
+    // The modem writes the staged image to the active region and resets the
+    // board. Call at a quiet moment, after saving any state worth keeping.
+    void switchToStaged()
+    {
+        if (state != STAGED)
+        {
+            return;
+        }
+        Serial.println("Switching to staged firmware...");
+        Serial.flush();
+        if (ota.update(STAGE_PATH) != 0)
+        {
+            Serial.println("Firmware switch failed!");
+            state = FAILED;
+        }
+    }
+};
+
+RAM_BUDGET(Update, BUDGET_UPDATE_RAM, sizeof(FirmwareUpdater));
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef HttpHeaders_h
+#define HttpHeaders_h
+
+#include <Arduino.h>
+
+// Find a header by name (case-insensitive) in an HTTP message that starts
+// with a request or status line, returns its value or nullptr. Only the
+// header block is searched.
+inline const char *findHttpHeader(const char *message, const char *name)
+{
+    size_t nameLength = strlen(name);
+    const char *end = strstr(message, "\r\n\r\n");
+    const char *line = strstr(message, "\r\n");
+
+    while (line && (!end || line < end))
+    {
+        line += 2;
+        if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':')
+        {
+            const char *value = line + nameLength + 1;
+            while (*value == ' ')
+            {
+                value++;
+            }
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return nullptr;
+}
+
+// Parse exactly size bytes of hex text, returns false on malformed input
+inline bool parseHex(const char *hex, uint8_t *array, size_t size)
+{
+    for (size_t i = 0; i < size * 2; i++)
+    {
+        char c = hex[i];
+        uint8_t nibble;
+        if (c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            nibble = c - 'A' + 10;
+        else
+            return false;
+
+        if (i % 2 == 0)
+            array[i / 2] = nibble << 4;
+        else
+            array[i / 2] |= nibble;
+    }
+    return true;
+}
+
+// Write size bytes as lowercase hex text, without a terminator
+inline void writeHex(char *out, const uint8_t *array, size_t size)
+{
+    const char hexChars[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; i++)
+    {
+        out[2 * i] = hexChars[array[i] >> 4];
+        out[2 * i + 1] = hexChars[array[i] & 0x0F];
+    }
+}
+
+#endif
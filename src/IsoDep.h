@@ -0,0 +1,341 @@
+#ifndef IsoDep_h
+#define IsoDep_h
+
+#include <Arduino.h>
+#include <MFRC522.h>
+
+// Highest bit rate offered to cards in PPS, in kbit/s: 106, 212 or 424
+#ifndef READER_MAX_BITRATE
+#define READER_MAX_BITRATE 424
+#endif
+
+// ISO/IEC 14443-4 (ISO-DEP) session with the card the MFRC522 library has
+// just selected. activate() sends RATS and, when the ATS advertises it, PPS
+// to raise the bit rate in both directions, then sets the MFRC522 modem to
+// the same rate and lets its CRC coprocessor frame every block, which saves
+// the library's PCD_CalculateCRC round trips on each frame.
+//
+// APDU exchanges are split phase. beginExchange() loads the FIFO and starts
+// the transceive, finishExchange() collects the answer, so the next APDU can
+// be prepared while the card works on the current one. Waiting time
+// extensions and chained responses are handled, a failed exchange ends the
+// session. deselect() must end every session, it puts the reader back to
+// 106 kbit/s for the library's REQA and anticollision.
+class IsoDep
+{
+public:
+    enum Rate : uint8_t
+    {
+        RATE_106,
+        RATE_212,
+        RATE_424
+    };
+
+    static const uint8_t FRAME_SIZE = 64; // MFRC522 FIFO, announced to the card as FSD
+
+private:
+    static const uint8_t SAK_ISO14443_4 = 0x20;
+    static const uint8_t RATS = 0xE0;
+    static const uint8_t FSDI_64 = 0x50; // RATS parameter, CID 0
+    static const uint8_t PPSS = 0xD0;    // PPS start byte, CID 0
+    static const uint8_t PPS0_PPS1 = 0x11;
+    static const uint8_t PCB_I_BLOCK = 0x02;
+    static const uint8_t PCB_R_ACK = 0xA2;
+    static const uint8_t PCB_S_DESELECT = 0xC2;
+    static const uint8_t PCB_S_WTX = 0xF2;
+    static const uint8_t PCB_CHAINING = 0x10;
+    static const uint8_t MAX_WTX = 8;
+
+    // MFRC522 register values
+    static const uint8_t MODE_CRC = 0x80; // TxModeReg.TxCRCEn, RxModeReg.RxCRCEn
+    static const uint8_t IRQ_ALL = 0x7F;
+    static const uint8_t IRQ_RX_IDLE = 0x30;
+    static const uint8_t IRQ_TIMER = 0x01;
+    static const uint8_t ERROR_FRAMING = 0x13; // BufferOvfl, ParityErr, ProtocolErr
+    static const uint8_t ERROR_CRC = 0x04;
+    static const uint8_t START_SEND = 0x80;
+    static const uint16_t TIMER_DEFAULT = 1000; // Library's 25 ms reload at 40 kHz
+    static const unsigned long TIMER_TICK_US = 25;
+    static const unsigned long FWT_UNIT_US = 302; // 256 * 16 / fc, FWT = FWT_UNIT_US << FWI
+
+    static constexpr uint8_t MOD_WIDTH[] = {0x26, 0x15, 0x0A};
+    static constexpr uint8_t FRAME_SIZES[] = {16, 24, 32, 40, 48, 64}; // By FSCI, FIFO caps the rest
+
+    MFRC522 &reader;
+    Rate rate = RATE_106;
+    bool active = false;
+    uint8_t blockNumber = 0;
+    uint8_t cardFrameSize = 32; // FSC
+    uint8_t fwi = 4;
+    unsigned long sentAt = 0;
+    unsigned long waitMs = 0;
+
+    // Frame waiting time on the MFRC522 timer, which starts when a frame
+    // has been sent. The 40 kHz timer tops out at 1.6 s.
+    void setWaitTime(unsigned long us)
+    {
+        unsigned long ticks = min(us / TIMER_TICK_US + 1, 0xFFFFUL);
+        reader.PCD_WriteRegister(MFRC522::TReloadRegH, ticks >> 8);
+        reader.PCD_WriteRegister(MFRC522::TReloadRegL, ticks & 0xFF);
+        waitMs = ticks * TIMER_TICK_US / 1000 + 5;
+    }
+
+    void setRate(Rate newRate, bool crc)
+    {
+        uint8_t mode = (crc ? MODE_CRC : 0) | (newRate << 4);
+        reader.PCD_WriteRegister(MFRC522::TxModeReg, mode);
+        reader.PCD_WriteRegister(MFRC522::RxModeReg, mode);
+        reader.PCD_WriteRegister(MFRC522::ModWidthReg, MOD_WIDTH[newRate]);
+        rate = newRate;
+    }
+
+    void startTransceive(const uint8_t *frame, uint8_t length)
+    {
+        reader.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Idle);
+        reader.PCD_WriteRegister(MFRC522::ComIrqReg, IRQ_ALL);
+        reader.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80); // Flush
+        reader.PCD_WriteRegister(MFRC522::FIFODataReg, length, (byte *)frame);
+        reader.PCD_WriteRegister(MFRC522::BitFramingReg, 0x00);
+        reader.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Transceive);
+        reader.PCD_SetRegisterBitMask(MFRC522::BitFramingReg, START_SEND);
+        sentAt = millis();
+    }
+
+    // Wait for the card's frame, CRC already checked and stripped by the
+    // MFRC522. length is the buffer size on entry and the frame length on
+    // return.
+    bool receive(uint8_t *frame, uint8_t &length)
+    {
+        while (true)
+        {
+            uint8_t irq = reader.PCD_ReadRegister(MFRC522::ComIrqReg);
+            if (irq & IRQ_RX_IDLE)
+            {
+                break;
+            }
+            if ((irq & IRQ_TIMER) || millis() - sentAt > waitMs)
+            {
+                return false;
+            }
+        }
+
+        if (reader.PCD_ReadRegister(MFRC522::ErrorReg) & (ERROR_FRAMING | ERROR_CRC))
+        {
+            return false;
+        }
+        uint8_t received = reader.PCD_ReadRegister(MFRC522::FIFOLevelReg);
+        if (received == 0 || received > length)
+        {
+            return false;
+        }
+        reader.PCD_ReadRegister(MFRC522::FIFODataReg, received, frame, 0);
+        length = received;
+        return true;
+    }
+
+    bool transceive(const uint8_t *frame, uint8_t length, uint8_t *response, uint8_t &responseLength)
+    {
+        startTransceive(frame, length);
+        return receive(response, responseLength);
+    }
+
+    // Highest rate up to READER_MAX_BITRATE the card supports both ways,
+    // from the ATS interface byte TA(1)
+    static Rate commonRate(uint8_t ta)
+    {
+        Rate best = RATE_106;
+        for (uint8_t r = RATE_212; r <= RATE_424 && (106U << r) <= READER_MAX_BITRATE; r++)
+        {
+            bool cardToReader = ta & (0x10 << (r - 1)); // DS
+            bool readerToCard = ta & (0x01 << (r - 1)); // DR
+            if (cardToReader && readerToCard)
+            {
+                best = (Rate)r;
+            }
+        }
+        return best;
+    }
+
+    void guardTime(uint8_t sfgi)
+    {
+        if (sfgi == 0 || sfgi == 15)
+        {
+            return;
+        }
+        unsigned long us = FWT_UNIT_US << sfgi;
+        if (us > 16000)
+        {
+            delay(us / 1000 + 1);
+        }
+        else
+        {
+            delayMicroseconds(us);
+        }
+    }
+
+public:
+    explicit IsoDep(MFRC522 &reader) : reader(reader)
+    {
+    }
+
+    // Whether the selected card announced ISO/IEC 14443-4 in its SAK
+    static bool supported(const MFRC522::Uid &uid)
+    {
+        return uid.sak & SAK_ISO14443_4;
+    }
+
+    // RATS, then PPS to the highest common bit rate. The card stays
+    // activated at 106 kbit/s if it does not support a higher one or does
+    // not answer the PPS.
+    bool activate()
+    {
+        active = false;
+        blockNumber = 0;
+        setRate(RATE_106, true);
+        setWaitTime(FWT_UNIT_US << 4); // Activation frame waiting time
+
+        uint8_t rats[] = {RATS, FSDI_64};
+        uint8_t ats[FRAME_SIZE];
+        uint8_t atsLength = sizeof(ats);
+        if (!transceive(rats, sizeof(rats), ats, atsLength) || ats[0] != atsLength)
+        {
+            deselect();
+            return false;
+        }
+
+        // ATS: TL T0 [TA(1)] [TB(1)] [TC(1)] historical bytes
+        uint8_t t0 = atsLength > 1 ? ats[1] : 0x02;
+        uint8_t ta = 0;
+        uint8_t tb = 0x40; // FWI 4, no SFGT
+        uint8_t next = 2;
+        if ((t0 & 0x10) && next < atsLength)
+        {
+            ta = ats[next++];
+        }
+        if ((t0 & 0x20) && next < atsLength)
+        {
+            tb = ats[next++];
+        }
+        uint8_t fsci = t0 & 0x0F;
+        cardFrameSize = fsci < sizeof(FRAME_SIZES) ? FRAME_SIZES[fsci] : FRAME_SIZE;
+        fwi = min((uint8_t)(tb >> 4), (uint8_t)14);
+        guardTime(tb & 0x0F);
+        active = true;
+
+        Rate target = commonRate(ta);
+        if (target != RATE_106)
+        {
+            uint8_t pps[] = {PPSS, PPS0_PPS1, (uint8_t)((target << 2) | target)}; // DSI, DRI
+            uint8_t answer[4];
+            uint8_t answerLength = sizeof(answer);
+            if (transceive(pps, sizeof(pps), answer, answerLength) && answer[0] == PPSS)
+            {
+                setRate(target, true);
+            }
+        }
+
+        setWaitTime(FWT_UNIT_US << fwi);
+        return true;
+    }
+
+    // Send an APDU as one I-block. Fails for APDUs longer than the card's
+    // frame size allows, those would need chaining.
+    bool beginExchange(const uint8_t *apdu, uint8_t length)
+    {
+        if (!active || length + 3 > cardFrameSize) // PCB and CRC
+        {
+            return false;
+        }
+        uint8_t frame[FRAME_SIZE];
+        frame[0] = PCB_I_BLOCK | blockNumber;
+        memcpy(frame + 1, apdu, length);
+        startTransceive(frame, length + 1);
+        return true;
+    }
+
+    // Collect the response APDU, data and status word, of beginExchange().
+    // length is the buffer size on entry and the response length on return.
+    bool finishExchange(uint8_t *response, uint16_t &length)
+    {
+        uint16_t capacity = length;
+        length = 0;
+        uint8_t wtx = 0;
+        uint8_t frame[FRAME_SIZE];
+        while (active)
+        {
+            uint8_t received = sizeof(frame);
+            if (!receive(frame, received))
+            {
+                break;
+            }
+
+            // The card needs more time, grant it for this frame only
+            uint8_t pcb = frame[0];
+            if (pcb == PCB_S_WTX && received == 2 && ++wtx <= MAX_WTX)
+            {
+                uint8_t multiplier = max((uint8_t)(frame[1] & 0x3F), (uint8_t)1);
+                setWaitTime((FWT_UNIT_US << fwi) * multiplier);
+                uint8_t reply[] = {PCB_S_WTX, multiplier};
+                startTransceive(reply, sizeof(reply));
+                continue;
+            }
+            if (wtx)
+            {
+                setWaitTime(FWT_UNIT_US << fwi);
+                wtx = 0;
+            }
+
+            if ((pcb & 0xE2) != PCB_I_BLOCK || (pcb & 0x01) != blockNumber || length + received - 1 > capacity)
+            {
+                break;
+            }
+            memcpy(response + length, frame + 1, received - 1);
+            length += received - 1;
+            blockNumber ^= 1;
+
+            if (!(pcb & PCB_CHAINING))
+            {
+                return true;
+            }
+            uint8_t ack = PCB_R_ACK | blockNumber;
+            startTransceive(&ack, 1);
+        }
+
+        active = false;
+        return false;
+    }
+
+    bool exchange(const uint8_t *apdu, uint8_t length, uint8_t *response, uint16_t &responseLength)
+    {
+        return beginExchange(apdu, length) && finishExchange(response, responseLength);
+    }
+
+    // End the session with S(DESELECT) and restore the library's reader
+    // settings
+    void deselect()
+    {
+        if (active)
+        {
+            uint8_t request = PCB_S_DESELECT;
+            uint8_t answer[2];
+            uint8_t answerLength = sizeof(answer);
+            transceive(&request, 1, answer, answerLength);
+            active = false;
+        }
+        setRate(RATE_106, false);
+        reader.PCD_WriteRegister(MFRC522::TReloadRegH, TIMER_DEFAULT >> 8);
+        reader.PCD_WriteRegister(MFRC522::TReloadRegL, TIMER_DEFAULT & 0xFF);
+    }
+
+    Rate bitRate() const
+    {
+        return rate;
+    }
+
+    static unsigned int kbps(Rate rate)
+    {
+        return 106U << rate;
+    }
+};
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef KeyStore_h
+#define KeyStore_h
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <ArduinoBearSSL.h>
+
+#include "arduino_secrets.h"
+#include "HttpHeaders.h"
+#include "PersistentLayout.h"
+#include "SecureRandom.h"
+
+// Holds the current and next AES-128 request keys as pre-expanded BearSSL key
+// schedules, so encrypting a request never pays for key expansion and a
+// rotation is a slot swap. Keys are kept in data flash wrapped under the
+// compiled-in AES_KEY, which also serves as key ID 0 until the server rotates.
+class KeyStore
+{
+public:
+    static const size_t KEY_SIZE = 16;
+    static const size_t TAG_SIZE = 32;
+
+private:
+    static const uint32_t RECORD_MAGIC = 0x4B455932; // "KEY2"
+
+    struct Record
+    {
+        uint32_t magic;
+        uint8_t keyIds[2];
+        uint8_t currentSlot;
+        uint8_t hasNext;
+        uint8_t iv[KEY_SIZE];
+        uint8_t wrappedKeys[2 * KEY_SIZE];
+        uint32_t checksum;
+    };
+
+    const uint8_t rootKey[KEY_SIZE] = AES_KEY;
+    br_aes_ct_cbcenc_keys schedules[2];
+    uint8_t keys[2][KEY_SIZE];
+    uint8_t keyIds[2] = {0, 0};
+    uint8_t currentSlot = 0;
+    bool hasNext = false;
+
+    void installKey(uint8_t slot, uint8_t keyId, const uint8_t *key)
+    {
+        memcpy(keys[slot], key, KEY_SIZE);
+        keyIds[slot] = keyId;
+        br_aes_ct_cbcenc_init(&schedules[slot], keys[slot], KEY_SIZE);
+    }
+
+    bool load()
+    {
+        Record record;
+        EEPROM.get(EEPROM_KEYSTORE_ADDR, record);
+
+        if (record.magic != RECORD_MAGIC ||
+            record.checksum != recordChecksum(&record, offsetof(Record, checksum)))
+        {
+            return false;
+        }
+
+        // Unwrap both keys with the root key
+        uint8_t plain[2 * KEY_SIZE];
+        memcpy(plain, record.wrappedKeys, sizeof(plain));
+        br_aes_ct_cbcdec_keys unwrap;
+        br_aes_ct_cbcdec_init(&unwrap, rootKey, KEY_SIZE);
+        br_aes_ct_cbcdec_run(&unwrap, record.iv, plain, sizeof(plain));
+
+        currentSlot = record.currentSlot & 1;
+        hasNext = record.hasNext;
+        installKey(0, record.keyIds[0], plain);
+        installKey(1, record.keyIds[1], plain + KEY_SIZE);
+        memset(plain, 0, sizeof(plain));
+        return true;
+    }
+
+    // Wrap both keys under the root key with a fresh IV and store them
+    bool save()
+    {
+        uint8_t iv[KEY_SIZE];
+        if (!SecureRandom::fillBlock(iv))
+        {
+            Serial.println("Key store not saved: no random IV");
+            return false;
+        }
+
+        Record record;
+        record.magic = RECORD_MAGIC;
+        record.keyIds[0] = keyIds[0];
+        record.keyIds[1] = keyIds[1];
+        record.currentSlot = currentSlot;
+        record.hasNext = hasNext;
+        memcpy(record.iv, iv, KEY_SIZE);
+
+        memcpy(record.wrappedKeys, keys[0], KEY_SIZE);
+        memcpy(record.wrappedKeys + KEY_SIZE, keys[1], KEY_SIZE);
+        br_aes_ct_cbcenc_keys wrap;
+        br_aes_ct_cbcenc_init(&wrap, rootKey, KEY_SIZE);
+        br_aes_ct_cbcenc_run(&wrap, iv, record.wrappedKeys, sizeof(record.wrappedKeys));
+
+        record.checksum = recordChecksum(&record, offsetof(Record, checksum));
+        EEPROM.put(EEPROM_KEYSTORE_ADDR, record);
+        return true;
+    }
+
+    // Key ID of a rotation header, 1 to 255; ID 0 is the factory key
+    static bool parseKeyId(const char *text, char **end, uint8_t &keyId)
+    {
+        long value = strtol(text, end, 10);
+        if (*end == text || value < 1 || value > 255)
+        {
+            return false;
+        }
+        keyId = value;
+        return true;
+    }
+
+public:
+    // Load the stored key pair, falling back to the compiled-in key as ID 0
+    void begin()
+    {
+        if (load())
+        {
+            Serial.print("Key store loaded, current key ID: ");
+            Serial.println(currentKeyId());
+            return;
+        }
+
+        currentSlot = 0;
+        hasNext = false;
+        installKey(0, 0, rootKey);
+        installKey(1, 0, rootKey);
+        Serial.println("Key store empty, using factory key ID 0");
+    }
+
+    uint8_t currentKeyId() const
+    {
+        return keyIds[currentSlot];
+    }
+
+    // Decrypt whole blocks in place with the current or staged key of the
+    // given ID (CBC), returns false if the key is not known
+    bool decrypt(uint8_t keyId, uint8_t *data, size_t size, uint8_t *iv) const
+    {
+        uint8_t slot = currentSlot;
+        if (keyIds[slot] != keyId)
+        {
+            slot ^= 1;
+            if (!hasNext || keyIds[slot] != keyId)
+            {
+                return false;
+            }
+        }
+
+        br_aes_ct_cbcdec_keys dec;
+        br_aes_ct_cbcdec_init(&dec, keys[slot], KEY_SIZE);
+        br_aes_ct_cbcdec_run(&dec, iv, data, size);
+        return true;
+    }
+
+    // Check an HMAC-SHA256 tag made by the server with the current key
+    bool verifyTag(const void *message, size_t size, const uint8_t *tag) const
+    {
+        br_hmac_key_context keyContext;
+        br_hmac_context context;
+        uint8_t expected[TAG_SIZE];
+
+        br_hmac_key_init(&keyContext, &br_sha256_vtable, keys[currentSlot], KEY_SIZE);
+        br_hmac_init(&context, &keyContext, 0);
+        br_hmac_update(&context, message, size);
+        br_hmac_out(&context, expected);
+
+        // Compare in constant time
+        uint8_t difference = 0;
+        for (size_t i = 0; i < TAG_SIZE; i++)
+        {
+            difference |= expected[i] ^ tag[i];
+        }
+        return difference == 0;
+    }
+
+    // Encrypt whole blocks in place with the current key schedule (CBC)
+    void encrypt(uint8_t *data, size_t size, uint8_t *iv) const
+    {
+        br_aes_ct_cbcenc_run(&schedules[currentSlot], iv, data, size);
+    }
+
+    // Accept a next key sent by the server, encrypted under the current key
+    // as AES-128-CBC(key || PKCS7 padding block) and authenticated with an
+    // HMAC-SHA256 tag under the current key over
+    // "KEY-NEXT" | key ID | IV | ciphertext. CBC alone lets IV bit flips
+    // through to the key, the tag does not.
+    bool stageNextKey(uint8_t keyId, const uint8_t *iv, const uint8_t *ciphertext, const uint8_t *tag)
+    {
+        uint8_t message[8 + 1 + 3 * KEY_SIZE];
+        memcpy(message, "KEY-NEXT", 8);
+        message[8] = keyId;
+        memcpy(message + 9, iv, KEY_SIZE);
+        memcpy(message + 9 + KEY_SIZE, ciphertext, 2 * KEY_SIZE);
+        if (!verifyTag(message, sizeof(message), tag))
+        {
+            Serial.println("Rejected next key: bad tag");
+            return false;
+        }
+
+        uint8_t plain[2 * KEY_SIZE];
+        uint8_t ivCopy[KEY_SIZE];
+        memcpy(plain, ciphertext, sizeof(plain));
+        memcpy(ivCopy, iv, KEY_SIZE);
+
+        br_aes_ct_cbcdec_keys dec;
+        br_aes_ct_cbcdec_init(&dec, keys[currentSlot], KEY_SIZE);
+        br_aes_ct_cbcdec_run(&dec, ivCopy, plain, sizeof(plain));
+
+        // The second block must be a full PKCS7 padding block
+        for (size_t i = KEY_SIZE; i < sizeof(plain); i++)
+        {
+            if (plain[i] != KEY_SIZE)
+            {
+                Serial.println("Rejected next key: bad padding");
+                memset(plain, 0, sizeof(plain));
+                return false;
+            }
+        }
+
+        if (hasNext && keyIds[currentSlot ^ 1] == keyId)
+        {
+            memset(plain, 0, sizeof(plain));
+            return true;
+        }
+
+        installKey(currentSlot ^ 1, keyId, plain);
+        memset(plain, 0, sizeof(plain));
+        hasNext = true;
+        save();
+
+        Serial.print("Staged next key ID: ");
+        Serial.println(keyId);
+        return true;
+    }
+
+    // Apply the key rotation commands carried in a server response:
+    //   X-Key-Next: <id>,<iv hex>,<64 hex chars of key and padding block>,<tag hex>
+    //   X-Key-Activate: <id>,<tag hex>
+    // Tags are HMAC-SHA256 under the current key, see stageNextKey() and
+    // activateKey().
+    void applyRotationHeaders(const char *response)
+    {
+        const char *next = findHttpHeader(response, "X-Key-Next");
+        if (next)
+        {
+            uint8_t keyId;
+            uint8_t iv[KEY_SIZE];
+            uint8_t ciphertext[2 * KEY_SIZE];
+            uint8_t tag[TAG_SIZE];
+            char *cursor;
+
+            if (parseKeyId(next, &cursor, keyId) && *cursor == ',' && parseHex(cursor + 1, iv, KEY_SIZE) &&
+                cursor[1 + 2 * KEY_SIZE] == ',' &&
+                parseHex(cursor + 2 + 2 * KEY_SIZE, ciphertext, sizeof(ciphertext)) &&
+                cursor[2 + 6 * KEY_SIZE] == ',' && parseHex(cursor + 3 + 6 * KEY_SIZE, tag, TAG_SIZE))
+            {
+                stageNextKey(keyId, iv, ciphertext, tag);
+            }
+            else
+            {
+                Serial.println("Malformed X-Key-Next header");
+            }
+        }
+
+        const char *activate = findHttpHeader(response, "X-Key-Activate");
+        if (activate)
+        {
+            uint8_t keyId;
+            uint8_t tag[TAG_SIZE];
+            char *cursor;
+            if (parseKeyId(activate, &cursor, keyId) && *cursor == ',' && parseHex(cursor + 1, tag, TAG_SIZE))
+            {
+                activateKey(keyId, tag);
+            }
+            else
+            {
+                Serial.println("Malformed X-Key-Activate header");
+            }
+        }
+    }
+
+    // Switch to the staged next key. The tag is HMAC-SHA256 under the
+    // current key over "KEY-ACTIVATE" | current key ID | next key ID.
+    bool activateKey(uint8_t keyId, const uint8_t *tag)
+    {
+        if (keyIds[currentSlot] == keyId)
+        {
+            return true;
+        }
+
+        uint8_t message[12 + 2];
+        memcpy(message, "KEY-ACTIVATE", 12);
+        message[12] = keyIds[currentSlot];
+        message[13] = keyId;
+        if (!verifyTag(message, sizeof(message), tag))
+        {
+            Serial.println("Rejected key activation: bad tag");
+            return false;
+        }
+
+        if (!hasNext || keyIds[currentSlot ^ 1] != keyId)
+        {
+            Serial.print("Cannot activate unknown key ID: ");
+            Serial.println(keyId);
+            return false;
+        }
+
+        currentSlot ^= 1;
+        hasNext = false;
+        save();
+
+        Serial.print("Activated key ID: ");
+        Serial.println(keyId);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef LatencyHistogram_h
+#define LatencyHistogram_h
+
+#include <Arduino.h>
+
+// Fixed-size latency histogram in milliseconds. Percentiles are reported as
+// the upper bound of the bucket they fall into.
+class LatencyHistogram
+{
+public:
+    static const uint8_t BUCKET_COUNT = 16;
+
+private:
+    static constexpr uint16_t BUCKET_LIMITS_MS[BUCKET_COUNT - 1] = {
+        10, 20, 50, 100, 150, 200, 300, 400, 500, 750, 1000, 1500, 2000, 3000, 5000};
+
+    uint16_t buckets[BUCKET_COUNT] = {0};
+    uint32_t samples = 0;
+    unsigned long maximum = 0;
+
+public:
+    void record(unsigned long latencyMs)
+    {
+        uint8_t bucket = 0;
+        while (bucket < BUCKET_COUNT - 1 && latencyMs > BUCKET_LIMITS_MS[bucket])
+        {
+            bucket++;
+        }
+
+        if (buckets[bucket] < UINT16_MAX)
+        {
+            buckets[bucket]++;
+        }
+        samples++;
+        maximum = max(maximum, latencyMs);
+    }
+
+    // Latency that percent of the samples stay within
+    unsigned long percentile(uint8_t percent) const
+    {
+        if (samples == 0)
+        {
+            return 0;
+        }
+
+        uint32_t target = (samples * percent + 99) / 100;
+        uint32_t seen = 0;
+        for (uint8_t bucket = 0; bucket < BUCKET_COUNT - 1; bucket++)
+        {
+            seen += buckets[bucket];
+            if (seen >= target)
+            {
+                return min((unsigned long)BUCKET_LIMITS_MS[bucket], maximum);
+            }
+        }
+        return maximum;
+    }
+
+    uint32_t count() const
+    {
+        return samples;
+    }
+
+    void reset()
+    {
+        memset(buckets, 0, sizeof(buckets));
+        samples = 0;
+        maximum = 0;
+    }
+};
+
+#endif
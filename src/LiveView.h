@@ -0,0 +1,353 @@
+#ifndef LiveView_h
+#define LiveView_h
+
+#include <Arduino.h>
+#include <ArduCAM.h>
+#include <SPI.h>
+#include <WiFiS3.h>
+
+#include "TaskSupport.h"
+
+#ifndef LIVE_VIEW_PORT
+#define LIVE_VIEW_PORT 81
+#endif
+#ifndef LIVE_VIEW_DUTY_PERCENT
+#define LIVE_VIEW_DUTY_PERCENT 50 // Share of the modem bridge the stream may use
+#endif
+
+// Live MJPEG view of the door camera over HTTP for one viewer at a time, e.g.
+// http://<door ip>:81/?token=<token> in a browser. Requests without the
+// token get 401. Frames go from the ArduCAM FIFO to the
+// socket in chunks and are never held in RAM whole. Every call to service()
+// does at most one step, so the door keeps running while a frame is sent.
+// The frame interval follows the measured send time so the stream leaves
+// the rest of the modem bridge to authorization requests.
+class LiveView
+{
+public:
+    static const size_t CHUNK_SIZE = 512;
+    static const unsigned long MIN_FRAME_INTERVAL_MS = 100; // At most 10 frames per second
+    static const unsigned long MAX_FRAME_INTERVAL_MS = 2000;
+    static const unsigned long ACCEPT_INTERVAL_MS = 250; // Each accept check is a modem exchange
+    static const unsigned long REQUEST_TIMEOUT_MS = 2000;
+    static const size_t REQUEST_LINE_SIZE = 96;
+
+private:
+    enum State : uint8_t
+    {
+        VIEW_IDLE,      // No viewer
+        VIEW_WAITING,   // Viewer connected, waiting for the next frame time
+        VIEW_CAPTURING, // Frame being taken into the FIFO
+        VIEW_SENDING    // Frame being sent in chunks
+    };
+
+    ArduCAM &camera;
+    TaskMutex &spiBus;
+    TaskMutex &modemLink;
+    WiFiServer server;
+    WiFiClient viewer;
+    const char *token;
+    WiFiClient candidate; // Connected, its request line not read yet
+    unsigned long candidateSince = 0;
+    char requestLine[REQUEST_LINE_SIZE];
+    uint8_t requestLength = 0;
+    State state = VIEW_IDLE;
+    uint8_t chunk[CHUNK_SIZE];
+    uint32_t remaining = 0;
+    unsigned long nextAccept = 0;
+    unsigned long nextFrame = 0;
+    unsigned long frameStart = 0;
+    unsigned long averageSendMs = 0; // Running average of the time to send a frame (alpha 1/4)
+    unsigned long frameInterval = MIN_FRAME_INTERVAL_MS;
+    uint32_t frames = 0;
+    uint32_t bytesSent = 0;
+    unsigned long viewStart = 0;
+
+    bool send(const void *data, size_t size)
+    {
+        TaskLock link(modemLink);
+        if (viewer.write((const uint8_t *)data, size) != size)
+        {
+            disconnect();
+            return false;
+        }
+        bytesSent += size;
+        return true;
+    }
+
+    void accept()
+    {
+        if ((long)(millis() - nextAccept) < 0)
+        {
+            return;
+        }
+        nextAccept = millis() + ACCEPT_INTERVAL_MS;
+
+        TaskLock link(modemLink);
+        if (candidate)
+        {
+            readRequest();
+            return;
+        }
+
+        WiFiClient client = server.available();
+        if (!client || (state != VIEW_IDLE && client == viewer))
+        {
+            return;
+        }
+
+        if (state != VIEW_IDLE)
+        {
+            reject(client, "503 Service Unavailable");
+            return;
+        }
+
+        candidate = client;
+        candidateSince = millis();
+        requestLength = 0;
+        readRequest();
+    }
+
+    static void reject(WiFiClient &client, const char *status)
+    {
+        client.print("HTTP/1.1 ");
+        client.print(status);
+        client.print("\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        client.stop();
+    }
+
+    // Collect the request line of the waiting client, "GET /?token=<token> HTTP/1.1"
+    void readRequest()
+    {
+        int available = candidate.available();
+        if (available > 0 && requestLength < REQUEST_LINE_SIZE - 1)
+        {
+            int length = candidate.read((uint8_t *)requestLine + requestLength,
+                                        min((size_t)available, REQUEST_LINE_SIZE - 1 - requestLength));
+            requestLength += max(length, 0);
+        }
+        requestLine[requestLength] = '\0';
+
+        if (!strchr(requestLine, '\n') && requestLength < REQUEST_LINE_SIZE - 1)
+        {
+            if (millis() - candidateSince >= REQUEST_TIMEOUT_MS || !candidate.connected())
+            {
+                candidate.stop();
+            }
+            return;
+        }
+
+        if (!tokenMatches())
+        {
+            Serial.println("Live view request without a valid token");
+            reject(candidate, "401 Unauthorized");
+            return;
+        }
+
+        // The rest of the request is not needed
+        const char header[] = "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+                              "Cache-Control: no-cache\r\nConnection: close\r\n\r\n";
+        if (candidate.write((const uint8_t *)header, sizeof(header) - 1) != sizeof(header) - 1)
+        {
+            candidate.stop();
+            return;
+        }
+
+        viewer = candidate;
+        candidate = WiFiClient();
+        state = VIEW_WAITING;
+        nextFrame = millis();
+        frames = 0;
+        bytesSent = 0;
+        viewStart = millis();
+        Serial.println("Live view started");
+    }
+
+    // Compared in constant time, so the token cannot be guessed byte by byte
+    bool tokenMatches() const
+    {
+        static const char prefix[] = "GET /?token=";
+        if (strncmp(requestLine, prefix, sizeof(prefix) - 1) != 0)
+        {
+            return false;
+        }
+        const char *offered = requestLine + sizeof(prefix) - 1;
+        size_t offeredLength = strcspn(offered, " &\r\n");
+        size_t tokenLength = strlen(token);
+        if (tokenLength == 0 || offeredLength != tokenLength)
+        {
+            return false;
+        }
+        uint8_t difference = 0;
+        for (size_t i = 0; i < tokenLength; i++)
+        {
+            difference |= offered[i] ^ token[i];
+        }
+        return difference == 0;
+    }
+
+    void startFrame()
+    {
+        TaskLock bus(spiBus);
+        camera.flush_fifo();
+        camera.clear_fifo_flag();
+        camera.start_capture();
+        state = VIEW_CAPTURING;
+    }
+
+    void collectFrame()
+    {
+        uint32_t length;
+        {
+            TaskLock bus(spiBus);
+            if (!camera.get_bit(ARDUCHIP_TRIG, CAP_DONE_MASK))
+            {
+                return;
+            }
+            length = camera.read_fifo_length();
+        }
+
+        if (length == 0 || length >= MAX_FIFO_SIZE)
+        {
+            state = VIEW_WAITING;
+            return;
+        }
+
+        // Parts are delimited by the boundary only, so a frame cut short
+        // does not break the stream. The line break ends the previous part.
+        static const char partHeader[] = "\r\n--frame\r\nContent-Type: image/jpeg\r\n\r\n";
+        frameStart = millis();
+        if (send(partHeader, sizeof(partHeader) - 1))
+        {
+            remaining = length;
+            state = VIEW_SENDING;
+        }
+    }
+
+    void sendChunk()
+    {
+        size_t size = min((uint32_t)CHUNK_SIZE, remaining);
+        {
+            TaskLock bus(spiBus);
+            camera.CS_LOW();
+            camera.set_fifo_burst();
+            for (size_t i = 0; i < size; i++)
+            {
+                chunk[i] = SPI.transfer(0x00);
+            }
+            camera.CS_HIGH();
+        }
+
+        if (!send(chunk, size))
+        {
+            return;
+        }
+
+        remaining -= size;
+        if (remaining == 0)
+        {
+            finishFrame();
+        }
+    }
+
+    // Pick the next frame time from the send time
+    void finishFrame()
+    {
+        unsigned long sendMs = millis() - frameStart;
+        averageSendMs = frames == 0 ? sendMs : averageSendMs + ((long)sendMs - (long)averageSendMs) / 4;
+        frameInterval = constrain(averageSendMs * 100 / LIVE_VIEW_DUTY_PERCENT,
+                                  MIN_FRAME_INTERVAL_MS, MAX_FRAME_INTERVAL_MS);
+        frames++;
+
+        nextFrame = frameStart + frameInterval;
+        state = VIEW_WAITING;
+    }
+
+    void disconnect()
+    {
+        viewer.stop();
+        state = VIEW_IDLE;
+
+        unsigned long seconds = max((millis() - viewStart) / 1000, 1UL);
+        Serial.print("Live view ended: ");
+        Serial.print(frames);
+        Serial.print(" frames, ");
+        Serial.print(bytesSent / 1024 / seconds);
+        Serial.println(" KB/s");
+    }
+
+public:
+    LiveView(ArduCAM &cam, TaskMutex &bus, TaskMutex &link, const char *accessToken)
+        : camera(cam), spiBus(bus), modemLink(link), server(LIVE_VIEW_PORT), token(accessToken) {}
+
+    // Start listening, call once WiFi is up
+    void begin()
+    {
+        TaskLock link(modemLink);
+        server.begin();
+    }
+
+    // Take one step of the stream, never waits. While paused, e.g. during a
+    // tap or while another user of the camera FIFO is busy, no frames are
+    // taken and a frame being sent is cut short.
+    void service(bool paused)
+    {
+        accept();
+        if (state == VIEW_IDLE)
+        {
+            return;
+        }
+
+        if (paused)
+        {
+            if (state != VIEW_WAITING)
+            {
+                abortFrame();
+            }
+            return;
+        }
+
+        switch (state)
+        {
+        case VIEW_WAITING:
+            if ((long)(millis() - nextFrame) >= 0)
+            {
+                startFrame();
+            }
+            break;
+        case VIEW_CAPTURING:
+            collectFrame();
+            break;
+        case VIEW_SENDING:
+            sendChunk();
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Drop the frame in progress, e.g. because another capture reuses the
+    // FIFO. Only changes state, so it is safe to call with the bus held.
+    void abortFrame()
+    {
+        if (state == VIEW_SENDING || state == VIEW_CAPTURING)
+        {
+            remaining = 0;
+            state = VIEW_WAITING;
+        }
+    }
+
+    bool isStreaming() const
+    {
+        return state != VIEW_IDLE;
+    }
+
+    // Current time between frames
+    unsigned long interval() const
+    {
+        return frameInterval;
+    }
+};
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef LockdownListener_h
+#define LockdownListener_h
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <MFRC522.h>
+#include <WiFiS3.h>
+#include <WiFiUdp.h>
+
+#include "arduino_secrets.h"
+#include "Cmac.h"
+#include "PersistentLayout.h"
+#include "UidFingerprint.h"
+
+#ifndef LOCKDOWN_GROUP
+#define LOCKDOWN_GROUP IPAddress(239, 255, 42, 1)
+#endif
+#ifndef LOCKDOWN_PORT
+#define LOCKDOWN_PORT 5007
+#endif
+
+// A key of its own, so whoever sends emergency commands never needs AES_KEY
+#ifndef COMMAND_KEY
+#error "Set a 16-byte COMMAND_KEY in arduino_secrets.h"
+#endif
+
+// Fleet-wide emergency commands received on a UDP multicast group. Commands
+// are authenticated with AES-CMAC under COMMAND_KEY and carry a sequence
+// number that must increase, so a captured packet cannot be replayed. The
+// last sequence, the door mode and the revoked badges are kept in data
+// flash, a lockdown or revocation survives a restart. Each applied command is acknowledged to its sender.
+//
+// Command packet (big-endian):
+//   "LK" | version | command | sequence (8) | UID size | UID (10) | CMAC (16)
+// Acknowledgement:
+//   "LA" | version | result | sequence (8) | apply time us (4) | device UUID (36) | CMAC (16)
+class LockdownListener
+{
+public:
+    enum Command : uint8_t
+    {
+        COMMAND_NONE = 0,
+        COMMAND_LOCK_ALL = 1,     // Keep doors closed, deny every card
+        COMMAND_UNLOCK_ALL = 2,   // Hold doors open, e.g. for evacuation
+        COMMAND_RESUME = 3,       // Back to normal operation
+        COMMAND_REVOKE_BADGE = 4, // Deny one card locally until resumed
+    };
+
+    enum Mode : uint8_t
+    {
+        MODE_NORMAL,
+        MODE_LOCKDOWN,
+        MODE_UNLOCKED
+    };
+
+    static const uint8_t VERSION = 1;
+    static const size_t COMMAND_SIZE = 23;
+    static const size_t ACK_SIZE = 52;
+    static const uint8_t MAX_REVOKED = 8;
+    static const unsigned long POLL_INTERVAL_MS = 50; // Each receive check is a modem exchange
+
+private:
+    static const uint32_t RECORD_MAGIC = 0x4C4B4431;  // "LKD1"
+    static const uint32_t REVOKED_MAGIC = 0x52564B31; // "RVK1"
+    static const size_t UUID_SIZE = 36;
+
+    struct Record
+    {
+        uint32_t magic;
+        uint64_t sequence;
+        uint8_t mode;
+        uint32_t checksum;
+    };
+
+    // Kept apart from Record, which has no room for the list at its address
+    struct RevokedRecord
+    {
+        uint32_t magic;
+        uint32_t count;
+        uint64_t badges[MAX_REVOKED];
+        uint32_t checksum;
+    };
+    static_assert(EEPROM_REVOKED_ADDR + sizeof(RevokedRecord) <= EEPROM_BENCHMARK_ADDR,
+                  "Revoked badges overlap the benchmark record");
+
+    WiFiUDP udp;
+    Cmac cmac;
+    const UidFingerprint &fingerprints;
+    uint64_t lastSequence = 0;
+    Mode currentMode = MODE_NORMAL;
+    uint64_t revoked[MAX_REVOKED]; // Fingerprints of revoked badges
+    uint8_t revokedCount = 0;
+
+    // Command waiting for acknowledge()
+    IPAddress senderAddress;
+    uint16_t senderPort = 0;
+    uint64_t pendingSequence = 0;
+    unsigned long receivedAt = 0;
+    unsigned long nextPoll = 0;
+
+    static uint64_t readSequence(const uint8_t *data)
+    {
+        uint64_t value = 0;
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            value = (value << 8) | data[i];
+        }
+        return value;
+    }
+
+    static void writeSequence(uint8_t *data, uint64_t value)
+    {
+        for (int8_t i = 7; i >= 0; i--)
+        {
+            data[i] = value & 0xFF;
+            value >>= 8;
+        }
+    }
+
+    void save()
+    {
+        Record record;
+        record.magic = RECORD_MAGIC;
+        record.sequence = lastSequence;
+        record.mode = currentMode;
+        record.checksum = recordChecksum(&record, offsetof(Record, checksum));
+        EEPROM.put(EEPROM_LOCKDOWN_ADDR, record);
+
+        RevokedRecord list = {};
+        list.magic = REVOKED_MAGIC;
+        list.count = revokedCount;
+        memcpy(list.badges, revoked, sizeof(revoked[0]) * revokedCount);
+        list.checksum = recordChecksum(&list, offsetof(RevokedRecord, checksum));
+        EEPROM.put(EEPROM_REVOKED_ADDR, list);
+    }
+
+    void load()
+    {
+        Record record;
+        EEPROM.get(EEPROM_LOCKDOWN_ADDR, record);
+        if (record.magic == RECORD_MAGIC &&
+            record.checksum == recordChecksum(&record, offsetof(Record, checksum)))
+        {
+            lastSequence = record.sequence;
+            currentMode = (Mode)record.mode;
+        }
+
+        RevokedRecord list;
+        EEPROM.get(EEPROM_REVOKED_ADDR, list);
+        if (list.magic == REVOKED_MAGIC && list.count <= MAX_REVOKED &&
+            list.checksum == recordChecksum(&list, offsetof(RevokedRecord, checksum)))
+        {
+            revokedCount = list.count;
+            memcpy(revoked, list.badges, sizeof(revoked[0]) * revokedCount);
+        }
+    }
+
+    void addRevoked(uint64_t badge)
+    {
+        if (isRevoked(badge))
+        {
+            return;
+        }
+
+        // A full list drops the oldest entry
+        if (revokedCount == MAX_REVOKED)
+        {
+            memmove(revoked, revoked + 1, sizeof(revoked[0]) * (MAX_REVOKED - 1));
+            revokedCount--;
+        }
+        revoked[revokedCount++] = badge;
+    }
+
+public:
+    explicit LockdownListener(const UidFingerprint &uidFingerprints) : fingerprints(uidFingerprints)
+    {
+        const uint8_t key[Cmac::BLOCK_SIZE] = COMMAND_KEY;
+        cmac.begin(key);
+    }
+
+    // Restore the saved mode and join the multicast group, call once WiFi is up
+    bool begin()
+    {
+        load();
+        if (currentMode != MODE_NORMAL)
+        {
+            Serial.println(currentMode == MODE_LOCKDOWN ? "Lockdown restored" : "Emergency unlock restored");
+        }
+        if (revokedCount > 0)
+        {
+            Serial.print("Revoked badges restored: ");
+            Serial.println(revokedCount);
+        }
+        return rejoin();
+    }
+
+    // Join the group again, e.g. after a WiFi reconnect
+    bool rejoin()
+    {
+        udp.stop();
+        if (!udp.beginMulticast(LOCKDOWN_GROUP, LOCKDOWN_PORT))
+        {
+            Serial.println("Failed to join the lockdown multicast group!");
+            return false;
+        }
+        return true;
+    }
+
+    // Check for an authenticated command, never waits. Returns the command to
+    // apply, with the fingerprint of the badge in badge for
+    // COMMAND_REVOKE_BADGE. The caller applies it and then calls
+    // acknowledge().
+    Command service(uint64_t &badge)
+    {
+        if ((long)(millis() - nextPoll) < 0)
+        {
+            return COMMAND_NONE;
+        }
+        nextPoll = millis() + POLL_INTERVAL_MS;
+
+        int size = udp.parsePacket();
+        if (size <= 0)
+        {
+            return COMMAND_NONE;
+        }
+
+        uint8_t packet[COMMAND_SIZE + Cmac::BLOCK_SIZE];
+        unsigned long now = micros();
+        int length = udp.read(packet, sizeof(packet));
+        if (length != (int)sizeof(packet) || size != length || packet[0] != 'L' || packet[1] != 'K' ||
+            packet[2] != VERSION)
+        {
+            return COMMAND_NONE;
+        }
+
+        if (!cmac.verify(packet, COMMAND_SIZE, packet + COMMAND_SIZE))
+        {
+            Serial.println("Lockdown command rejected: bad CMAC");
+            return COMMAND_NONE;
+        }
+
+        uint64_t sequence = readSequence(packet + 4);
+        if (sequence <= lastSequence)
+        {
+            // Old or repeated command, most likely a retransmission
+            return COMMAND_NONE;
+        }
+
+        Command command = (Command)packet[3];
+        switch (command)
+        {
+        case COMMAND_LOCK_ALL:
+            currentMode = MODE_LOCKDOWN;
+            break;
+        case COMMAND_UNLOCK_ALL:
+            currentMode = MODE_UNLOCKED;
+            break;
+        case COMMAND_RESUME:
+            currentMode = MODE_NORMAL;
+            revokedCount = 0;
+            break;
+        case COMMAND_REVOKE_BADGE:
+        {
+            MFRC522::Uid uid = {};
+            if (packet[12] < 4 || packet[12] > sizeof(uid.uidByte))
+            {
+                return COMMAND_NONE;
+            }
+            uid.size = packet[12];
+            memcpy(uid.uidByte, packet + 13, uid.size);
+            badge = fingerprints.of(uid);
+            addRevoked(badge);
+            break;
+        }
+        default:
+            return COMMAND_NONE;
+        }
+
+        lastSequence = sequence;
+        save();
+
+        senderAddress = udp.remoteIP();
+        senderPort = udp.remotePort();
+        pendingSequence = sequence;
+        receivedAt = now;
+        return command;
+    }
+
+    // Tell the sender the last command was applied and how long that took
+    void acknowledge(bool applied)
+    {
+        uint8_t ack[ACK_SIZE + Cmac::BLOCK_SIZE];
+        uint32_t applyUs = micros() - receivedAt;
+
+        memset(ack, 0, sizeof(ack));
+        ack[0] = 'L';
+        ack[1] = 'A';
+        ack[2] = VERSION;
+        ack[3] = applied ? 1 : 0;
+        writeSequence(ack + 4, pendingSequence);
+        ack[12] = applyUs >> 24;
+        ack[13] = applyUs >> 16;
+        ack[14] = applyUs >> 8;
+        ack[15] = applyUs;
+        memcpy(ack + 16, DEVICE_UUID, min(strlen(DEVICE_UUID), UUID_SIZE));
+        cmac.compute(ack, ACK_SIZE, ack + ACK_SIZE);
+
+        udp.beginPacket(senderAddress, senderPort);
+        udp.write(ack, sizeof(ack));
+        udp.endPacket();
+    }
+
+    Mode mode() const
+    {
+        return currentMode;
+    }
+
+    bool isRevoked(uint64_t badge) const
+    {
+        for (uint8_t i = 0; i < revokedCount; i++)
+        {
+            if (revoked[i] == badge)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t sequence() const
+    {
+        return lastSequence;
+    }
+};
+
+#endif
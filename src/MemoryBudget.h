@@ -0,0 +1,76 @@
+#ifndef MemoryBudget_h
+#define MemoryBudget_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Static RAM limits per subsystem, in bytes: what lives in .bss and .data,
+// not stack buffers or the heap (ArduinoJson documents, capture chunks).
+// Together the limits must stay within BUDGET_TOTAL_RAM, which leaves the
+// rest of the 32 KB SRAM to the Arduino core, libraries, stack and heap.
+// Raising one limit means lowering another, e.g. cache entries against the
+// response buffer inside the Auth budget. BUDGET_IMAGE_RAM bounds the whole
+// linked image's .data and .bss, core and libraries included; both totals
+// are checked after linking by scripts/memory_map.py.
+#define BUDGET_TOTAL_RAM 20480
+#define BUDGET_IMAGE_RAM 28672
+#define BUDGET_TOTAL_FLASH 196608
+
+#define BUDGET_AUTH_RAM 2816
+#define BUDGET_READER_RAM 384
+#define BUDGET_CAMERA_RAM 1536
+#define BUDGET_UPDATE_RAM 384
+#define BUDGET_UI_RAM 128
+#define BUDGET_METRICS_RAM 576
+#define BUDGET_LOCKDOWN_RAM 2048 // Mostly the WiFiUDP receive buffer
+#define BUDGET_STORAGE_RAM 2048  // Storage queue and arena, audit write-behind buffer
+#define BUDGET_TASKS_RAM 9216    // RTOS build only: task stacks and queue storage
+
+// Proxy build (src/proxy_main.cpp), which has no door subsystems
+#define BUDGET_PROXY_RAM 6272
+
+namespace MemoryBudget
+{
+    // One line of the memory map, also read from the ELF by the build script
+    struct Entry
+    {
+        char subsystem[12];
+        uint32_t used;
+        uint32_t limit;
+    };
+
+    constexpr size_t sum()
+    {
+        return 0;
+    }
+
+    template <typename... Rest>
+    constexpr size_t sum(size_t first, Rest... rest)
+    {
+        return first + sum(rest...);
+    }
+
+    template <size_t N>
+    constexpr size_t totalLimit(const Entry (&map)[N])
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < N; i++)
+        {
+            total += map[i].limit;
+        }
+        return total;
+    }
+}
+
+// Declare the static buffers of a subsystem. Fails the build when they add
+// up to more than the subsystem's limit.
+#define RAM_BUDGET(subsystem, limit, ...)                                        \
+    constexpr size_t subsystem##RamUsed = MemoryBudget::sum(__VA_ARGS__);       \
+    constexpr size_t subsystem##RamLimit = (limit);                             \
+    static_assert(subsystem##RamUsed <= subsystem##RamLimit,                    \
+                  #subsystem " subsystem exceeds its RAM budget")
+
+// Memory map line for a subsystem declared with RAM_BUDGET
+#define BUDGET_ENTRY(subsystem) {#subsystem, subsystem##RamUsed, subsystem##RamLimit}
+
+#endif
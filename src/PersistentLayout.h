@@ -0,0 +1,34 @@
+#ifndef PersistentLayout_h
+#define PersistentLayout_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Offsets of the records kept in the RA4M1 data flash (EEPROM emulation).
+// Every record starts with its own magic and checksum, so a layout change
+// only needs a new magic for the affected record.
+#define EEPROM_KEYSTORE_ADDR 0
+#define EEPROM_REVOKED_ADDR 128 // 256 to 511 is free
+#define EEPROM_BENCHMARK_ADDR 512
+#define EEPROM_LOCKDOWN_ADDR 704
+#define EEPROM_POWER_ADDR 768
+#define EEPROM_DECISION_CACHE_ADDR 1024
+#define EEPROM_DECISION_CACHE_END 1536
+
+// CRC-32 used to validate persisted records
+inline uint32_t recordChecksum(const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc ^= bytes[i];
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef PowerMonitor_h
+#define PowerMonitor_h
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <IRQManager.h>
+
+#include "PersistentLayout.h"
+
+// RA4M1 voltage monitor 1 level (LVDLVLR.LVD1LVL). 0x02 trips at 4.02 V on
+// the 5 V rail, early enough for the SD card to finish its writes before the
+// 3.3 V regulator drops out.
+#ifndef POWER_FAIL_LVD_LEVEL
+#define POWER_FAIL_LVD_LEVEL 0x02
+#endif
+
+// Power failure warning from the RA4M1 low-voltage detector. The interrupt
+// only raises a flag, the storage code polls failing() between SD writes and
+// runs the emergency flush itself, so the SD card and SPI bus are never
+// touched from interrupt context.
+//
+// A marker in data flash tells the next boot whether the last power loss was
+// caught: it reads RUNNING while the firmware runs and CLEAN once the
+// emergency flush completed, with the time the flush took.
+class PowerMonitor
+{
+public:
+    enum LastShutdown
+    {
+        SHUTDOWN_FIRST_BOOT,
+        SHUTDOWN_CLEAN,
+        SHUTDOWN_UNCLEAN
+    };
+
+private:
+    static const uint32_t RECORD_MAGIC = 0x50574D31; // "PWM1"
+    static const uint8_t STATE_RUNNING = 1;
+    static const uint8_t STATE_CLEAN = 2;
+    static const uint8_t IRQ_PRIORITY = 1; // Above everything but the fault handlers
+
+    struct Record
+    {
+        uint32_t magic;
+        uint8_t state;
+        uint16_t flushMs; // Emergency flush time of a clean shutdown
+        uint32_t checksum;
+    };
+
+    static inline volatile bool lowVoltage = false;
+    static inline IRQn_Type irq = FSP_INVALID_VECTOR;
+
+    LastShutdown lastShutdown = SHUTDOWN_FIRST_BOOT;
+    uint16_t lastFlushMs = 0;
+
+    static void onLowVoltage()
+    {
+        R_SYSTEM->PRCR = 0xA508;
+        R_SYSTEM->LVD1SR_b.DET = 0;
+        R_SYSTEM->PRCR = 0xA500;
+        R_BSP_IrqStatusClear(irq);
+        lowVoltage = true;
+    }
+
+    void writeState(uint8_t state, uint16_t flushMs)
+    {
+        Record record;
+        memset(&record, 0, sizeof(record));
+        record.magic = RECORD_MAGIC;
+        record.state = state;
+        record.flushMs = flushMs;
+        record.checksum = recordChecksum(&record, offsetof(Record, checksum));
+        EEPROM.put(EEPROM_POWER_ADDR, record);
+    }
+
+    // Voltage monitor 1 as a maskable interrupt on a falling VCC, following
+    // the setting procedure of the RA4M1 hardware manual
+    bool enableDetector()
+    {
+        R_SYSTEM->PRCR = 0xA508;
+        R_SYSTEM->LVD1CR0_b.RIE = 0;
+        R_SYSTEM->LVCMPCR_b.LVD1E = 0;
+        R_SYSTEM->LVDLVLR_b.LVD1LVL = POWER_FAIL_LVD_LEVEL;
+        R_SYSTEM->LVD1CR0_b.DFDIS = 1;  // No digital filter, detect as early as possible
+        R_SYSTEM->LVD1CR1_b.IDTSEL = 1; // VCC falling below the level
+        R_SYSTEM->LVD1CR1_b.IRQSEL = 1; // Maskable interrupt
+        R_SYSTEM->LVCMPCR_b.LVD1E = 1;
+        delayMicroseconds(300); // Comparator stabilization
+        R_SYSTEM->LVD1CR0_b.CMPE = 1;
+        R_SYSTEM->LVD1SR_b.DET = 0;
+        R_SYSTEM->LVD1CR0_b.RI = 0; // Interrupt, not reset
+        R_SYSTEM->LVD1CR0_b.RIE = 1;
+        R_SYSTEM->PRCR = 0xA500;
+
+        GenericIrqCfg_t config;
+        config.irq = FSP_INVALID_VECTOR;
+        config.ipl = IRQ_PRIORITY;
+        config.event = ELC_EVENT_LVD_LVD1;
+        if (!IRQManager::getInstance().addGenericInterrupt(config, onLowVoltage))
+        {
+            return false;
+        }
+        irq = config.irq;
+        return true;
+    }
+
+public:
+    // Read the marker of the last shutdown, mark this run and start
+    // watching VCC. Call once from setup().
+    void begin()
+    {
+        Record record;
+        EEPROM.get(EEPROM_POWER_ADDR, record);
+        if (record.magic == RECORD_MAGIC && record.checksum == recordChecksum(&record, offsetof(Record, checksum)))
+        {
+            lastShutdown = record.state == STATE_CLEAN ? SHUTDOWN_CLEAN : SHUTDOWN_UNCLEAN;
+            lastFlushMs = record.flushMs;
+        }
+        writeState(STATE_RUNNING, 0);
+
+        if (!enableDetector())
+        {
+            Serial.println("Low-voltage interrupt unavailable, power loss is not detected");
+        }
+    }
+
+    // Whether VCC has dropped below the detection level
+    bool failing() const
+    {
+        return lowVoltage;
+    }
+
+    // Whether VCC is back above the detection level, e.g. after a short dip
+    bool restored() const
+    {
+        return R_SYSTEM->LVD1SR_b.MON == 1;
+    }
+
+    // Record that buffered data reached the card, taking flushMs of the
+    // hold-up time
+    void recordCleanShutdown(unsigned long flushMs)
+    {
+        writeState(STATE_CLEAN, min(flushMs, 65535UL));
+    }
+
+    // Resume normal operation after a dip the supply recovered from
+    void resume()
+    {
+        writeState(STATE_RUNNING, 0);
+        lowVoltage = false;
+    }
+
+    LastShutdown lastShutdownState() const
+    {
+        return lastShutdown;
+    }
+
+    uint16_t lastFlushTime() const
+    {
+        return lastFlushMs;
+    }
+};
+
+#endif
@@ -4,75 +4,91 @@
 #include <Arduino.h>
 #include <MFRC522.h>
 #include <ArduinoJson.h>
-#include <ArduinoBearSSL.h> // This library is required for AES128
-#include <AES128.h>
-
-// Include SCE5 headers for hardware RNG
-#ifdef __cplusplus
-extern "C"
-{
-#endif
-#include <hw_sce_private.h>
-#include <hw_sce_trng_private.h>
-#ifdef __cplusplus
-}
-#endif
+#include <ArduinoBearSSL.h> // This library is required for the BearSSL AES primitives
 
 #include "arduino_secrets.h"
+#include "BridgeTransport.h"
+#include "DnsCache.h"
+#include "HttpHeaders.h"
+#include "SecureRandom.h"
+#include "KeyStore.h"
+#include "DecisionCache.h"
+#include "ServerLoad.h"
+#include "MemoryBudget.h"
+
+#ifndef OVERLOAD_GRACE_S
+#define OVERLOAD_GRACE_S 3600 // Extra validity of signed grants while the server is overloaded
+#endif
 
 class RFIDAuth
 {
+public:
+    static const size_t JSON_BUFFER_SIZE = 180;
+    static const size_t RESPONSE_BUFFER_SIZE = 512;
+    static const size_t REQUEST_TEMPLATE_SIZE = 384;
+    static const size_t TRACE_ID_SIZE = 8;
+
+    enum AuthResult
+    {
+        AUTH_PENDING,
+        AUTH_GRANTED,
+        AUTH_DENIED,
+        AUTH_FAILED
+    };
+
+    // Stage timings of the last request. The split of the round trip into
+    // network up and down is an estimate: the time to the first response
+    // byte, less the server's own time, counts half each way.
+    struct RequestTrace
+    {
+        char id[2 * TRACE_ID_SIZE + 1]; // Hex, also sent in X-Trace
+        unsigned long readUs;           // Card anticollision and select
+        unsigned long encryptUs;        // Patching the prepared request
+        unsigned long dnsMs;            // Resolving the server, 0 when cached
+        unsigned long connectMs;        // Counted as network up
+        unsigned long upMs;
+        unsigned long serverMs;         // From the server's Server-Timing header
+        unsigned long downMs;
+        unsigned long totalMs;          // Connect to the complete response
+        bool hasServerTiming;
+    };
+
 private:
     static const size_t AES_BLOCK_SIZE = 16;
     static const unsigned long REQUEST_TIMEOUT_MS = 5000;
-    static const size_t JSON_BUFFER_SIZE = 180;
 
     const char *serverAddress;
     int serverPort;
     const char *deviceUUID;
-    WiFiClient client;
-    uint8_t aesKey[AES_BLOCK_SIZE] = AES_KEY;
-    bool sce5Initialized = false;
-
-    // Initialize the SCE5 module for secure random number generation
-    bool initializeSCE5()
-    {
-        if (sce5Initialized)
-            return true;
-
-        HW_SCE_PowerOn();
-        fsp_err_t err = HW_SCE_McuSpecificInit();
-        if (err != FSP_SUCCESS)
-        {
-            Serial.println("Failed to initialize SCE5!");
-            return false;
-        }
-
-        sce5Initialized = true;
-        return true;
-    }
+    BridgeTransport transport;
+    DnsCache resolver;
+    char responseBuffer[RESPONSE_BUFFER_SIZE];
+    KeyStore keyStore;
+    DecisionCache decisionCache;
+    ServerLoad serverLoad;
+    MFRC522::Uid pendingUid;
+    uint64_t pendingBadge = 0; // Fingerprint of pendingUid, given by the caller
+    bool requestPending = false;
+
+    // Next request, prepared while idle with everything but the ciphertext
+    char requestTemplate[REQUEST_TEMPLATE_SIZE];
+    size_t requestLength = 0;
+    char *contentField = nullptr; // 32 hex characters patched per tap
+    uint8_t templateIV[AES_BLOCK_SIZE];
+    uint8_t templateKeyId = 0;
+    bool templateReady = false;
+    char templateTraceId[2 * TRACE_ID_SIZE + 1];
+    char *traceField = nullptr; // Fixed-width X-Trace value patched per tap
+    size_t traceFieldLength = 0;
+    RequestTrace trace;
+    unsigned long sentTime = 0;
+    AuthResult simulatedResult = AUTH_PENDING; // AUTH_PENDING when the real server is asked
+    unsigned long simulatedLatencyMs = 0;
 
     // Generate a cryptographically secure random IV using hardware TRNG
     bool generateSecureRandomIV(uint8_t *iv)
     {
-        if (!initializeSCE5())
-        {
-            return false;
-        }
-
-        // SCE5 generates 128-bit (16-byte) random numbers
-        uint32_t random_data[4] = {0}; // 4 x 32-bit = 128-bit
-        fsp_err_t err = HW_SCE_RNG_Read(random_data);
-
-        if (err != FSP_SUCCESS)
-        {
-            Serial.println("Failed to generate random IV!");
-            return false;
-        }
-
-        // Copy the random data to the IV buffer
-        memcpy(iv, random_data, AES_BLOCK_SIZE);
-        return true;
+        return SecureRandom::fillBlock(iv);
     }
 
     // Convert RFID UID to HEX format string
@@ -92,198 +108,565 @@ private:
         return result;
     }
 
-    // Helper function to convert byte array to hex string (ASCII)
-    String byteArrayToHexString(uint8_t *array, size_t size)
+    // Find a response header by name (case-insensitive), returns its value
+    // or nullptr
+    const char *findHeader(const char *name)
     {
-        const char hexChars[] = "0123456789abcdef";
-        String result;
-        result.reserve(size * 2);
+        return findHttpHeader(responseBuffer, name);
+    }
 
-        for (size_t i = 0; i < size; i++)
+    // Cache a grant if it carries a valid server signature:
+    //   X-Decision-Signature: <valid seconds>,<HMAC-SHA256 hex>
+    // The HMAC is keyed with the current request key and covers the text
+    // "<device UUID>|<trace ID>|<UID hex>|<valid seconds>". As in
+    // confirmLoadReport() the fresh trace ID ties the signature to this
+    // request, a captured one cannot be replayed later to refresh a grant.
+    void recordSignedDecision(const MFRC522::Uid &uid, uint64_t badge, uint32_t now)
+    {
+        const char *signature = findHeader("X-Decision-Signature");
+        if (!signature)
         {
-            uint8_t byte = array[i];
-            result += hexChars[byte >> 4];
-            result += hexChars[byte & 0x0F];
+            return;
         }
 
-        return result;
+        char *cursor;
+        unsigned long validSeconds = strtoul(signature, &cursor, 10);
+        uint8_t tag[KeyStore::TAG_SIZE];
+        if (*cursor != ',' || !parseHex(cursor + 1, tag, sizeof(tag)))
+        {
+            Serial.println("Malformed X-Decision-Signature header");
+            return;
+        }
+
+        char message[112];
+        int length = snprintf(message, sizeof(message), "%s|%s|%s|%lu", deviceUUID, trace.id,
+                              formatUID((byte *)uid.uidByte, uid.size).c_str(), validSeconds);
+        if (length <= 0 || length >= (int)sizeof(message) || !keyStore.verifyTag(message, length, tag))
+        {
+            Serial.println("Decision signature rejected");
+            return;
+        }
+
+        decisionCache.recordGrant(badge, now, now + validSeconds);
     }
 
-    // Debug print function
-    void printBytes(const char *label, uint8_t *data, size_t size)
+    // Confirm the load report of the response if the server signed it:
+    //   X-Server-Load-Signature: <HMAC-SHA256 hex>
+    // keyed with the current request key over
+    // "<device UUID>|<trace ID>|<X-Server-Load value>". The trace ID is
+    // fresh for every request, so a signed report cannot be replayed.
+    void confirmLoadReport()
     {
-        Serial.print(label);
-        Serial.print(" [");
-        for (size_t i = 0; i < size; i++)
+        const char *level = findHeader("X-Server-Load");
+        const char *signature = findHeader("X-Server-Load-Signature");
+        if (!level || !signature)
+        {
+            return;
+        }
+
+        uint8_t tag[KeyStore::TAG_SIZE];
+        char message[96];
+        int length = snprintf(message, sizeof(message), "%s|%s|%d", deviceUUID, trace.id, atoi(level));
+        if (!parseHex(signature, tag, sizeof(tag)) || length <= 0 || length >= (int)sizeof(message) ||
+            !keyStore.verifyTag(message, length, tag))
         {
-            if (i > 0)
-                Serial.print(" ");
-            Serial.print(data[i], DEC);
+            Serial.println("Server load signature rejected");
+            return;
         }
-        Serial.print("] HEX: ");
-        Serial.println(byteArrayToHexString(data, size));
+        serverLoad.confirmLoad();
+    }
+
+    // X-Trace value: trace ID and device stage times, zero-padded to a fixed
+    // width so it can be patched into the prepared request
+    static int formatTrace(char *out, size_t size, const char *id, unsigned long readUs,
+                           unsigned long encryptUs, unsigned long dnsMs, unsigned long connectMs)
+    {
+        return snprintf(out, size, "%s;read=%06lu;enc=%06lu;dns=%05lu;conn=%05lu", id, min(readUs, 999999UL),
+                        min(encryptUs, 999999UL), min(dnsMs, 99999UL), min(connectMs, 99999UL));
+    }
+
+    // Write the stage times measured so far over the X-Trace placeholder
+    void patchTrace()
+    {
+        char value[64];
+        formatTrace(value, sizeof(value), trace.id, trace.readUs, trace.encryptUs, trace.dnsMs,
+                    trace.connectMs);
+        memcpy(traceField, value, traceFieldLength);
     }
 
-    // Encrypt the UID using AES-128-CBC with random IV
-    bool encryptUID(byte *uidBytes, byte size, String &encryptedContent, String &ivHex)
+    // Split the round trip once the response is complete, using the
+    // server's time from "Server-Timing: <name>;dur=<ms>" when present
+    void finishTrace()
     {
-        // Generate a new random IV
+        unsigned long now = millis();
+        unsigned long firstByte = transport.firstByteTime();
+        trace.totalMs = trace.connectMs + (now - sentTime);
+
+        trace.hasServerTiming = false;
+        trace.serverMs = 0;
+        const char *timing = findHeader("Server-Timing");
+        const char *duration = timing ? strstr(timing, "dur=") : nullptr;
+        if (duration && duration < timing + strcspn(timing, "\r\n"))
+        {
+            trace.serverMs = (unsigned long)(strtod(duration + 4, nullptr) + 0.5);
+            trace.hasServerTiming = true;
+        }
+
+        unsigned long toFirstByte = firstByte - sentTime;
+        unsigned long network = toFirstByte > trace.serverMs ? toFirstByte - trace.serverMs : 0;
+        trace.upMs = trace.connectMs + network / 2;
+        trace.downMs = network - network / 2 + (now - firstByte);
+    }
+
+    // Fill the prepared request with the encrypted UID: one AES block under
+    // the template IV, written as hex over the content placeholder
+    void patchRequest(const MFRC522::Uid &uid)
+    {
+        // UID bytes with PKCS7 padding
+        uint8_t block[AES_BLOCK_SIZE];
+        memcpy(block, uid.uidByte, uid.size);
+        memset(block + uid.size, AES_BLOCK_SIZE - uid.size, AES_BLOCK_SIZE - uid.size);
+
         uint8_t iv[AES_BLOCK_SIZE];
-        if (!generateSecureRandomIV(iv))
+        memcpy(iv, templateIV, AES_BLOCK_SIZE);
+        keyStore.encrypt(block, AES_BLOCK_SIZE, iv);
+        writeHex(contentField, block, AES_BLOCK_SIZE);
+
+        // An IV is used for one request only
+        templateReady = false;
+    }
+
+public:
+    RFIDAuth(const char *server, int port, const char *uuid)
+    {
+        serverAddress = server;
+        serverPort = port;
+        deviceUUID = uuid;
+    }
+
+    // Load the request keys and saved decisions, call once from setup()
+    void begin()
+    {
+        keyStore.begin();
+        resolver.begin(serverAddress);
+        if (decisionCache.load())
         {
-            Serial.println("Failed to generate secure IV!");
-            return false;
+            Serial.println("Decision cache restored");
         }
+    }
+
+    // Keep the decision cache across a restart, e.g. before a firmware switch
+    void saveState()
+    {
+        decisionCache.save();
+    }
+
+    // Whether the badge holds a recent signed grant good for a provisional
+    // entry. Signed grants stay good for OVERLOAD_GRACE_S longer while the
+    // server reports overload in a signed load report.
+    bool hasTrustedDecision(uint64_t badge, uint32_t now)
+    {
+        return decisionCache.isTrusted(badge, now, serverLoad.confirmedOverload() ? OVERLOAD_GRACE_S : 0);
+    }
 
-        // Store IV hex string before encryption
-        ivHex = byteArrayToHexString(iv, AES_BLOCK_SIZE);
+    // Stage timings of the last request sent by beginAuthorization()
+    const RequestTrace &lastTrace() const
+    {
+        return trace;
+    }
 
-        // First convert UID to hex string format
-        String formattedUID = formatUID(uidBytes, size);
-        Serial.print("Formatted UID (hex): ");
-        Serial.println(formattedUID);
+    // Whether the server asked for load to be shed, see ServerLoad
+    bool serverOverloaded() const
+    {
+        return serverLoad.overloaded();
+    }
 
-        // Calculate exact number of bytes needed for the UID
-        size_t uidByteLength = size;
+    // Whether the server signed its overload report, see confirmLoadReport()
+    bool overloadConfirmed() const
+    {
+        return serverLoad.confirmedOverload();
+    }
+
+    // Whether the server must not be asked at all for now
+    bool serverBusy() const
+    {
+        return serverLoad.backingOff();
+    }
+
+    // Forget the signed grants of a badge, e.g. when it is revoked centrally
+    void revokeDecision(uint64_t badge)
+    {
+        decisionCache.revoke(badge);
+    }
 
-        // Prepare input buffer with padding
-        uint8_t input[AES_BLOCK_SIZE] = {0}; // AES block size
+    // Firmware offer carried by the last response, if any:
+    //   X-Firmware-Update: <version> <image url> <SHA-256 hex> <tag hex>
+    // The tag is HMAC-SHA256 under the current request key over
+    // "<device UUID>|<version>|<image url>|<SHA-256 lowercase hex>", like a
+    // decision signature. Unsigned or badly signed offers are ignored.
+    bool firmwareOffer(uint16_t &version, char *url, size_t size, uint8_t *digest)
+    {
+        const char *offer = findHeader("X-Firmware-Update");
+        if (!offer)
+        {
+            return false;
+        }
+
+        char *cursor;
+        unsigned long offered = strtoul(offer, &cursor, 10);
+        while (*cursor == ' ')
+        {
+            cursor++;
+        }
+
+        size_t length = strcspn(cursor, " \r\n");
+        const char *digestHex = cursor + length + 1;
+        uint8_t tag[KeyStore::TAG_SIZE];
+        if (offered == 0 || offered > UINT16_MAX || length == 0 || length >= size || cursor[length] != ' ' ||
+            !parseHex(digestHex, digest, br_sha256_SIZE) || digestHex[2 * br_sha256_SIZE] != ' ' ||
+            !parseHex(digestHex + 2 * br_sha256_SIZE + 1, tag, sizeof(tag)))
+        {
+            Serial.println("Malformed or unsigned X-Firmware-Update header");
+            return false;
+        }
+        version = offered;
+        memcpy(url, cursor, length);
+        url[length] = '\0';
+
+        char canonical[2 * br_sha256_SIZE + 1];
+        writeHex(canonical, digest, br_sha256_SIZE);
+        canonical[2 * br_sha256_SIZE] = '\0';
+        char message[224];
+        int messageLength = snprintf(message, sizeof(message), "%s|%u|%s|%s", deviceUUID, version, url, canonical);
+        if (messageLength <= 0 || messageLength >= (int)sizeof(message) ||
+            !keyStore.verifyTag(message, messageLength, tag))
+        {
+            Serial.println("Firmware offer signature rejected");
+            return false;
+        }
+        return true;
+    }
 
-        // Copy direct UID bytes
-        memcpy(input, uidBytes, uidByteLength);
+    // Prepare the next request while the reader is idle: HTTP headers, device
+    // UUID, key ID and a fresh IV, with a placeholder for the ciphertext.
+    // Cheap to call every loop, it only does work when the template was used
+    // or the key changed.
+    bool prepareRequest()
+    {
+        if (templateReady && templateKeyId == keyStore.currentKeyId())
+        {
+            return true;
+        }
 
-        // Add PKCS7 padding
-        size_t padLength = AES_BLOCK_SIZE - (uidByteLength % AES_BLOCK_SIZE); // Calculate padding length
-        for (size_t i = uidByteLength; i < AES_BLOCK_SIZE; i++)
+        templateReady = false;
+        uint8_t traceId[AES_BLOCK_SIZE];
+        if (!generateSecureRandomIV(templateIV) || !SecureRandom::fillBlock(traceId))
         {
-            input[i] = padLength;
+            return false;
         }
 
-        printBytes("Input before encryption", input, AES_BLOCK_SIZE);
-        printBytes("Random IV", iv, AES_BLOCK_SIZE);
+        char traceValue[64];
+        writeHex(templateTraceId, traceId, TRACE_ID_SIZE);
+        templateTraceId[2 * TRACE_ID_SIZE] = '\0';
+        traceFieldLength = formatTrace(traceValue, sizeof(traceValue), templateTraceId, 0, 0, 0, 0);
+
+        char ivHex[2 * AES_BLOCK_SIZE + 1];
+        char placeholder[2 * AES_BLOCK_SIZE + 1];
+        writeHex(ivHex, templateIV, AES_BLOCK_SIZE);
+        ivHex[2 * AES_BLOCK_SIZE] = '\0';
+        memset(placeholder, '0', 2 * AES_BLOCK_SIZE);
+        placeholder[2 * AES_BLOCK_SIZE] = '\0';
+
+        StaticJsonDocument<JSON_BUFFER_SIZE> doc;
+        doc["UUID"] = deviceUUID;
+        doc["kid"] = keyStore.currentKeyId();
+        doc["iv"] = (const char *)ivHex;
+        doc["content"] = (const char *)placeholder;
+
+        size_t bodyLength = measureJson(doc);
+        int headerLength = snprintf(requestTemplate, REQUEST_TEMPLATE_SIZE,
+                                    "POST / HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\n"
+                                    "Content-Length: %u\r\nX-Trace: %s\r\nConnection: close\r\n\r\n",
+                                    serverAddress, (unsigned)bodyLength, traceValue);
+        if (headerLength <= 0 || headerLength + bodyLength >= REQUEST_TEMPLATE_SIZE)
+        {
+            Serial.println("Request template too large!");
+            return false;
+        }
 
-        // Encrypt the padded data
-        AES128.runEnc(aesKey, AES_BLOCK_SIZE, input, AES_BLOCK_SIZE, iv);
+        char *body = requestTemplate + headerLength;
+        serializeJson(doc, body, REQUEST_TEMPLATE_SIZE - headerLength);
+        contentField = strstr(body, "\"content\":\"");
+        if (!contentField)
+        {
+            return false;
+        }
 
-        printBytes("Encrypted bytes", input, AES_BLOCK_SIZE);
+        contentField += strlen("\"content\":\"");
+        traceField = strstr(requestTemplate, "X-Trace: ") + strlen("X-Trace: ");
+        requestLength = headerLength + bodyLength;
+        templateKeyId = keyStore.currentKeyId();
+        templateReady = true;
+        return true;
+    }
 
-        // Convert encrypted data to hex string
-        encryptedContent = byteArrayToHexString(input, AES_BLOCK_SIZE);
+    // Average time to encrypt one AES block with the current key schedule
+    unsigned long measureBlockEncryptNanos(uint16_t blocks)
+    {
+        uint8_t block[AES_BLOCK_SIZE] = {0};
+        uint8_t iv[AES_BLOCK_SIZE] = {0};
 
-        Serial.print("IV (hex): ");
-        Serial.println(ivHex);
-        Serial.print("Encrypted content (hex): ");
-        Serial.println(encryptedContent);
+        unsigned long start = micros();
+        for (uint16_t i = 0; i < blocks; i++)
+        {
+            keyStore.encrypt(block, AES_BLOCK_SIZE, iv);
+        }
+        return (micros() - start) * 1000UL / blocks;
+    }
 
+    // Connect to the server's cached address, dnsMs is the time spent
+    // resolving it when the cache had to
+    bool connectServer(unsigned long &dnsMs)
+    {
+        IPAddress address;
+        if (!resolver.lookup(address, dnsMs))
+        {
+            return false;
+        }
+        if (!transport.connect(address, serverPort))
+        {
+            resolver.connectFailed();
+            return false;
+        }
         return true;
     }
 
-public:
-    RFIDAuth(const char *server, int port, const char *uuid)
+    // Resolve the server ahead of the cached address expiring, call with
+    // the modem held and only while no request is pending: the lookup
+    // blocks until the resolver answers
+    void refreshAddress()
     {
-        serverAddress = server;
-        serverPort = port;
-        deviceUUID = uuid;
+        if (!requestPending)
+        {
+            resolver.refresh();
+        }
     }
 
-    bool checkCardAuthorization(MFRC522::Uid uid)
+    // Time a minimal HEAD request to the server, returns 0 if it failed.
+    // Must not be called while an authorization is pending.
+    unsigned long measureRoundTripMs()
     {
+        unsigned long start = millis();
+        unsigned long dnsMs;
+        if (requestPending || !connectServer(dnsMs))
+        {
+            return 0;
+        }
+
+        transport.print("HEAD / HTTP/1.1\r\nHost: ");
+        transport.print(serverAddress);
+        transport.print("\r\nConnection: close\r\n\r\n");
+        bool sent = transport.sendBuffered();
+        int length = sent ? transport.readResponse(responseBuffer, RESPONSE_BUFFER_SIZE, REQUEST_TIMEOUT_MS) : -1;
+        transport.stop();
+        responseBuffer[0] = '\0';
+
+        return length > 0 ? max(millis() - start, 1UL) : 0;
+    }
+
+    // Answer the following authorizations here instead of asking the server,
+    // for the saturation benchmark. Requests are still built and encrypted,
+    // then answered with result after latencyMs. Simulated answers are not
+    // cached. stopSimulation() goes back to the server.
+    void simulateServer(AuthResult result, unsigned long latencyMs)
+    {
+        simulatedResult = result;
+        simulatedLatencyMs = latencyMs;
+    }
+
+    void stopSimulation()
+    {
+        simulatedResult = AUTH_PENDING;
+    }
+
+    // Send the authorization request for a card. The answer is collected by
+    // pollAuthorization() so the caller keeps running while the server works.
+    // Uses the template from prepareRequest(), which is built here if the
+    // loop has not done so yet. badge is the card's UID fingerprint, the key
+    // of the decision cache. readUs is the time the card read took, sent
+    // with the other stage times in the X-Trace header.
+    bool beginAuthorization(const MFRC522::Uid &uid, uint64_t badge, unsigned long readUs)
+    {
+        requestPending = false;
+        responseBuffer[0] = '\0';
+        transport.resetTransactionCount();
+        if (serverLoad.backingOff())
+        {
+            Serial.print("Server busy, retry in ");
+            Serial.print(serverLoad.retryAfterS());
+            Serial.println(" s");
+            return false;
+        }
+        if (!prepareRequest())
+        {
+            Serial.println("Encryption failed!");
+            return false;
+        }
+        unsigned long encryptStart = micros();
+        patchRequest(uid);
+        memcpy(trace.id, templateTraceId, sizeof(trace.id));
+        trace.readUs = readUs;
+        trace.encryptUs = micros() - encryptStart;
+
+        if (simulatedResult != AUTH_PENDING)
+        {
+            trace.dnsMs = 0;
+            trace.connectMs = 0;
+            trace.hasServerTiming = false;
+            pendingUid = uid;
+            pendingBadge = badge;
+            requestPending = true;
+            sentTime = millis();
+            return true;
+        }
+
         Serial.print("Attempting to connect to server: ");
         Serial.print(serverAddress);
         Serial.print(":");
         Serial.println(serverPort);
 
-        if (!client.connect(serverAddress, serverPort))
+        unsigned long connectStart = millis();
+        if (!connectServer(trace.dnsMs))
         {
             Serial.println("Connection failed!");
             return false;
         }
+        trace.connectMs = millis() - connectStart - trace.dnsMs;
+        patchTrace();
 
-        Serial.println("Connected to server successfully");
-
-        // Encrypt the card UID and get IV separately
-        String encryptedContent, ivHex;
-        if (!encryptUID(uid.uidByte, uid.size, encryptedContent, ivHex))
+        // Send the whole HTTP POST request in one bridge write
+        transport.write((const uint8_t *)requestTemplate, requestLength);
+        if (!transport.sendBuffered())
         {
-            Serial.println("Encryption failed!");
-            client.stop();
+            Serial.println("Send failed!");
+            transport.stop();
             return false;
         }
 
-        // Create JSON request
-        StaticJsonDocument<JSON_BUFFER_SIZE> doc;
-        doc["UUID"] = deviceUUID;
-        doc["iv"] = ivHex;
-        doc["content"] = encryptedContent;
-
-        String jsonString;
-        serializeJson(doc, jsonString);
-
-        Serial.print("Sending request: ");
-        Serial.println(jsonString);
-
-        // Send HTTP POST request
-        client.println("POST / HTTP/1.1");
-        client.print("Host: ");
-        client.println(serverAddress);
-        client.println("Content-Type: application/json");
-        client.print("Content-Length: ");
-        client.println(jsonString.length());
-        client.println("Connection: close");
-        client.println();
-        client.println(jsonString);
-
-        // Wait for response with timeout
-        unsigned long timeout = millis();
-        while (client.available() == 0)
-        {
-            if (millis() - timeout > REQUEST_TIMEOUT_MS)
+        Serial.print("Sent request for UID ");
+        Serial.print(formatUID((byte *)uid.uidByte, uid.size));
+        Serial.print(": ");
+        Serial.println(strstr(requestTemplate, "\r\n\r\n") + 4);
+
+        pendingUid = uid;
+        pendingBadge = badge;
+        requestPending = true;
+        sentTime = millis();
+        transport.beginResponse(REQUEST_TIMEOUT_MS);
+        return true;
+    }
+
+    // Collect the answer to the request sent by beginAuthorization() in
+    // bridge-sized chunks, never waits. now is the RTC time in seconds.
+    AuthResult pollAuthorization(uint32_t now)
+    {
+        if (!requestPending)
+        {
+            return AUTH_FAILED;
+        }
+
+        if (simulatedResult != AUTH_PENDING)
+        {
+            if (millis() - sentTime < simulatedLatencyMs)
             {
-                Serial.println("Request timeout!");
-                client.stop();
-                return false;
+                return AUTH_PENDING;
             }
+            requestPending = false;
+            trace.totalMs = millis() - sentTime;
+            return simulatedResult;
         }
 
-        Serial.println("Received response from server:");
+        BridgeTransport::ResponseStatus status = transport.pollResponse(responseBuffer, RESPONSE_BUFFER_SIZE);
+        if (status == BridgeTransport::RESPONSE_PENDING)
+        {
+            return AUTH_PENDING;
+        }
 
-        // Read response headers
-        bool authorized = false;
-        while (client.connected())
+        requestPending = false;
+        if (status == BridgeTransport::RESPONSE_TIMEOUT)
         {
-            String line = client.readStringUntil('\n');
-            Serial.println(line);
-            if (line.startsWith("HTTP/1.1"))
-            {
-                authorized = (line.indexOf("200") > 0);
-            }
-            if (line == "\r")
-            {
-                break;
-            }
+            trace.totalMs = trace.connectMs + (millis() - sentTime);
+            trace.hasServerTiming = false;
+            Serial.println("Request timeout!");
+            transport.stop();
+            serverLoad.recordTimeout();
+            return AUTH_FAILED;
         }
 
-        // Read response body
-        String response = "";
-        while (client.available())
+        Serial.println("Received response from server:");
+        Serial.println(responseBuffer);
+        finishTrace();
+        serverLoad.update(responseBuffer);
+        confirmLoadReport();
+
+        // A server error is no decision, cached grants are kept
+        if (strncmp(responseBuffer, "HTTP/1.1 5", 10) == 0)
         {
-            response += (char)client.read();
+            Serial.println("Server error");
+            transport.stop();
+            return AUTH_FAILED;
         }
-        Serial.print("Response body: ");
+
+        // Status line decides the outcome, the body carries the user name
+        bool authorized = strncmp(responseBuffer, "HTTP/1.1 200", 12) == 0;
+        const char *body = strstr(responseBuffer, "\r\n\r\n");
+        body = body ? body + 4 : "";
 
         if (authorized)
         {
             Serial.print("Access granted for user: ");
-            Serial.println(response);
+            Serial.println(body);
         }
         else
         {
             Serial.println("Access denied");
         }
 
-        client.stop();
-        return authorized;
+        transport.stop();
+        keyStore.applyRotationHeaders(responseBuffer);
+
+        if (authorized)
+        {
+            recordSignedDecision(pendingUid, pendingBadge, now);
+        }
+        else
+        {
+            decisionCache.revoke(pendingBadge);
+        }
+
+        Serial.print("Bridge transactions: ");
+        Serial.println(transport.transactionCount());
+        Serial.print("Trace ");
+        Serial.print(trace.id);
+        Serial.print(": up ");
+        Serial.print(trace.upMs);
+        Serial.print(" ms, server ");
+        if (trace.hasServerTiming)
+        {
+            Serial.print(trace.serverMs);
+            Serial.print(" ms");
+        }
+        else
+        {
+            Serial.print("n/a");
+        }
+        Serial.print(", down ");
+        Serial.print(trace.downMs);
+        Serial.println(" ms");
+        return authorized ? AUTH_GRANTED : AUTH_DENIED;
     }
 };
 
+RAM_BUDGET(Auth, BUDGET_AUTH_RAM, sizeof(RFIDAuth));
+
 #endif
\ No newline at end of file
@@ -0,0 +1,457 @@
+#ifndef ReaderDriver_h
+#define ReaderDriver_h
+
+#include <Arduino.h>
+#include <MFRC522.h>
+
+// Optional MFRC522 IRQ pin. Without it the driver reads ComIrqReg on each
+// service() call, with it SPI is only touched once the reader signals.
+// #define READER_IRQ_PIN 12
+
+// Non-blocking MFRC522 driver for card detection and selection: REQA or
+// WUPA, anticollision and SELECT through all cascade levels, and HLTA. The
+// library's PICC_IsNewCardPresent() and PICC_ReadCardSerial() busy-wait on
+// ComIrqReg for every command, up to the 25 ms timer with no card present.
+// Here every command is started and left to the MFRC522, and service()
+// checks it and starts the next one, so each call takes a few SPI transfers
+// per command that has already completed. The selected card ends up in
+// reader.uid as with the library, so the rest of the firmware can keep using
+// the library for everything after selection. The time of each command is kept per command type.
+class ReaderDriver
+{
+public:
+    enum Result : uint8_t
+    {
+        READER_IDLE,    // Nothing in progress, start a request
+        READER_BUSY,    // Command in flight, call service() again
+        READER_NO_CARD, // No answer to REQA or WUPA
+        READER_CARD,    // Card selected, UID and SAK in reader.uid
+        READER_FAILED   // A card answered but selection failed, see status()
+    };
+
+    enum Command : uint8_t
+    {
+        CMD_REQUEST, // REQA or WUPA
+        CMD_ANTICOLL,
+        CMD_SELECT,
+        CMD_HALT,
+        CMD_COUNT
+    };
+
+    struct Timing
+    {
+        uint32_t count;
+        uint32_t totalUs;
+        uint32_t maxUs;
+    };
+
+private:
+    enum State : uint8_t
+    {
+        STATE_IDLE,
+        STATE_REQUEST,
+        STATE_ANTICOLL,
+        STATE_SELECT,
+        STATE_HALT
+    };
+
+    static const uint8_t PICC_CT = 0x88; // Cascade tag
+    static const uint8_t SAK_UID_INCOMPLETE = 0x04;
+    static const uint8_t NVB_SELECT = 0x70;
+
+    // MFRC522 register values
+    static const uint8_t IRQ_ALL = 0x7F;
+    static const uint8_t IRQ_RX_IDLE = 0x30;
+    static const uint8_t IRQ_IDLE = 0x10;
+    static const uint8_t IRQ_TIMER = 0x01;
+    static const uint8_t IRQ_ENABLE = 0xB1; // IRqInv, RxIEn, IdleIEn, TimerIEn
+    static const uint8_t IRQ_PUSH_PULL = 0x80; // DivIEnReg.IRQPushPull
+    static const uint8_t ERROR_FRAMING = 0x13; // BufferOvfl, ParityErr, ProtocolErr
+    static const uint8_t ERROR_COLLISION = 0x08;
+    static const uint8_t ERROR_CRC = 0x04;
+    static const uint8_t COLL_POS_INVALID = 0x20;
+    static const uint8_t VALUES_AFTER_COLL = 0x80;
+    static const uint8_t MODE_CRC = 0x80; // TxCRCEn, RxCRCEn at 106 kbit/s
+    static const uint8_t START_SEND = 0x80;
+    static const uint16_t TIMER_RELOAD = 200; // 5 ms at the library's 40 kHz timer
+    static const unsigned long COMMAND_TIMEOUT_MS = 10; // In case the timer IRQ is missed
+
+    static inline volatile bool irqRaised = false;
+
+    MFRC522 &reader;
+    State state = STATE_IDLE;
+    Command command = CMD_REQUEST;
+    unsigned long commandStart = 0; // micros()
+    unsigned long answeredAt = 0;   // micros() of the last ATQA
+    MFRC522::StatusCode lastStatus = MFRC522::STATUS_OK;
+    uint8_t frame[9]; // SEL, NVB, 4 UID bytes or CT and 3, BCC, CRC
+    uint8_t level = 0;
+    uint8_t knownBits = 0;
+    uint8_t rxAlign = 0;
+    uint8_t uidIndex = 0;
+    uint8_t commandsStarted = 0;
+    Timing timings[CMD_COUNT] = {};
+
+    static void onIrq()
+    {
+        irqRaised = true;
+    }
+
+    void startCommand(Command type, uint8_t pcdCommand, const uint8_t *data, uint8_t length, uint8_t bitFraming,
+                      bool crc)
+    {
+        reader.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Idle);
+        reader.PCD_WriteRegister(MFRC522::TxModeReg, crc ? MODE_CRC : 0x00);
+        reader.PCD_WriteRegister(MFRC522::RxModeReg, crc ? MODE_CRC : 0x00);
+        irqRaised = false;
+        reader.PCD_WriteRegister(MFRC522::ComIrqReg, IRQ_ALL);
+        reader.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80); // Flush
+        reader.PCD_WriteRegister(MFRC522::FIFODataReg, length, (byte *)data);
+        reader.PCD_WriteRegister(MFRC522::BitFramingReg, bitFraming);
+        reader.PCD_WriteRegister(MFRC522::CommandReg, pcdCommand);
+        if (pcdCommand == MFRC522::PCD_Transceive)
+        {
+            reader.PCD_SetRegisterBitMask(MFRC522::BitFramingReg, START_SEND);
+        }
+        command = type;
+        commandStart = micros();
+        commandsStarted++;
+    }
+
+    // Check the command in flight. Returns false while it runs, otherwise
+    // its status, with the received bytes in back and the number of valid
+    // bits of the last one in validBits.
+    bool finished(MFRC522::StatusCode &status, uint8_t *back, uint8_t &backLength, uint8_t &validBits)
+    {
+        uint8_t done = state == STATE_HALT ? IRQ_IDLE : IRQ_RX_IDLE;
+        bool timedOut = (micros() - commandStart) / 1000 > COMMAND_TIMEOUT_MS;
+#ifdef READER_IRQ_PIN
+        if (!irqRaised && !timedOut)
+        {
+            return false;
+        }
+#endif
+        uint8_t irq = reader.PCD_ReadRegister(MFRC522::ComIrqReg);
+        if (!(irq & done))
+        {
+            if (!(irq & IRQ_TIMER) && !timedOut)
+            {
+                return false;
+            }
+            status = MFRC522::STATUS_TIMEOUT;
+            recordTiming();
+            return true;
+        }
+        recordTiming();
+        if (back == nullptr)
+        {
+            status = MFRC522::STATUS_OK;
+            return true;
+        }
+
+        uint8_t error = reader.PCD_ReadRegister(MFRC522::ErrorReg);
+        if (error & ERROR_FRAMING)
+        {
+            status = MFRC522::STATUS_ERROR;
+            return true;
+        }
+        uint8_t received = reader.PCD_ReadRegister(MFRC522::FIFOLevelReg);
+        if (received > backLength)
+        {
+            status = MFRC522::STATUS_NO_ROOM;
+            return true;
+        }
+        backLength = received;
+        reader.PCD_ReadRegister(MFRC522::FIFODataReg, received, back, rxAlign);
+        validBits = reader.PCD_ReadRegister(MFRC522::ControlReg) & 0x07;
+        status = (error & ERROR_COLLISION) ? MFRC522::STATUS_COLLISION
+                 : (error & ERROR_CRC)     ? MFRC522::STATUS_CRC_WRONG
+                                           : MFRC522::STATUS_OK;
+        return true;
+    }
+
+    void recordTiming()
+    {
+        unsigned long us = micros() - commandStart;
+        Timing &timing = timings[command];
+        timing.count++;
+        timing.totalUs += us;
+        timing.maxUs = max(timing.maxUs, (uint32_t)us);
+    }
+
+    void startLevel()
+    {
+        static const uint8_t SEL[] = {MFRC522::PICC_CMD_SEL_CL1, MFRC522::PICC_CMD_SEL_CL2,
+                                      MFRC522::PICC_CMD_SEL_CL3};
+        frame[0] = SEL[level];
+        knownBits = 0;
+        reader.PCD_ClearRegisterBitMask(MFRC522::CollReg, VALUES_AFTER_COLL);
+        startAnticollision();
+    }
+
+    // ANTICOLLISION with the UID bits known so far at this cascade level
+    void startAnticollision()
+    {
+        uint8_t txLastBits = knownBits % 8;
+        uint8_t index = 2 + knownBits / 8;
+        frame[1] = (index << 4) + txLastBits; // NVB
+        rxAlign = txLastBits;
+        state = STATE_ANTICOLL;
+        startCommand(CMD_ANTICOLL, MFRC522::PCD_Transceive, frame, index + (txLastBits ? 1 : 0),
+                     (rxAlign << 4) + txLastBits, false);
+    }
+
+    void startSelect()
+    {
+        frame[1] = NVB_SELECT;
+        frame[6] = frame[2] ^ frame[3] ^ frame[4] ^ frame[5]; // BCC
+        rxAlign = 0;
+        state = STATE_SELECT;
+        startCommand(CMD_SELECT, MFRC522::PCD_Transceive, frame, 7, 0x00, true);
+    }
+
+    Result fail(MFRC522::StatusCode status)
+    {
+        lastStatus = status;
+        state = STATE_IDLE;
+        return READER_FAILED;
+    }
+
+    Result serviceRequest()
+    {
+        MFRC522::StatusCode status;
+        uint8_t atqa[2];
+        uint8_t length = sizeof(atqa);
+        uint8_t validBits = 0;
+        if (!finished(status, atqa, length, validBits))
+        {
+            return READER_BUSY;
+        }
+        if (status == MFRC522::STATUS_TIMEOUT)
+        {
+            state = STATE_IDLE;
+            lastStatus = status;
+            return READER_NO_CARD;
+        }
+        // A collision of ATQAs still means cards are there
+        if (status != MFRC522::STATUS_COLLISION && (status != MFRC522::STATUS_OK || length != 2 || validBits != 0))
+        {
+            return fail(status == MFRC522::STATUS_OK ? MFRC522::STATUS_ERROR : status);
+        }
+
+        answeredAt = micros();
+        level = 0;
+        uidIndex = 0;
+        startLevel();
+        return READER_BUSY;
+    }
+
+    Result serviceAnticollision()
+    {
+        MFRC522::StatusCode status;
+        uint8_t index = 2 + knownBits / 8;
+        uint8_t length = sizeof(frame) - index;
+        uint8_t validBits = 0;
+        if (!finished(status, frame + index, length, validBits))
+        {
+            return READER_BUSY;
+        }
+
+        if (status == MFRC522::STATUS_COLLISION)
+        {
+            // Follow the card with a 1 at the first colliding bit, as the library does
+            uint8_t coll = reader.PCD_ReadRegister(MFRC522::CollReg);
+            if (coll & COLL_POS_INVALID)
+            {
+                return fail(MFRC522::STATUS_COLLISION);
+            }
+            uint8_t position = coll & 0x1F;
+            if (position == 0)
+            {
+                position = 32;
+            }
+            if (position <= knownBits)
+            {
+                return fail(MFRC522::STATUS_INTERNAL_ERROR);
+            }
+            knownBits = position;
+            uint8_t bit = (knownBits - 1) % 8;
+            frame[1 + knownBits / 8 + (knownBits % 8 ? 1 : 0)] |= 1 << bit;
+            startAnticollision();
+            return READER_BUSY;
+        }
+        if (status != MFRC522::STATUS_OK)
+        {
+            return fail(status);
+        }
+
+        knownBits = 32;
+        startSelect();
+        return READER_BUSY;
+    }
+
+    Result serviceSelect()
+    {
+        MFRC522::StatusCode status;
+        uint8_t sak;
+        uint8_t length = 1;
+        uint8_t validBits = 0;
+        if (!finished(status, &sak, length, validBits))
+        {
+            return READER_BUSY;
+        }
+        if (status == MFRC522::STATUS_OK && (length != 1 || validBits != 0))
+        {
+            status = MFRC522::STATUS_ERROR;
+        }
+        if (status != MFRC522::STATUS_OK)
+        {
+            return fail(status);
+        }
+
+        // A cascade tag means more UID bytes on the next level
+        bool cascade = frame[2] == PICC_CT;
+        uint8_t first = cascade ? 3 : 2;
+        memcpy(reader.uid.uidByte + uidIndex, frame + first, 6 - first);
+        uidIndex += 6 - first;
+
+        if ((sak & SAK_UID_INCOMPLETE) && level < 2)
+        {
+            level++;
+            startLevel();
+            return READER_BUSY;
+        }
+        reader.uid.size = uidIndex;
+        reader.uid.sak = sak;
+        reader.PCD_WriteRegister(MFRC522::TxModeReg, 0x00);
+        reader.PCD_WriteRegister(MFRC522::RxModeReg, 0x00);
+        state = STATE_IDLE;
+        return READER_CARD;
+    }
+
+    // Check the command in flight and start the next one once it is done
+    Result step()
+    {
+        switch (state)
+        {
+        case STATE_REQUEST:
+            return serviceRequest();
+        case STATE_ANTICOLL:
+            return serviceAnticollision();
+        case STATE_SELECT:
+            return serviceSelect();
+        case STATE_HALT:
+        {
+            MFRC522::StatusCode status;
+            uint8_t none = 0;
+            uint8_t validBits = 0;
+            if (!finished(status, nullptr, none, validBits))
+            {
+                return READER_BUSY;
+            }
+            reader.PCD_WriteRegister(MFRC522::TxModeReg, 0x00);
+            reader.PCD_WriteRegister(MFRC522::RxModeReg, 0x00);
+            state = STATE_IDLE;
+            return READER_IDLE;
+        }
+        default:
+            return READER_IDLE;
+        }
+    }
+
+public:
+    explicit ReaderDriver(MFRC522 &reader) : reader(reader)
+    {
+    }
+
+    // Call after PCD_Init()
+    void begin()
+    {
+#ifdef READER_IRQ_PIN
+        reader.PCD_WriteRegister(MFRC522::ComIEnReg, IRQ_ENABLE);
+        reader.PCD_WriteRegister(MFRC522::DivIEnReg, IRQ_PUSH_PULL);
+        pinMode(READER_IRQ_PIN, INPUT_PULLUP);
+        attachInterrupt(digitalPinToInterrupt(READER_IRQ_PIN), onIrq, FALLING);
+#endif
+    }
+
+    // Start looking for a card, with WUPA to reach a card the last failed
+    // attempt left idle or halted
+    void request(bool wakeup)
+    {
+        reader.PCD_WriteRegister(MFRC522::TReloadRegH, TIMER_RELOAD >> 8);
+        reader.PCD_WriteRegister(MFRC522::TReloadRegL, TIMER_RELOAD & 0xFF);
+        reader.PCD_WriteRegister(MFRC522::ModWidthReg, 0x26);
+        reader.PCD_ClearRegisterBitMask(MFRC522::CollReg, VALUES_AFTER_COLL);
+        frame[0] = wakeup ? MFRC522::PICC_CMD_WUPA : MFRC522::PICC_CMD_REQA;
+        rxAlign = 0;
+        state = STATE_REQUEST;
+        startCommand(CMD_REQUEST, MFRC522::PCD_Transceive, frame, 1, 0x07, false);
+    }
+
+    // Send HLTA to the selected card. The card does not answer, so the
+    // command is done once the frame has gone out.
+    void halt()
+    {
+        uint8_t hlta[] = {MFRC522::PICC_CMD_HLTA, 0x00};
+        state = STATE_HALT;
+        startCommand(CMD_HALT, MFRC522::PCD_Transmit, hlta, sizeof(hlta), 0x00, true);
+    }
+
+    // Advance the command in flight, never waits. A command that completed
+    // starts the next one, which is checked right away, so a selection is
+    // not spread over several calls by commands the card answers at once.
+    Result service()
+    {
+        Result result;
+        uint8_t started;
+        do
+        {
+            started = commandsStarted;
+            result = step();
+        } while (result == READER_BUSY && commandsStarted != started);
+        return result;
+    }
+
+    bool busy() const
+    {
+        return state != STATE_IDLE;
+    }
+
+    // When the card being selected answered the request
+    unsigned long answerTime() const
+    {
+        return answeredAt;
+    }
+
+    // Why the last selection failed
+    MFRC522::StatusCode status() const
+    {
+        return lastStatus;
+    }
+
+    const Timing &timing(Command type) const
+    {
+        return timings[type];
+    }
+
+    void printTimings() const
+    {
+        static const char *const NAMES[CMD_COUNT] = {"request", "anticoll", "select", "halt"};
+        Serial.print("Reader commands:");
+        for (uint8_t type = 0; type < CMD_COUNT; type++)
+        {
+            const Timing &timing = timings[type];
+            Serial.print(" ");
+            Serial.print(NAMES[type]);
+            Serial.print(" ");
+            Serial.print(timing.count ? timing.totalUs / timing.count : 0);
+            Serial.print("/");
+            Serial.print(timing.maxUs);
+            Serial.print(" us");
+        }
+        Serial.println(" (avg/max)");
+    }
+};
+
+#endif
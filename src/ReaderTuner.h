@@ -0,0 +1,276 @@
+#ifndef ReaderTuner_h
+#define ReaderTuner_h
+
+#include <Arduino.h>
+#include <MFRC522.h>
+
+#ifndef READER_TUNE_WINDOW
+#define READER_TUNE_WINDOW 32 // Card presentations per tuning step
+#endif
+#ifndef READER_MAX_RETRIES
+#define READER_MAX_RETRIES 3
+#endif
+
+// Retry policy for card selection, and tuning of the MFRC522 receiver gain
+// and retry count from the errors seen. The reader driver reports each
+// presentation, a card answering REQA, and its selection results. A select
+// that times out points to a weak signal and raises the gain, CRC errors and
+// collisions with a single card point to an overdriven receiver and lower
+// it. After every READER_TUNE_WINDOW presentations one step is taken, and
+// taken back if the next window has a lower first-attempt success rate.
+// Retries are added while they rescue reads and dropped while they don't.
+// One instance per reader.
+class ReaderTuner
+{
+public:
+    struct Stats
+    {
+        uint32_t presented;    // Cards seen by REQA
+        uint32_t firstAttempt; // UIDs read by the first select
+        uint32_t read;         // UIDs read, with retries
+        uint32_t timeouts;
+        uint32_t crcErrors;
+        uint32_t collisions;
+        uint32_t otherErrors;
+        uint32_t totalUs; // Time to UID of successful reads
+    };
+
+private:
+    static const uint8_t ERROR_RATE_PERCENT = 10; // Share of selects that triggers a gain step
+
+    // Distinct RxGain settings, the datasheet's 0x20 and 0x30 repeat 18 and 23 dB
+    static constexpr uint8_t GAINS[] = {
+        MFRC522::RxGain_18dB, MFRC522::RxGain_23dB, MFRC522::RxGain_33dB,
+        MFRC522::RxGain_38dB, MFRC522::RxGain_43dB, MFRC522::RxGain_48dB};
+    static const uint8_t GAIN_COUNT = sizeof(GAINS);
+
+    struct Window
+    {
+        uint16_t presented;
+        uint16_t firstAttempt;
+        uint16_t selects;
+        uint16_t timeouts;
+        uint16_t garbled; // CRC errors and collisions
+        uint16_t rescued; // Reads that needed a retry
+    };
+
+    MFRC522 &reader;
+    const char *name;
+    Stats totals = {};
+    Window window = {};
+    unsigned long presentationStart = 0;
+    uint8_t attempt = 0;
+    bool inPresentation = false;
+    uint8_t gainIndex = 2;
+    uint8_t retries = 1;
+    int8_t lastStep = 0;             // Gain step taken after the previous window
+    uint8_t lastFirstAttemptPct = 0; // First-attempt success of the previous window
+
+    static uint8_t percent(uint16_t part, uint16_t whole)
+    {
+        return whole ? (uint32_t)part * 100 / whole : 0;
+    }
+
+    void countError(MFRC522::StatusCode status)
+    {
+        window.selects++;
+        switch (status)
+        {
+        case MFRC522::STATUS_OK:
+            break;
+        case MFRC522::STATUS_TIMEOUT:
+            totals.timeouts++;
+            window.timeouts++;
+            break;
+        case MFRC522::STATUS_CRC_WRONG:
+            totals.crcErrors++;
+            window.garbled++;
+            break;
+        case MFRC522::STATUS_COLLISION:
+            totals.collisions++;
+            window.garbled++;
+            break;
+        default:
+            totals.otherErrors++;
+            break;
+        }
+    }
+
+    void endPresentation()
+    {
+        inPresentation = false;
+        if (window.presented >= READER_TUNE_WINDOW)
+        {
+            tune();
+        }
+    }
+
+    void setGain(uint8_t index)
+    {
+        gainIndex = index;
+        reader.PCD_SetAntennaGain(GAINS[gainIndex]);
+    }
+
+    void tune()
+    {
+        uint8_t firstAttemptPct = percent(window.firstAttempt, window.presented);
+
+        // The last step made first reads worse, take it back and hold
+        int8_t step = 0;
+        if (lastStep != 0 && firstAttemptPct < lastFirstAttemptPct)
+        {
+            step = -lastStep;
+        }
+        else if (percent(window.timeouts, window.selects) >= ERROR_RATE_PERCENT && gainIndex < GAIN_COUNT - 1)
+        {
+            step = 1;
+        }
+        else if (percent(window.garbled, window.selects) >= ERROR_RATE_PERCENT && gainIndex > 0)
+        {
+            step = -1;
+        }
+        if (step != 0)
+        {
+            setGain(gainIndex + step);
+        }
+        lastStep = lastStep != 0 && step == -lastStep ? 0 : step;
+        lastFirstAttemptPct = firstAttemptPct;
+
+        if (window.rescued > 0 && retries < READER_MAX_RETRIES)
+        {
+            retries++;
+        }
+        else if (window.rescued == 0 && window.presented == window.firstAttempt && retries > 1)
+        {
+            retries--;
+        }
+
+        if (step != 0)
+        {
+            Serial.print("Reader ");
+            Serial.print(name);
+            Serial.print(": first reads ");
+            Serial.print(firstAttemptPct);
+            Serial.print("%, antenna gain now ");
+            Serial.print(gainDb());
+            Serial.println(" dB");
+        }
+        window = {};
+    }
+
+public:
+    ReaderTuner(MFRC522 &reader, const char *name) : reader(reader), name(name)
+    {
+    }
+
+    // Start from the gain the reader was initialized with. Call after
+    // PCD_Init().
+    void begin()
+    {
+        uint8_t gain = reader.PCD_GetAntennaGain();
+        for (uint8_t i = 0; i < GAIN_COUNT; i++)
+        {
+            if (GAINS[i] == gain)
+            {
+                gainIndex = i;
+            }
+        }
+    }
+
+    // A card answered REQA, startUs is the micros() of its answer
+    void beginPresentation(unsigned long startUs)
+    {
+        presentationStart = startUs;
+        attempt = 0;
+        inPresentation = true;
+        totals.presented++;
+        window.presented++;
+    }
+
+    bool presenting() const
+    {
+        return inPresentation;
+    }
+
+    // The card was selected, returns the time to UID in microseconds
+    unsigned long selected()
+    {
+        countError(MFRC522::STATUS_OK);
+        if (attempt == 0)
+        {
+            totals.firstAttempt++;
+            window.firstAttempt++;
+        }
+        else
+        {
+            window.rescued++;
+        }
+        unsigned long us = micros() - presentationStart;
+        totals.read++;
+        totals.totalUs += us;
+        endPresentation();
+        return us;
+    }
+
+    // Selection failed, returns whether to wake the card up with WUPA and
+    // select it again
+    bool selectFailed(MFRC522::StatusCode status)
+    {
+        countError(status);
+        if (attempt < retries)
+        {
+            attempt++;
+            return true;
+        }
+        endPresentation();
+        return false;
+    }
+
+    // The card did not answer WUPA for a retry, it was taken away
+    void cardGone()
+    {
+        countError(MFRC522::STATUS_TIMEOUT);
+        endPresentation();
+    }
+
+    const Stats &stats() const
+    {
+        return totals;
+    }
+
+    uint8_t gainDb() const
+    {
+        static const uint8_t DB[] = {18, 23, 33, 38, 43, 48};
+        return DB[gainIndex];
+    }
+
+    void printStats() const
+    {
+        if (totals.presented == 0)
+        {
+            return;
+        }
+        Serial.print("Reader ");
+        Serial.print(name);
+        Serial.print(": ");
+        Serial.print((uint32_t)((uint64_t)totals.firstAttempt * 100 / totals.presented));
+        Serial.print("% first read, ");
+        Serial.print((uint32_t)((uint64_t)totals.read * 100 / totals.presented));
+        Serial.print("% read of ");
+        Serial.print(totals.presented);
+        Serial.print(", time to UID avg ");
+        Serial.print(totals.read ? totals.totalUs / totals.read : 0);
+        Serial.print(" us, errors timeout ");
+        Serial.print(totals.timeouts);
+        Serial.print(" crc ");
+        Serial.print(totals.crcErrors);
+        Serial.print(" collision ");
+        Serial.print(totals.collisions);
+        Serial.print(", gain ");
+        Serial.print(gainDb());
+        Serial.print(" dB, retries ");
+        Serial.println(retries);
+    }
+};
+
+#endif
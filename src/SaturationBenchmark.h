@@ -0,0 +1,204 @@
+#ifndef SaturationBenchmark_h
+#define SaturationBenchmark_h
+
+#include <Arduino.h>
+
+// Bookkeeping of the saturation benchmark, which drives back-to-back
+// simulated taps through the door's authorization path to find how many taps
+// per minute one door sustains, e.g. for a turnstile lane. The firmware runs
+// the taps, this class picks each tap's outcome from the configured mix,
+// adds up the time spent per stage and reports the ceiling and the stage
+// that limits it.
+//
+// Outcomes: grants and denials answered after the server latency, denials
+// with their incident capture, and grants answered from a proxy's cache
+// after the shorter cached latency.
+class SaturationBenchmark
+{
+public:
+    enum Outcome : uint8_t
+    {
+        TAP_GRANT,
+        TAP_DENY,
+        TAP_CACHED
+    };
+
+    enum Stage : uint8_t
+    {
+        STAGE_PREPARE,  // Request template for the next tap
+        STAGE_READ,     // Card read, the reader's average time to UID
+        STAGE_SUBMIT,   // Encryption and sending the request
+        STAGE_SERVER,   // Waiting for the (simulated) server
+        STAGE_DECISION, // Audit, UI, and in the super-loop build the capture
+        STAGE_STORAGE,  // RTOS build: storage queue still draining after the last tap
+        STAGE_COUNT
+    };
+
+    struct Mix
+    {
+        uint16_t taps;
+        uint8_t denyPercent;
+        uint8_t cachedPercent;
+        uint16_t latencyMs;
+        uint16_t cachedLatencyMs;
+    };
+
+    static const uint16_t MAX_TAPS = 1000;
+
+private:
+    static constexpr const char *STAGE_NAMES[STAGE_COUNT] = {"prepare", "read", "submit", "server", "decision",
+                                                             "storage"};
+
+    Mix mix = {};
+    unsigned long readTimeUs = 0;
+    uint32_t stageUs[STAGE_COUNT] = {};
+    uint32_t elapsedUs = 0;
+    uint16_t counts[3] = {};
+
+public:
+    // Parse "[taps] [deny %] [cached %] [latency ms] [cached latency ms]",
+    // missing values keep their defaults
+    static bool parse(const char *args, Mix &mix)
+    {
+        mix = {100, 10, 30, 80, 10};
+        unsigned long values[5] = {mix.taps, mix.denyPercent, mix.cachedPercent, mix.latencyMs, mix.cachedLatencyMs};
+        for (uint8_t i = 0; i < 5; i++)
+        {
+            while (*args == ' ')
+            {
+                args++;
+            }
+            if (*args == '\0')
+            {
+                break;
+            }
+            char *end;
+            values[i] = strtoul(args, &end, 10);
+            if (end == args)
+            {
+                return false;
+            }
+            args = end;
+        }
+
+        if (values[0] == 0 || values[0] > MAX_TAPS || values[1] + values[2] > 100 || values[3] > 60000 ||
+            values[4] > 60000)
+        {
+            return false;
+        }
+        mix = {(uint16_t)values[0], (uint8_t)values[1], (uint8_t)values[2], (uint16_t)values[3],
+               (uint16_t)values[4]};
+        return true;
+    }
+
+    // readUs is the reader's measured time to UID, 0 if no card was read yet
+    void begin(const Mix &newMix, unsigned long readUs)
+    {
+        mix = newMix;
+        readTimeUs = readUs;
+        memset(stageUs, 0, sizeof(stageUs));
+        memset(counts, 0, sizeof(counts));
+        elapsedUs = 0;
+    }
+
+    Outcome nextOutcome()
+    {
+        long draw = random(100);
+        Outcome outcome = draw < mix.denyPercent                      ? TAP_DENY
+                          : draw < mix.denyPercent + mix.cachedPercent ? TAP_CACHED
+                                                                       : TAP_GRANT;
+        counts[outcome]++;
+        return outcome;
+    }
+
+    unsigned long serverLatencyMs(Outcome outcome) const
+    {
+        return outcome == TAP_CACHED ? mix.cachedLatencyMs : mix.latencyMs;
+    }
+
+    // Spend the card read time, there is no card on the reader
+    unsigned long simulateRead()
+    {
+        delayMicroseconds(readTimeUs);
+        add(STAGE_READ, readTimeUs);
+        return readTimeUs;
+    }
+
+    void add(Stage stage, unsigned long us)
+    {
+        stageUs[stage] += us;
+    }
+
+    void finish(unsigned long totalUs)
+    {
+        elapsedUs = max(totalUs, 1UL);
+    }
+
+    uint32_t tapsPerMinute() const
+    {
+        return (uint64_t)mix.taps * 60000000ULL / elapsedUs;
+    }
+
+    // Stage with the most time, optionally leaving out the simulated server
+    Stage bottleneck(bool onDevice) const
+    {
+        uint8_t worst = STAGE_PREPARE;
+        for (uint8_t stage = 0; stage < STAGE_COUNT; stage++)
+        {
+            if ((!onDevice || stage != STAGE_SERVER) && stageUs[stage] > stageUs[worst])
+            {
+                worst = stage;
+            }
+        }
+        return (Stage)worst;
+    }
+
+    static const char *stageName(Stage stage)
+    {
+        return STAGE_NAMES[stage];
+    }
+
+    void print(uint32_t droppedRequests) const
+    {
+        Serial.print("Saturation: ");
+        Serial.print(mix.taps);
+        Serial.print(" taps (");
+        Serial.print(counts[TAP_GRANT]);
+        Serial.print(" grant, ");
+        Serial.print(counts[TAP_DENY]);
+        Serial.print(" deny, ");
+        Serial.print(counts[TAP_CACHED]);
+        Serial.print(" cached) in ");
+        Serial.print(elapsedUs / 1000);
+        Serial.print(" ms, ceiling ");
+        Serial.print(tapsPerMinute());
+        Serial.println(" taps/min");
+
+        for (uint8_t stage = 0; stage < STAGE_COUNT; stage++)
+        {
+            Serial.print("  ");
+            Serial.print(STAGE_NAMES[stage]);
+            Serial.print(": ");
+            Serial.print(stageUs[stage] / mix.taps);
+            Serial.print(" us/tap, ");
+            Serial.print((uint32_t)((uint64_t)stageUs[stage] * 100 / elapsedUs));
+            Serial.println("%");
+        }
+        if (readTimeUs == 0)
+        {
+            Serial.println("  No card read yet, the read stage is not counted");
+        }
+
+        Serial.print("Bottleneck: ");
+        Serial.print(STAGE_NAMES[bottleneck(false)]);
+        Serial.print(", on the device: ");
+        Serial.println(STAGE_NAMES[bottleneck(true)]);
+        if (droppedRequests > 0)
+        {
+            Serial.print("Requests dropped by full task queues: ");
+            Serial.println(droppedRequests);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SecureRandom_h
+#define SecureRandom_h
+
+#include <Arduino.h>
+
+// Include SCE5 headers for hardware RNG
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include <hw_sce_private.h>
+#include <hw_sce_trng_private.h>
+#ifdef __cplusplus
+}
+#endif
+
+// Hardware TRNG of the RA4M1 secure crypto engine (SCE5)
+namespace SecureRandom
+{
+    // Initialize the SCE5 module, done once on first use
+    inline bool begin()
+    {
+        static bool initialized = false;
+        if (initialized)
+            return true;
+
+        HW_SCE_PowerOn();
+        fsp_err_t err = HW_SCE_McuSpecificInit();
+        if (err != FSP_SUCCESS)
+        {
+            Serial.println("Failed to initialize SCE5!");
+            return false;
+        }
+
+        initialized = true;
+        return true;
+    }
+
+    // Fill a 16-byte block, e.g. an AES IV, with random data
+    inline bool fillBlock(uint8_t *block)
+    {
+        if (!begin())
+        {
+            return false;
+        }
+
+        // SCE5 generates 128-bit (16-byte) random numbers
+        uint32_t random_data[4] = {0}; // 4 x 32-bit = 128-bit
+        fsp_err_t err = HW_SCE_RNG_Read(random_data);
+
+        if (err != FSP_SUCCESS)
+        {
+            Serial.println("Failed to generate random IV!");
+            return false;
+        }
+
+        memcpy(block, random_data, sizeof(random_data));
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef SelfBenchmark_h
+#define SelfBenchmark_h
+
+#include <Arduino.h>
+#include <ArduCAM.h>
+#include <EEPROM.h>
+#include <LiquidCrystal_I2C.h>
+#include <SD.h>
+
+#include "PersistentLayout.h"
+#include "RFIDAuth.h"
+
+#ifndef BENCHMARK_HOUR
+#define BENCHMARK_HOUR 3 // Local hour of the nightly run
+#endif
+
+// Short nightly self-benchmark of the parts that wear or drift in the field:
+// SD sector writes, camera FIFO readout, AES, server round trip and LCD
+// updates. Results are kept as a week of history in data flash and each run
+// is reported against the average of the previous ones, so a degrading door
+// shows up before its users notice.
+class SelfBenchmark
+{
+public:
+    static const uint8_t HISTORY_DAYS = 7;
+    static const uint8_t DEGRADED_PERCENT = 25; // Slower than average by this much is flagged
+
+    struct Result
+    {
+        uint32_t day;            // Days since the epoch, 0 marks an empty slot
+        uint32_t sdWriteUs;      // Per 512-byte sector, write and flush
+        uint32_t fifoBytesPerMs; // Camera FIFO burst readout
+        uint32_t aesNsPerBlock;  // One AES-128 block with the current key
+        uint32_t roundTripMs;    // HEAD request to the server, 0 if unreachable
+        uint32_t lcdUs;          // Redraw of both LCD lines
+    };
+
+private:
+    static const uint32_t RECORD_MAGIC = 0x424E4331; // "BNC1"
+    static const uint8_t SD_SECTORS = 8;
+    static const uint16_t SD_SECTOR_SIZE = 512;
+    static const uint16_t AES_BLOCKS = 64;
+
+    ArduCAM &camera;
+    LiquidCrystal_I2C &lcd;
+    RFIDAuth &auth;
+    Result history[HISTORY_DAYS];
+    uint8_t next = 0;
+
+    uint32_t measureSDWrite()
+    {
+        static const char path[] = "/BENCH.TMP";
+        uint8_t chunk[64];
+        memset(chunk, 0xA5, sizeof(chunk));
+
+        File file = SD.open(path, O_WRITE | O_CREAT | O_TRUNC);
+        if (!file)
+        {
+            return 0;
+        }
+
+        unsigned long start = micros();
+        for (uint8_t sector = 0; sector < SD_SECTORS; sector++)
+        {
+            for (uint16_t i = 0; i < SD_SECTOR_SIZE; i += sizeof(chunk))
+            {
+                file.write(chunk, sizeof(chunk));
+            }
+            file.flush();
+        }
+        unsigned long elapsed = micros() - start;
+
+        file.close();
+        SD.remove(path);
+        return elapsed / SD_SECTORS;
+    }
+
+    uint32_t measureFifoReadout()
+    {
+        camera.flush_fifo();
+        camera.clear_fifo_flag();
+        camera.start_capture();
+
+        unsigned long start = millis();
+        while (!camera.get_bit(ARDUCHIP_TRIG, CAP_DONE_MASK))
+        {
+            if (millis() - start > 2000)
+            {
+                return 0;
+            }
+        }
+
+        uint32_t length = camera.read_fifo_length();
+        if (length == 0 || length >= MAX_FIFO_SIZE)
+        {
+            return 0;
+        }
+
+        camera.CS_LOW();
+        camera.set_fifo_burst();
+        unsigned long readStart = micros();
+        for (uint32_t i = 0; i < length; i++)
+        {
+            SPI.transfer(0x00);
+        }
+        unsigned long elapsed = micros() - readStart;
+        camera.CS_HIGH();
+        camera.clear_fifo_flag();
+
+        return elapsed > 0 ? (uint64_t)length * 1000 / elapsed : 0;
+    }
+
+    uint32_t measureLCD()
+    {
+        unsigned long start = micros();
+        lcd.clear();
+        lcd.setCursor(0, 0);
+        lcd.print("Self-benchmark  ");
+        lcd.setCursor(0, 1);
+        lcd.print("in progress...  ");
+        return micros() - start;
+    }
+
+    // Average of a field over earlier runs, ignoring failed measurements
+    uint32_t average(uint32_t Result::*field, uint8_t exclude) const
+    {
+        uint32_t total = 0;
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < HISTORY_DAYS; i++)
+        {
+            if (i != exclude && history[i].day != 0 && history[i].*field != 0)
+            {
+                total += history[i].*field;
+                count++;
+            }
+        }
+        return count > 0 ? total / count : 0;
+    }
+
+    // Print one measurement with its trend, returns true if it degraded.
+    // higherIsBetter is set for rates.
+    bool reportMetric(const char *name, const char *unit, uint32_t Result::*field, uint8_t latest, bool higherIsBetter)
+    {
+        uint32_t value = history[latest].*field;
+        uint32_t baseline = average(field, latest);
+
+        Serial.print("  ");
+        Serial.print(name);
+        Serial.print(": ");
+        Serial.print(value);
+        Serial.print(unit);
+
+        if (value == 0)
+        {
+            Serial.println(" (failed)");
+            return true;
+        }
+        if (baseline == 0)
+        {
+            Serial.println();
+            return false;
+        }
+
+        long change = ((long)value - (long)baseline) * 100 / (long)baseline;
+        if (higherIsBetter)
+        {
+            change = -change;
+        }
+
+        Serial.print(" (");
+        Serial.print(change >= 0 ? "+" : "");
+        Serial.print(change);
+        Serial.print("% vs ");
+        Serial.print(HISTORY_DAYS);
+        Serial.print("-day average)");
+
+        // Positive change means slower
+        bool degraded = change > DEGRADED_PERCENT;
+        Serial.println(degraded ? " DEGRADED" : "");
+        return degraded;
+    }
+
+    void save()
+    {
+        uint32_t magic = RECORD_MAGIC;
+        uint32_t checksum = recordChecksum(history, sizeof(history));
+        EEPROM.put(EEPROM_BENCHMARK_ADDR, magic);
+        EEPROM.put(EEPROM_BENCHMARK_ADDR + sizeof(magic), history);
+        EEPROM.put(EEPROM_BENCHMARK_ADDR + sizeof(magic) + sizeof(history), checksum);
+    }
+
+public:
+    SelfBenchmark(ArduCAM &cam, LiquidCrystal_I2C &display, RFIDAuth &rfidAuth)
+        : camera(cam), lcd(display), auth(rfidAuth)
+    {
+        memset(history, 0, sizeof(history));
+    }
+
+    // Restore the history saved by earlier runs
+    void begin()
+    {
+        uint32_t magic, checksum;
+        EEPROM.get(EEPROM_BENCHMARK_ADDR, magic);
+        EEPROM.get(EEPROM_BENCHMARK_ADDR + sizeof(magic), history);
+        EEPROM.get(EEPROM_BENCHMARK_ADDR + sizeof(magic) + sizeof(history), checksum);
+
+        if (magic != RECORD_MAGIC || checksum != recordChecksum(history, sizeof(history)))
+        {
+            memset(history, 0, sizeof(history));
+        }
+
+        // Continue after the most recent run
+        uint32_t newest = 0;
+        for (uint8_t i = 0; i < HISTORY_DAYS; i++)
+        {
+            if (history[i].day > newest)
+            {
+                newest = history[i].day;
+                next = (i + 1) % HISTORY_DAYS;
+            }
+        }
+    }
+
+    // Whether tonight's run is due, given the local RTC time
+    bool due(uint32_t now) const
+    {
+        uint32_t today = now / 86400;
+        uint8_t hour = (now % 86400) / 3600;
+        uint8_t latest = (next + HISTORY_DAYS - 1) % HISTORY_DAYS;
+        return hour == BENCHMARK_HOUR && history[latest].day != today;
+    }
+
+    // Run all measurements, store and report them. Takes well under a
+    // second plus the server round trip; call only when the door is idle.
+    // Returns the number of degraded measurements.
+    uint8_t run(uint32_t now)
+    {
+        Serial.println("Running self-benchmark...");
+
+        Result &result = history[next];
+        uint8_t latest = next;
+        next = (next + 1) % HISTORY_DAYS;
+
+        result.day = now / 86400;
+        result.lcdUs = measureLCD();
+        result.sdWriteUs = measureSDWrite();
+        result.fifoBytesPerMs = measureFifoReadout();
+        result.aesNsPerBlock = auth.measureBlockEncryptNanos(AES_BLOCKS);
+        result.roundTripMs = auth.measureRoundTripMs();
+        save();
+
+        Serial.println("Self-benchmark results:");
+        uint8_t degraded = 0;
+        degraded += reportMetric("SD sector write", " us", &Result::sdWriteUs, latest, false);
+        degraded += reportMetric("FIFO readout", " B/ms", &Result::fifoBytesPerMs, latest, true);
+        degraded += reportMetric("AES block", " ns", &Result::aesNsPerBlock, latest, false);
+        degraded += reportMetric("Server round trip", " ms", &Result::roundTripMs, latest, false);
+        degraded += reportMetric("LCD update", " us", &Result::lcdUs, latest, false);
+        return degraded;
+    }
+
+    // Latest results, e.g. for the audit log
+    const Result &latest() const
+    {
+        return history[(next + HISTORY_DAYS - 1) % HISTORY_DAYS];
+    }
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef ServerLoad_h
+#define ServerLoad_h
+
+#include <Arduino.h>
+
+#include "HttpHeaders.h"
+
+#ifndef OVERLOAD_SHED_PERCENT
+#define OVERLOAD_SHED_PERCENT 80 // X-Server-Load at which devices start shedding
+#endif
+#ifndef OVERLOAD_MAX_BACKOFF_S
+#define OVERLOAD_MAX_BACKOFF_S 300
+#endif
+
+// Overload signalled by the authorization server, or inferred from repeated
+// timeouts. The server can answer 503 with Retry-After (delta seconds) to
+// stop requests for a while, or report its load on any response:
+//   X-Server-Load: <percent>
+// A reported load is trusted for LOAD_HOLD_MS, after which requests resume
+// and bring a fresh report. Any of these only sheds work; a load report the
+// caller verified as signed by the server (confirmLoad()) is also what lets
+// the door relax its own policy. Times are millis().
+class ServerLoad
+{
+public:
+    static const unsigned long LOAD_HOLD_MS = 30000;
+    static const unsigned long DEFAULT_RETRY_AFTER_S = 30; // For a 503 without a usable Retry-After
+    static const unsigned long TIMEOUT_BACKOFF_S = 5;      // Doubled for every further timeout
+
+private:
+    unsigned long backoffStart = 0;
+    unsigned long backoffMs = 0;
+    unsigned long loadTime = 0;
+    uint8_t load = 0;
+    uint8_t timeouts = 0;
+    unsigned long confirmedTime = 0;
+    uint8_t confirmedLoad = 0;
+
+    void backOff(unsigned long seconds)
+    {
+        backoffStart = millis();
+        backoffMs = min(seconds, (unsigned long)OVERLOAD_MAX_BACKOFF_S) * 1000UL;
+    }
+
+public:
+    // Take the overload signals from a complete HTTP response
+    void update(const char *response)
+    {
+        timeouts = 0;
+
+        const char *level = findHttpHeader(response, "X-Server-Load");
+        if (level)
+        {
+            load = min(atoi(level), 100);
+            loadTime = millis();
+        }
+
+        if (strncmp(response, "HTTP/1.", 7) == 0 && atoi(response + 9) == 503)
+        {
+            const char *retryAfter = findHttpHeader(response, "Retry-After");
+            char *end = nullptr;
+            unsigned long seconds = retryAfter ? strtoul(retryAfter, &end, 10) : 0;
+            backOff(end != retryAfter && seconds > 0 ? seconds : DEFAULT_RETRY_AFTER_S);
+        }
+    }
+
+    // A request that got no answer in time. One timeout may be a WiFi
+    // glitch, further ones back off for 5, 10, 20 s and so on.
+    void recordTimeout()
+    {
+        if (timeouts < 8)
+        {
+            timeouts++;
+        }
+        if (timeouts >= 2)
+        {
+            backOff(TIMEOUT_BACKOFF_S << (timeouts - 2));
+        }
+    }
+
+    // The load report of the last response carried a valid server signature
+    void confirmLoad()
+    {
+        confirmedLoad = load;
+        confirmedTime = loadTime;
+    }
+
+    // Whether a signed load report asks for load to be shed. Timeouts and
+    // unsigned reports or 503s never count here.
+    bool confirmedOverload() const
+    {
+        return confirmedLoad >= OVERLOAD_SHED_PERCENT && millis() - confirmedTime < LOAD_HOLD_MS;
+    }
+
+    // Whether no requests should be sent at all
+    bool backingOff() const
+    {
+        return backoffMs > 0 && millis() - backoffStart < backoffMs;
+    }
+
+    // Whether work should be shed: backing off, or a recent high load report
+    bool overloaded() const
+    {
+        return backingOff() || (load >= OVERLOAD_SHED_PERCENT && millis() - loadTime < LOAD_HOLD_MS);
+    }
+
+    // Seconds left before requests may be sent again
+    unsigned long retryAfterS() const
+    {
+        return backingOff() ? (backoffMs - (millis() - backoffStart) + 999) / 1000 : 0;
+    }
+};
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef StorageService_h
+#define StorageService_h
+
+#include <Arduino.h>
+#include <SD.h>
+
+#ifndef STORAGE_QUEUE_SIZE
+#define STORAGE_QUEUE_SIZE 8
+#endif
+#ifndef STORAGE_SLICE_US
+#define STORAGE_SLICE_US 4000 // SD time per service() call
+#endif
+
+// The one owner of the SD card. Subsystems queue create, append, close,
+// read, remove and directory requests, and service() carries them out in
+// order in bounded time slices. Appends to the file at the tail of the queue
+// are merged into it, and their data waits in a sector-sized arena, so a
+// stream of small appends becomes sector writes. The file being written
+// stays open across requests for it and is closed when the queue runs empty.
+//
+// Enqueueing never blocks: it returns false when the queue or the arena is
+// full, and the caller runs service() or drops the data. Call everything
+// with the SPI bus held. Queue depth and the latency of each operation type,
+// from enqueue to completion, are kept for reporting.
+class StorageService
+{
+public:
+    static const size_t SECTOR_SIZE = 512;
+    static const size_t PATH_SIZE = 28;
+
+    enum Operation : uint8_t
+    {
+        OP_CREATE, // Create or truncate
+        OP_APPEND,
+        OP_CLOSE,
+        OP_READ,
+        OP_REMOVE,
+        OP_MKDIR, // Create a directory unless it exists
+        OP_COUNT
+    };
+
+    // Completion of a queued read, bytes is -1 if it failed
+    struct ReadResult
+    {
+        volatile bool done;
+        int16_t bytes;
+    };
+
+    struct Latency
+    {
+        uint32_t count;
+        uint32_t totalMs;
+        uint32_t maxMs;
+        uint32_t failed;
+    };
+
+private:
+    struct Request
+    {
+        Operation op;
+        char path[PATH_SIZE];
+        uint16_t length; // Bytes in the arena for appends, bytes wanted for reads
+        uint32_t offset; // Read position
+        uint8_t *dest;
+        ReadResult *result;
+        unsigned long queuedAt;
+    };
+
+    Request queue[STORAGE_QUEUE_SIZE];
+    uint8_t head = 0;
+    uint8_t count = 0;
+    uint8_t maxDepth = 0;
+    uint8_t arena[SECTOR_SIZE]; // Append data in queue order, the head's first
+    size_t arenaUsed = 0;
+    size_t progress = 0; // Bytes of the head append already written
+    File file;
+    char openPath[PATH_SIZE] = "";
+    char lastDirectory[PATH_SIZE] = "";
+    Latency latencies[OP_COUNT] = {};
+
+    Request &tail()
+    {
+        return queue[(head + count - 1) % STORAGE_QUEUE_SIZE];
+    }
+
+    Request *enqueue(Operation op, const char *path)
+    {
+        if (count == STORAGE_QUEUE_SIZE || strlen(path) >= PATH_SIZE)
+        {
+            return nullptr;
+        }
+        Request &request = queue[(head + count) % STORAGE_QUEUE_SIZE];
+        request.op = op;
+        strcpy(request.path, path);
+        request.length = 0;
+        request.queuedAt = millis();
+        count++;
+        maxDepth = max(maxDepth, count);
+        return &request;
+    }
+
+    void closeFile()
+    {
+        if (openPath[0])
+        {
+            file.close();
+            openPath[0] = '\0';
+        }
+    }
+
+    // Keep the file of consecutive appends open
+    bool openForAppend(const char *path)
+    {
+        if (strcmp(openPath, path) == 0)
+        {
+            return true;
+        }
+        closeFile();
+        file = SD.open(path, FILE_WRITE);
+        if (!file)
+        {
+            return false;
+        }
+        strcpy(openPath, path);
+        return true;
+    }
+
+    void complete(bool ok)
+    {
+        Request &request = queue[head];
+        Latency &latency = latencies[request.op];
+        unsigned long ms = millis() - request.queuedAt;
+        latency.count++;
+        latency.totalMs += ms;
+        latency.maxMs = max(latency.maxMs, (uint32_t)ms);
+        if (!ok)
+        {
+            latency.failed++;
+            Serial.print(F("Storage request failed: "));
+            Serial.println(request.path);
+        }
+
+        if (request.op == OP_APPEND)
+        {
+            arenaUsed -= request.length;
+            memmove(arena, arena + request.length, arenaUsed);
+            progress = 0;
+        }
+        head = (head + 1) % STORAGE_QUEUE_SIZE;
+        count--;
+    }
+
+    // One SD call for the request at the head, returns false if it failed
+    bool step()
+    {
+        Request &request = queue[head];
+        switch (request.op)
+        {
+        case OP_CREATE:
+        {
+            closeFile();
+            file = SD.open(request.path, O_WRITE | O_CREAT | O_TRUNC);
+            bool ok = file;
+            if (ok)
+            {
+                strcpy(openPath, request.path);
+            }
+            complete(ok);
+            return ok;
+        }
+        case OP_APPEND:
+        {
+            if (!openForAppend(request.path))
+            {
+                complete(false);
+                return false;
+            }
+            size_t chunk = min((size_t)request.length - progress, SECTOR_SIZE);
+            if (file.write(arena + progress, chunk) != chunk)
+            {
+                closeFile();
+                complete(false);
+                return false;
+            }
+            progress += chunk;
+            if (progress == request.length)
+            {
+                complete(true);
+            }
+            return true;
+        }
+        case OP_CLOSE:
+            if (strcmp(openPath, request.path) == 0)
+            {
+                closeFile();
+            }
+            complete(true);
+            return true;
+        case OP_READ:
+        {
+            closeFile();
+            File source = SD.open(request.path, FILE_READ);
+            int bytes = -1;
+            if (source && source.seek(request.offset))
+            {
+                bytes = source.read(request.dest, request.length);
+            }
+            if (source)
+            {
+                source.close();
+            }
+            request.result->bytes = bytes;
+            request.result->done = true;
+            complete(bytes >= 0);
+            return bytes >= 0;
+        }
+        case OP_REMOVE:
+            if (strcmp(openPath, request.path) == 0)
+            {
+                closeFile();
+            }
+            if (SD.exists(request.path))
+            {
+                SD.remove(request.path);
+            }
+            complete(true);
+            return true;
+        case OP_MKDIR:
+        {
+            bool ok = strcmp(lastDirectory, request.path) == 0 || SD.exists(request.path) ||
+                      SD.mkdir(request.path);
+            if (ok)
+            {
+                strcpy(lastDirectory, request.path);
+            }
+            complete(ok);
+            return ok;
+        }
+        default:
+            complete(false);
+            return false;
+        }
+    }
+
+public:
+    bool create(const char *path)
+    {
+        return enqueue(OP_CREATE, path) != nullptr;
+    }
+
+    // Queue data to append to a file, merged with an append to the same
+    // file at the tail of the queue. All or nothing.
+    bool append(const char *path, const void *data, size_t length)
+    {
+        if (length == 0)
+        {
+            return true;
+        }
+        if (arenaUsed + length > sizeof(arena))
+        {
+            return false;
+        }
+
+        Request *request = count > 0 && tail().op == OP_APPEND && strcmp(tail().path, path) == 0
+                               ? &tail()
+                               : enqueue(OP_APPEND, path);
+        if (!request)
+        {
+            return false;
+        }
+        memcpy(arena + arenaUsed, data, length);
+        arenaUsed += length;
+        request->length += length;
+        return true;
+    }
+
+    bool close(const char *path)
+    {
+        return enqueue(OP_CLOSE, path) != nullptr;
+    }
+
+    // Read up to length bytes at offset into dest, result.done is set once
+    // the read ran
+    bool read(const char *path, uint32_t offset, uint8_t *dest, uint16_t length, ReadResult &result)
+    {
+        Request *request = enqueue(OP_READ, path);
+        if (!request)
+        {
+            return false;
+        }
+        result.done = false;
+        result.bytes = -1;
+        request->offset = offset;
+        request->length = length;
+        request->dest = dest;
+        request->result = &result;
+        return true;
+    }
+
+    bool remove(const char *path)
+    {
+        return enqueue(OP_REMOVE, path) != nullptr;
+    }
+
+    bool makeDirectory(const char *path)
+    {
+        return enqueue(OP_MKDIR, path) != nullptr;
+    }
+
+    // Carry out queued requests for about sliceUs. Each step is a single SD
+    // call, an open or close, a write of at most one sector, a read, a
+    // remove or a directory check, so a slice overruns by one call at most.
+    void service(unsigned long sliceUs = STORAGE_SLICE_US)
+    {
+        unsigned long start = micros();
+        while (count > 0 && micros() - start < sliceUs)
+        {
+            step();
+        }
+        if (count == 0)
+        {
+            closeFile();
+        }
+    }
+
+    // Carry out everything queued, e.g. for the emergency flush. Returns
+    // false if any request failed.
+    bool drain()
+    {
+        bool ok = true;
+        while (count > 0)
+        {
+            ok = step() && ok;
+        }
+        closeFile();
+        return ok;
+    }
+
+    uint8_t depth() const
+    {
+        return count;
+    }
+
+    const Latency &latency(Operation op) const
+    {
+        return latencies[op];
+    }
+
+    void printStats() const
+    {
+        static const char *const NAMES[OP_COUNT] = {"create", "append", "close", "read", "remove", "mkdir"};
+        Serial.print("Storage queue ");
+        Serial.print(count);
+        Serial.print(" (max ");
+        Serial.print(maxDepth);
+        Serial.print("), latency avg/max ms:");
+        for (uint8_t op = 0; op < OP_COUNT; op++)
+        {
+            const Latency &latency = latencies[op];
+            if (latency.count == 0)
+            {
+                continue;
+            }
+            Serial.print(" ");
+            Serial.print(NAMES[op]);
+            Serial.print(" ");
+            Serial.print(latency.totalMs / latency.count);
+            Serial.print("/");
+            Serial.print(latency.maxMs);
+            if (latency.failed)
+            {
+                Serial.print(" (");
+                Serial.print(latency.failed);
+                Serial.print(" failed)");
+            }
+        }
+        Serial.println();
+    }
+};
+
+#endif
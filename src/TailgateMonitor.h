@@ -0,0 +1,146 @@
+#ifndef TailgateMonitor_h
+#define TailgateMonitor_h
+
+#include <Arduino.h>
+#include <ArduCAM.h>
+
+// Flags possible tailgating from the compressed size of low-resolution frames
+// taken while the door is open after a grant. JPEG size follows scene
+// complexity, so a second person walking in shows up as a jump against the
+// running average. Only the FIFO length is read, frames are never transferred
+// or decoded, and the statistics are two running values.
+class TailgateMonitor
+{
+public:
+    static const unsigned long FRAME_INTERVAL_MS = 250; // Time between probe frames
+    static const unsigned long WINDOW_MS = 2500;        // How long after a grant jumps are flagged
+    static const uint8_t WARMUP_FRAMES = 2;             // Frames used to settle the baseline
+    static const int32_t MIN_JUMP_BYTES = 1500;         // Smallest size change considered significant
+    static const uint8_t JUMP_FACTOR = 4;               // Jump threshold in mean deviations
+
+private:
+    ArduCAM &camera;
+    bool active = false;
+    bool captureInFlight = false;
+    bool flagged = false;
+    unsigned long grantTime = 0;
+    unsigned long lastFrameTime = 0;
+    uint8_t frames = 0;
+    int32_t meanSize = 0;      // Running average of frame size (alpha 1/4)
+    int32_t meanDeviation = 0; // Running average of absolute deviation (alpha 1/4)
+
+    // Compare a frame size to the baseline, returns true on a significant jump
+    bool analyzeFrame(int32_t size)
+    {
+        int32_t deviation = abs(size - meanSize);
+        bool jump = false;
+
+        if (frames == 0)
+        {
+            meanSize = size;
+            meanDeviation = 0;
+        }
+        else
+        {
+            int32_t threshold = max(MIN_JUMP_BYTES, (int32_t)(JUMP_FACTOR * meanDeviation));
+            jump = frames >= WARMUP_FRAMES && deviation > threshold;
+            meanSize += (size - meanSize) / 4;
+            meanDeviation += (deviation - meanDeviation) / 4;
+        }
+
+        if (frames < 255)
+        {
+            frames++;
+        }
+        return jump;
+    }
+
+public:
+    TailgateMonitor(ArduCAM &cam) : camera(cam) {}
+
+    // Start watching after a grant opened the door
+    void start()
+    {
+        active = true;
+        flagged = false;
+        frames = 0;
+        grantTime = millis();
+        lastFrameTime = 0;
+    }
+
+    void stop()
+    {
+        active = false;
+        captureInFlight = false;
+    }
+
+    // Whether probe frames are being taken, the camera FIFO is in use
+    bool isActive() const
+    {
+        return active;
+    }
+
+    // Forget a probe frame, e.g. because another capture reused the FIFO
+    void abortCapture()
+    {
+        captureInFlight = false;
+    }
+
+    // Start or collect one probe frame, never waits for the camera.
+    // Returns true once per grant when a jump within the window was seen.
+    bool service()
+    {
+        if (!active)
+        {
+            return false;
+        }
+
+        if (captureInFlight)
+        {
+            if (!camera.get_bit(ARDUCHIP_TRIG, CAP_DONE_MASK))
+            {
+                return false;
+            }
+
+            captureInFlight = false;
+            uint32_t length = camera.read_fifo_length();
+            camera.clear_fifo_flag();
+
+            if (length == 0 || length >= MAX_FIFO_SIZE)
+            {
+                return false;
+            }
+
+            bool jump = analyzeFrame(length);
+            if (jump && !flagged && millis() - grantTime <= WINDOW_MS)
+            {
+                flagged = true;
+                Serial.print("Frame size jump after grant: ");
+                Serial.print(length);
+                Serial.print(" bytes vs average ");
+                Serial.println(meanSize);
+                return true;
+            }
+            return false;
+        }
+
+        // Nothing can be flagged once the window after the grant has passed
+        if (millis() - grantTime > WINDOW_MS)
+        {
+            active = false;
+            return false;
+        }
+
+        if (millis() - lastFrameTime >= FRAME_INTERVAL_MS)
+        {
+            lastFrameTime = millis();
+            camera.flush_fifo();
+            camera.clear_fifo_flag();
+            camera.start_capture();
+            captureInFlight = true;
+        }
+        return false;
+    }
+};
+
+#endif
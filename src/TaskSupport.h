@@ -0,0 +1,197 @@
+#ifndef TaskSupport_h
+#define TaskSupport_h
+
+#include <Arduino.h>
+
+// Run the firmware as prioritised FreeRTOS tasks instead of the super-loop,
+// see the uno_r4_wifi_rtos environment in platformio.ini
+#ifndef USE_RTOS
+#define USE_RTOS 0
+#endif
+
+#if USE_RTOS
+#include <Arduino_FreeRTOS.h>
+#endif
+
+// Mutex guarding a resource shared between tasks, such as the SPI bus or the
+// WiFi modem. Compiles to nothing in the super-loop build, so shared code can
+// take locks unconditionally.
+class TaskMutex
+{
+#if USE_RTOS
+    SemaphoreHandle_t handle = nullptr;
+#endif
+
+public:
+    void begin()
+    {
+#if USE_RTOS
+        handle = xSemaphoreCreateMutex();
+#endif
+    }
+
+    void lock()
+    {
+#if USE_RTOS
+        xSemaphoreTake(handle, portMAX_DELAY);
+#endif
+    }
+
+    void unlock()
+    {
+#if USE_RTOS
+        xSemaphoreGive(handle);
+#endif
+    }
+
+    // Let a higher-priority task waiting for the resource run between two
+    // transfers of a long operation
+    void yield()
+    {
+        unlock();
+        lock();
+    }
+};
+
+// Holds a TaskMutex for the current scope
+class TaskLock
+{
+    TaskMutex &mutex;
+
+public:
+    explicit TaskLock(TaskMutex &m) : mutex(m)
+    {
+        mutex.lock();
+    }
+
+    ~TaskLock()
+    {
+        mutex.unlock();
+    }
+};
+
+// Wait without holding up other tasks
+inline void taskPause(unsigned long ms)
+{
+#if USE_RTOS
+    vTaskDelay(pdMS_TO_TICKS(ms));
+#else
+    delay(ms);
+#endif
+}
+
+#if USE_RTOS
+
+// Bounded queue of requests for a task. Posting never blocks: when the queue
+// is full the request is dropped and the caller decides what to report.
+template <typename T, UBaseType_t N>
+class TaskQueue
+{
+    QueueHandle_t handle = nullptr;
+
+public:
+    // Queue storage allocated from the FreeRTOS heap by begin()
+    static const size_t STORAGE_SIZE = N * sizeof(T);
+
+    void begin()
+    {
+        handle = xQueueCreate(N, sizeof(T));
+    }
+
+    bool post(const T &item)
+    {
+        return xQueueSend(handle, &item, 0) == pdTRUE;
+    }
+
+    // Wait up to timeoutMs for the next request
+    bool take(T &item, unsigned long timeoutMs)
+    {
+        return xQueueReceive(handle, &item, pdMS_TO_TICKS(timeoutMs)) == pdTRUE;
+    }
+
+    // Requests posted and not taken yet
+    UBaseType_t waiting() const
+    {
+        return uxQueueMessagesWaiting(handle);
+    }
+};
+
+// Per-task active time and stack usage. Active time is measured around each
+// task's work, so it includes waits for a shared bus but not idle waits for
+// requests.
+class TaskMonitor
+{
+public:
+    static const uint8_t MAX_TASKS = 6;
+
+private:
+    struct Slot
+    {
+        const char *name;
+        TaskHandle_t handle;
+        uint16_t stackWords;
+        uint32_t activeUs;
+    };
+
+    Slot slots[MAX_TASKS];
+    uint8_t slotCount = 0;
+    unsigned long windowStart = 0;
+
+public:
+    // Create a task and start tracking it, returns its slot or -1 on failure
+    int create(TaskFunction_t function, const char *name, uint16_t stackWords, UBaseType_t priority)
+    {
+        TaskHandle_t handle;
+        if (slotCount >= MAX_TASKS ||
+            xTaskCreate(function, name, stackWords, nullptr, tskIDLE_PRIORITY + priority, &handle) != pdPASS)
+        {
+            Serial.print("Failed to create task ");
+            Serial.println(name);
+            return -1;
+        }
+
+        slots[slotCount] = {name, handle, stackWords, 0};
+        return slotCount++;
+    }
+
+    void addActive(int slot, unsigned long us)
+    {
+        if (slot >= 0)
+        {
+            taskENTER_CRITICAL();
+            slots[slot].activeUs += us;
+            taskEXIT_CRITICAL();
+        }
+    }
+
+    // Print active share and peak stack use of every task since the last report
+    void report()
+    {
+        unsigned long now = micros();
+        unsigned long window = max(now - windowStart, 1UL);
+        windowStart = now;
+
+        Serial.println("Task usage (active %, stack used / size words):");
+        for (uint8_t i = 0; i < slotCount; i++)
+        {
+            taskENTER_CRITICAL();
+            uint32_t active = slots[i].activeUs;
+            slots[i].activeUs = 0;
+            taskEXIT_CRITICAL();
+
+            UBaseType_t freeWords = uxTaskGetStackHighWaterMark(slots[i].handle);
+            Serial.print("  ");
+            Serial.print(slots[i].name);
+            Serial.print(": ");
+            Serial.print(active * 100.0 / window, 1);
+            Serial.print("%, ");
+            Serial.print(slots[i].stackWords - freeWords);
+            Serial.print(" / ");
+            Serial.println(slots[i].stackWords);
+        }
+    }
+};
+
+#endif
+
+#endif
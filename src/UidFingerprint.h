@@ -0,0 +1,137 @@
+#ifndef UidFingerprint_h
+#define UidFingerprint_h
+
+#include <Arduino.h>
+#include <MFRC522.h>
+
+#include "arduino_secrets.h"
+
+// A key of its own, so whoever looks up badges in the audit log with
+// scripts/fingerprint.py never needs AES_KEY
+#ifndef FINGERPRINT_KEY
+#error "Set a 16-byte FINGERPRINT_KEY in arduino_secrets.h"
+#endif
+
+// Fixed 64-bit key for a card UID: SipHash-2-4 of the 4, 7 or 10 UID bytes
+// under FINGERPRINT_KEY. Caches, revocation lists and logs store and compare
+// fingerprints instead of UIDs, so their records have a fixed width and no
+// plaintext UID is kept on the device. Without the key a fingerprint cannot
+// be traced back to a card or matched across doors with different keys.
+// Fingerprint 0 never occurs and marks "no badge".
+class UidFingerprint
+{
+public:
+    static const size_t KEY_SIZE = 16;
+    static const size_t HEX_SIZE = 17; // 16 hex digits and the terminator
+
+private:
+    uint64_t k0;
+    uint64_t k1;
+
+    static uint64_t rotate(uint64_t x, uint8_t bits)
+    {
+        return (x << bits) | (x >> (64 - bits));
+    }
+
+    static uint64_t readLittleEndian(const uint8_t *bytes, uint8_t count)
+    {
+        uint64_t value = 0;
+        for (int8_t i = count - 1; i >= 0; i--)
+        {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    static void sipRound(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3)
+    {
+        v0 += v1;
+        v1 = rotate(v1, 13) ^ v0;
+        v0 = rotate(v0, 32);
+        v2 += v3;
+        v3 = rotate(v3, 16) ^ v2;
+        v0 += v3;
+        v3 = rotate(v3, 21) ^ v0;
+        v2 += v1;
+        v1 = rotate(v1, 17) ^ v2;
+        v2 = rotate(v2, 32);
+    }
+
+public:
+    UidFingerprint()
+    {
+        const uint8_t key[KEY_SIZE] = FINGERPRINT_KEY;
+        k0 = readLittleEndian(key, 8);
+        k1 = readLittleEndian(key + 8, 8);
+    }
+
+    // SipHash-2-4 of a message under the device key
+    uint64_t hash(const uint8_t *data, size_t length) const
+    {
+        uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+        uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+        uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+        uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+        size_t whole = length & ~(size_t)7;
+        for (size_t i = 0; i < whole; i += 8)
+        {
+            uint64_t m = readLittleEndian(data + i, 8);
+            v3 ^= m;
+            sipRound(v0, v1, v2, v3);
+            sipRound(v0, v1, v2, v3);
+            v0 ^= m;
+        }
+
+        // Last block: the remaining bytes and the length in the top byte
+        uint64_t last = readLittleEndian(data + whole, length - whole) | ((uint64_t)length << 56);
+        v3 ^= last;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= last;
+
+        v2 ^= 0xff;
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            sipRound(v0, v1, v2, v3);
+        }
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    // Fingerprint of a card. The UID length is part of the hash, so a
+    // 4-byte UID never matches the start of a 7-byte one.
+    uint64_t of(const MFRC522::Uid &uid) const
+    {
+        uint64_t fingerprint = hash(uid.uidByte, min(uid.size, (byte)sizeof(uid.uidByte)));
+        return fingerprint != 0 ? fingerprint : 1;
+    }
+
+    // 16 hex digits, or an empty string for 0
+    static void format(uint64_t fingerprint, char *out)
+    {
+        if (fingerprint == 0)
+        {
+            out[0] = '\0';
+            return;
+        }
+        snprintf(out, HEX_SIZE, "%08lX%08lX", (unsigned long)(fingerprint >> 32),
+                 (unsigned long)(fingerprint & 0xFFFFFFFF));
+    }
+
+    // Average time of one fingerprint of a 7-byte UID, over count runs
+    uint32_t measureNanos(uint16_t count) const
+    {
+        MFRC522::Uid uid = {};
+        uid.size = 7;
+        volatile uint64_t sink = 0;
+        unsigned long start = micros();
+        for (uint16_t i = 0; i < count; i++)
+        {
+            uid.uidByte[0] = i;
+            sink = sink ^ of(uid);
+        }
+        return (micros() - start) * 1000UL / count;
+    }
+};
+
+#endif
@@ -12,6 +12,23 @@
 
 #include "arduino_secrets.h"
 #include "RFIDAuth.h"
+#include "FirmwareUpdater.h"
+#include "TailgateMonitor.h"
+#include "MemoryBudget.h"
+#include "LatencyHistogram.h"
+#include "CaptureDeduplicator.h"
+#include "StorageService.h"
+#include "AuditLog.h"
+#include "SelfBenchmark.h"
+#include "TaskSupport.h"
+#include "LockdownListener.h"
+#include "LiveView.h"
+#include "PowerMonitor.h"
+#include "IsoDep.h"
+#include "ReaderDriver.h"
+#include "ReaderTuner.h"
+#include "SaturationBenchmark.h"
+#include "UidFingerprint.h"
 
 // Pins for RFID RC522
 #define RST_PIN 9
@@ -35,12 +52,202 @@ const uint8_t SERVO_CLOSE_SPEED = 180; // Full speed other direction
 const uint16_t DOOR_MOVE_TIME = 360;   // Time for door to move from open to close position (360 ms)
 const uint16_t DOOR_OPEN_TIME = 3000;  // Time door stays open before auto-closing (3 seconds)
 
+// Grant trusted badges provisionally when the server misses the decision SLO
+#ifndef PROVISIONAL_GRANTS
+#define PROVISIONAL_GRANTS 0
+#endif
+#ifndef DECISION_SLO_MS
+#define DECISION_SLO_MS 300
+#endif
+
+// Grant trusted badges locally while the server signs an overload report,
+// off unless provisional grants are on
+#ifndef OVERLOAD_LOCAL_GRANTS
+#define OVERLOAD_LOCAL_GRANTS PROVISIONAL_GRANTS
+#endif
+
+// Live MJPEG view of the door camera, needs LIVE_VIEW_TOKEN in arduino_secrets.h
+#ifndef LIVE_VIEW
+#define LIVE_VIEW 0
+#endif
+#if LIVE_VIEW && !defined(LIVE_VIEW_TOKEN)
+#error "LIVE_VIEW needs a LIVE_VIEW_TOKEN in arduino_secrets.h"
+#endif
+
+// Application selected on ISO-DEP cards as part of the card read, as a list
+// of AID bytes, e.g. -DREADER_CREDENTIAL_AID=0xF0,0x01,0x02,0x03,0x04,0x05.
+// Unset, ISO-DEP cards are read by their UID like any other card and never
+// activated.
+#ifdef READER_CREDENTIAL_AID
+const uint8_t CREDENTIAL_AID[] = {READER_CREDENTIAL_AID};
+#endif
+
+// Size of the chunks streamed from the camera FIFO to the SD card
+const uint16_t CAPTURE_BUFFER_SIZE = 256;
+
+// Incident captures: a small low-quality preview for fast upload and
+// alerting, then a larger frame kept as evidence
+const uint8_t PREVIEW_JPEG_SIZE = OV5642_320x240;
+const uint8_t EVIDENCE_JPEG_SIZE = OV5642_1280x960;
+const uint8_t PROBE_JPEG_SIZE = OV5642_320x240; // Used by the tailgating monitor between incidents
+
 // Initialize RFID, Servo, ArduCAM, SD Card and LCD objects
 MFRC522 mfrc522(RFID_CS, RST_PIN);
+ReaderDriver cardReader(mfrc522);
+IsoDep isoDep(mfrc522);
+ReaderTuner readerTuner(mfrc522, "door");
+UidFingerprint uidFingerprint;
 RFIDAuth rfidAuth(SERVER_ADDRESS, SERVER_PORT, DEVICE_UUID);
 Servo doorServo;
 ArduCAM myCAM(OV5642, ARDUCAM_CS);
 LiquidCrystal_I2C lcd(0x27, 16, 2);
+FirmwareUpdater firmwareUpdater;
+TailgateMonitor tailgateMonitor(myCAM);
+CaptureDeduplicator captureDeduplicator;
+StorageService storage;
+AuditLog auditLog(storage);
+PowerMonitor powerMonitor;
+SelfBenchmark selfBenchmark(myCAM, lcd, rfidAuth);
+LockdownListener lockdown(uidFingerprint);
+SaturationBenchmark saturation;
+
+// Door-open latency of grants, and the server decision latency it would be
+// without provisional grants
+LatencyHistogram doorOpenLatency;
+LatencyHistogram serverGrantLatency;
+
+// Where server round trips go, from the X-Trace and Server-Timing headers.
+// DNS is the resolution on the request path, 0 while the address is cached.
+LatencyHistogram dnsLatency;
+LatencyHistogram networkUpLatency;
+LatencyHistogram serverLatency;
+LatencyHistogram networkDownLatency;
+
+// Card read time per credential type: UID only, and ISO-DEP at each bit rate
+enum CardType : uint8_t
+{
+  CARD_UID,
+  CARD_ISO_DEP_106,
+  CARD_ISO_DEP_212,
+  CARD_ISO_DEP_424,
+  CARD_TYPE_COUNT
+};
+const char *const CARD_TYPE_NAMES[CARD_TYPE_COUNT] = {"uid", "iso-dep 106", "iso-dep 212", "iso-dep 424"};
+
+struct CardReadTime
+{
+  uint32_t reads;
+  uint32_t totalUs;
+  uint32_t maxUs;
+};
+CardReadTime cardReadTimes[CARD_TYPE_COUNT];
+
+// Static RAM per subsystem, checked against MemoryBudget.h at compile time
+RAM_BUDGET(Reader, BUDGET_READER_RAM, sizeof(MFRC522), sizeof(ReaderDriver), sizeof(IsoDep), sizeof(ReaderTuner),
+           sizeof(cardReadTimes), sizeof(UidFingerprint));
+RAM_BUDGET(Camera, BUDGET_CAMERA_RAM, sizeof(ArduCAM), sizeof(TailgateMonitor), sizeof(CaptureDeduplicator),
+           LIVE_VIEW ? sizeof(LiveView) : 0);
+RAM_BUDGET(UI, BUDGET_UI_RAM, sizeof(LiquidCrystal_I2C), sizeof(Servo));
+RAM_BUDGET(Metrics, BUDGET_METRICS_RAM, sizeof(doorOpenLatency), sizeof(serverGrantLatency), sizeof(dnsLatency),
+           sizeof(networkUpLatency), sizeof(serverLatency), sizeof(networkDownLatency), sizeof(SelfBenchmark),
+           sizeof(SaturationBenchmark));
+RAM_BUDGET(Lockdown, BUDGET_LOCKDOWN_RAM, sizeof(LockdownListener));
+RAM_BUDGET(Storage, BUDGET_STORAGE_RAM, sizeof(StorageService), sizeof(AuditLog), sizeof(PowerMonitor));
+
+
+// Resources shared between tasks in the RTOS build
+TaskMutex spiBus;      // MFRC522, ArduCAM and SD card
+TaskMutex modemLink;   // WiFi modem bridge
+TaskMutex displayLock; // LCD
+
+#if LIVE_VIEW
+// Live MJPEG view of the door camera
+static_assert(sizeof(LIVE_VIEW_TOKEN) > 16, "LIVE_VIEW_TOKEN should be at least 16 characters");
+LiveView liveView(myCAM, spiBus, modemLink, LIVE_VIEW_TOKEN);
+#endif
+
+// Work handed to the door, storage and UI tasks in the RTOS build. The
+// super-loop build performs each request in place.
+enum DoorAction : uint8_t
+{
+  DOOR_OPEN,
+  DOOR_CLOSE
+};
+
+enum StorageAction : uint8_t
+{
+  STORE_AUDIT,
+  STORE_INCIDENT,
+  TAILGATE_START,
+  TAILGATE_STOP
+};
+
+enum UiAction : uint8_t
+{
+  UI_MESSAGE,
+  UI_GRANTED,
+  UI_DENIED
+};
+
+struct StorageRequest
+{
+  StorageAction action;
+  const char *name; // Audit event or capture reason
+  uint64_t badge; // UID fingerprint, 0 for none
+  uint32_t time;
+  bool simulated; // Made during a simulated tap, see simulatedTap
+  char detail[64];
+};
+
+struct UiRequest
+{
+  UiAction action;
+  const char *message; // Shown first if set, must stay valid
+};
+
+#if USE_RTOS
+// Task periods, how long each task waits for requests between its checks
+const unsigned long READER_TASK_PERIOD_MS = 5;
+const unsigned long DOOR_TASK_PERIOD_MS = 10;
+const unsigned long STORAGE_TASK_PERIOD_MS = 20;
+const unsigned long UI_TASK_PERIOD_MS = 50;
+const unsigned long NETWORK_TASK_PERIOD_MS = 100;
+const unsigned long TASK_REPORT_INTERVAL_MS = 60000;
+
+// Task stack sizes, in 32-bit words
+const uint16_t DOOR_TASK_STACK_WORDS = 192;
+const uint16_t READER_TASK_STACK_WORDS = 640;
+const uint16_t UI_TASK_STACK_WORDS = 192;
+const uint16_t STORAGE_TASK_STACK_WORDS = 512;
+const uint16_t NETWORK_TASK_STACK_WORDS = 512;
+
+TaskQueue<DoorAction, 4> doorQueue;
+TaskQueue<StorageRequest, 8> storageQueue;
+TaskQueue<UiRequest, 8> uiQueue;
+TaskMonitor taskMonitor;
+
+// Stacks and queues come from the FreeRTOS heap, which is static RAM as well
+RAM_BUDGET(Tasks, BUDGET_TASKS_RAM,
+           4 * (DOOR_TASK_STACK_WORDS + READER_TASK_STACK_WORDS + UI_TASK_STACK_WORDS + STORAGE_TASK_STACK_WORDS +
+                NETWORK_TASK_STACK_WORDS),
+           decltype(doorQueue)::STORAGE_SIZE, decltype(storageQueue)::STORAGE_SIZE, decltype(uiQueue)::STORAGE_SIZE);
+#endif
+
+// Memory map printed at boot and by the build (scripts/memory_map.py)
+constexpr MemoryBudget::Entry memoryMap[] = {
+    BUDGET_ENTRY(Auth),
+    BUDGET_ENTRY(Reader),
+    BUDGET_ENTRY(Camera),
+    BUDGET_ENTRY(Update),
+    BUDGET_ENTRY(UI),
+    BUDGET_ENTRY(Metrics),
+    BUDGET_ENTRY(Lockdown),
+    BUDGET_ENTRY(Storage),
+#if USE_RTOS
+    BUDGET_ENTRY(Tasks),
+#endif
+};
+static_assert(MemoryBudget::totalLimit(memoryMap) <= BUDGET_TOTAL_RAM, "Subsystem RAM budgets exceed BUDGET_TOTAL_RAM");
 
 // Initialize NTP client
 WiFiUDP ntpUDP;
@@ -50,6 +257,10 @@ NTPClient timeClient(ntpUDP);
 const char *MSG_READY = "Ready: Scan Card";
 const char *MSG_ACCESS_GRANTED = "Access Granted!";
 const char *MSG_ACCESS_DENIED = "Access Denied!";
+const char *MSG_ACCESS_REVOKED = "Access Revoked!";
+const char *MSG_SERVER_BUSY = "Server Busy";
+const char *MSG_LOCKDOWN = "LOCKDOWN";
+const char *MSG_UNLOCKED = "Emergency Unlock";
 
 // Door and button state variables
 bool doorIsOpen = false;
@@ -58,20 +269,76 @@ unsigned long doorOpenStartTime = 0; // Track when door was opened
 int lastButtonState = HIGH;
 unsigned long lastDebounceTime = 0;
 unsigned long debounceDelay = 50; // Debounce time in milliseconds
+unsigned long lastActivityTime = 0; // Last tap or button press, used to find quiet moments
+unsigned long lastBenchmarkCheck = 0; // Last time the nightly benchmark schedule was checked
+
+// Authorization in progress
+bool authPending = false;
+bool provisionalGrant = false;
+unsigned long tapStartTime = 0;
+unsigned long cardReadUs = 0; // Anticollision, select and ISO-DEP exchanges of the last card
+MFRC522::Uid pendingUid;
+uint64_t pendingBadge = 0; // Fingerprint of pendingUid, the key of local caches and logs
+
+// A saturation benchmark tap is being handled: its door actions are dropped,
+// it starts no tailgating watch and its audit lines are marked simulated
+bool simulatedTap = false;
+uint32_t droppedRequests = 0; // Requests lost to full task queues
 
 void initializeHardware();
 void setupWiFi();
 void initializeRTC();
 bool isDaylightSaving(int month, int day);
-String getTimestampFilename();
+String getTimestampPath();
+uint32_t currentUnixTime();
 void processRFIDCard();
-void capturePhotoToSD();
+void serviceAuthorization();
+void handleAuthorization(bool authorized);
+void grantAccess();
+void revokeProvisionalGrant();
+void reportLatency();
+void runSelfBenchmark();
+uint32_t captureFrame();
+uint32_t fingerprintFrame(uint32_t length);
+uint32_t streamFrameToSD(const String &filename, uint32_t length);
+void captureIncident(const char *reason, uint64_t badge, bool simulated);
+void appendCaptureIndex(const String &basePath, const char *reason, uint32_t previewBytes, uint32_t evidenceBytes);
 void checkButton();
 void openDoor();
 void closeDoor();
 void signalAccessGranted();
-void signalAccessDenied();
+void signalAccessDenied(uint64_t badge);
+void signalServerBusy();
 void stopServo();
+void printMemoryMap();
+void serviceConnection();
+void serviceLockdown();
+const char *idleMessage();
+void serviceReader();
+bool serviceCardReader();
+void serviceConsole();
+void runSaturationBenchmark(const SaturationBenchmark::Mix &mix);
+void serviceBetweenTaps();
+#ifdef READER_CREDENTIAL_AID
+CardType readIsoDepCard();
+#endif
+void recordCardRead(CardType type, unsigned long us);
+void serviceDoor();
+void serviceCamera();
+void serviceMaintenance();
+void servicePower();
+void reportLastShutdown();
+void requestDoor(DoorAction action);
+void performDoor(DoorAction action);
+void requestStorage(StorageAction action, const char *name, uint64_t badge, const char *detail);
+void performStorage(const StorageRequest &request);
+void requestUi(UiAction action, const char *message);
+void performUi(const UiRequest &request);
+void showMessage(const char *message);
+void drawMessage(const char *message);
+#if USE_RTOS
+void startTasks();
+#endif
 
 void setup()
 {
@@ -80,29 +347,401 @@ void setup()
   delay(2000);
 
   // Initialize hardware
+  spiBus.begin();
+  modemLink.begin();
+  displayLock.begin();
   initializeHardware();
+  rfidAuth.begin();
+  selfBenchmark.begin();
+  Serial.print("UID fingerprint: ");
+  Serial.print(uidFingerprint.measureNanos(256));
+  Serial.println(" ns");
 
   // Initialize WiFi and RTC
   setupWiFi();
   initializeRTC();
 
+  // Log how the previous run ended, then watch for the next power loss
+  powerMonitor.begin();
+  reportLastShutdown();
+
+  // Join the emergency command group, a saved lockdown or unlock applies right away
+  lockdown.begin();
+#if LIVE_VIEW
+  liveView.begin();
+#endif
+  if (lockdown.mode() == LockdownListener::MODE_UNLOCKED)
+  {
+    openDoor();
+  }
+  lcd.clear();
+  lcd.print(idleMessage());
+
   Serial.println("RFID Door Control System");
+  printMemoryMap();
   Serial.println("Scan your card or press button to open door...");
+
+#if USE_RTOS
+  // Hand over to the scheduler, loop() is not used from here on
+  startTasks();
+#endif
 }
 
 void loop()
 {
+  servicePower();
+  serviceConnection();
+  serviceReader();
+  serviceDoor();
+  serviceCamera();
+  serviceMaintenance();
+}
+
+void serviceConnection()
+{
+  TaskLock link(modemLink);
   if (WiFi.status() != WL_CONNECTED)
   {
     setupWiFi();
+    lockdown.rejoin();
+  }
+  else if (!authPending && !readerTuner.presenting())
+  {
+    // The lookup holds the modem until the resolver answers, so it only
+    // runs while no tap is being read or decided
+    rfidAuth.refreshAddress();
+  }
+}
+
+// Apply an emergency command from the lockdown group and acknowledge it
+void serviceLockdown()
+{
+  uint64_t badge = 0;
+  LockdownListener::Command command;
+  {
+    TaskLock link(modemLink);
+    command = lockdown.service(badge);
+  }
+  if (command == LockdownListener::COMMAND_NONE)
+  {
+    return;
+  }
+
+  uint64_t sequence = lockdown.sequence();
+  char detail[24];
+  snprintf(detail, sizeof(detail), "seq=%08lx%08lx", (unsigned long)(sequence >> 32), (unsigned long)sequence);
+
+  switch (command)
+  {
+  case LockdownListener::COMMAND_LOCK_ALL:
+    Serial.println("Emergency lockdown");
+    requestDoor(DOOR_CLOSE);
+    showMessage(MSG_LOCKDOWN);
+    requestStorage(STORE_AUDIT, "lockdown", 0, detail);
+    break;
+  case LockdownListener::COMMAND_UNLOCK_ALL:
+    Serial.println("Emergency unlock");
+    requestDoor(DOOR_OPEN);
+    showMessage(MSG_UNLOCKED);
+    requestStorage(STORE_AUDIT, "unlock-all", 0, detail);
+    break;
+  case LockdownListener::COMMAND_RESUME:
+    // A door held open closes on its next auto-close check
+    Serial.println("Emergency mode cleared");
+    showMessage(MSG_READY);
+    requestStorage(STORE_AUDIT, "resume", 0, detail);
+    break;
+  case LockdownListener::COMMAND_REVOKE_BADGE:
+    Serial.println("Badge revoked by emergency command");
+    rfidAuth.revokeDecision(badge);
+    requestStorage(STORE_AUDIT, "revoke-badge", badge, detail);
+    break;
+  default:
+    break;
+  }
+
+  TaskLock link(modemLink);
+  lockdown.acknowledge(true);
+}
+
+// LCD text while nothing is happening
+const char *idleMessage()
+{
+  switch (lockdown.mode())
+  {
+  case LockdownListener::MODE_LOCKDOWN:
+    return MSG_LOCKDOWN;
+  case LockdownListener::MODE_UNLOCKED:
+    return MSG_UNLOCKED;
+  default:
+    return MSG_READY;
+  }
+}
+
+void serviceReader()
+{
+  // Emergency commands first, they decide how a tap is handled
+  serviceLockdown();
+
+  // Check for RFID cards, one tap at a time. While idle, keep the next
+  // request prepared so a tap only encrypts and sends.
+  if (!authPending)
+  {
+    serviceConsole();
+    rfidAuth.prepareRequest();
+
+    bool cardRead;
+    {
+      TaskLock bus(spiBus);
+      cardRead = serviceCardReader();
+    }
+    if (cardRead)
+    {
+      TaskLock link(modemLink);
+      processRFIDCard();
+    }
+  }
+
+  // Collect the server's answer without blocking the loop
+  if (authPending)
+  {
+    TaskLock link(modemLink);
+    serviceAuthorization();
   }
+}
 
-  // Check for RFID cards
-  if (mfrc522.PICC_IsNewCardPresent() && mfrc522.PICC_ReadCardSerial())
+// Advance card detection and selection by one step without waiting on the
+// reader. Returns true once a card has been read into mfrc522.uid.
+bool serviceCardReader()
+{
+  switch (cardReader.service())
   {
-    processRFIDCard();
+  case ReaderDriver::READER_IDLE:
+    cardReader.request(false);
+    return false;
+  case ReaderDriver::READER_NO_CARD:
+    if (readerTuner.presenting())
+    {
+      readerTuner.cardGone();
+    }
+    return false;
+  case ReaderDriver::READER_FAILED:
+    if (!readerTuner.presenting())
+    {
+      readerTuner.beginPresentation(cardReader.answerTime());
+    }
+    if (readerTuner.selectFailed(cardReader.status()))
+    {
+      cardReader.request(true);
+    }
+    return false;
+  case ReaderDriver::READER_CARD:
+    break;
+  default:
+    return false;
   }
 
+  if (!readerTuner.presenting())
+  {
+    readerTuner.beginPresentation(cardReader.answerTime());
+  }
+  cardReadUs = readerTuner.selected();
+  CardType type = CARD_UID;
+#ifdef READER_CREDENTIAL_AID
+  if (IsoDep::supported(mfrc522.uid))
+  {
+    unsigned long start = micros();
+    type = readIsoDepCard();
+    cardReadUs += micros() - start;
+  }
+#endif
+  recordCardRead(type, cardReadUs);
+  return true;
+}
+
+#ifdef READER_CREDENTIAL_AID
+// Activate an ISO-DEP card at its highest bit rate and select the
+// credential application, then release it. Returns the credential type.
+// Unlike selection this waits on the card, up to its frame waiting time per
+// exchange, with the SPI bus held.
+CardType readIsoDepCard()
+{
+  if (!isoDep.activate())
+  {
+    return CARD_UID;
+  }
+  CardType type = (CardType)(CARD_ISO_DEP_106 + isoDep.bitRate());
+
+  uint8_t select[5 + sizeof(CREDENTIAL_AID) + 1] = {0x00, 0xA4, 0x04, 0x00, sizeof(CREDENTIAL_AID)};
+  memcpy(select + 5, CREDENTIAL_AID, sizeof(CREDENTIAL_AID));
+  uint8_t response[IsoDep::FRAME_SIZE];
+  uint16_t responseLength = sizeof(response);
+  if (!isoDep.exchange(select, sizeof(select), response, responseLength) || responseLength < 2 ||
+      response[responseLength - 2] != 0x90 || response[responseLength - 1] != 0x00)
+  {
+    Serial.println("Credential application not selected");
+  }
+
+  isoDep.deselect();
+  return type;
+}
+#endif
+
+void recordCardRead(CardType type, unsigned long us)
+{
+  CardReadTime &time = cardReadTimes[type];
+  time.reads++;
+  time.totalUs += us;
+  time.maxUs = max(time.maxUs, (uint32_t)us);
+}
+
+// Commands typed on the serial monitor:
+//   saturate [taps] [deny %] [cached %] [latency ms] [cached latency ms]
+void serviceConsole()
+{
+  static char line[48];
+  static uint8_t length = 0;
+  while (Serial.available())
+  {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r')
+    {
+      if (length < sizeof(line) - 1)
+      {
+        line[length++] = c;
+      }
+      continue;
+    }
+    if (length == 0)
+    {
+      continue;
+    }
+    line[length] = '\0';
+    length = 0;
+
+    SaturationBenchmark::Mix mix;
+    if (strncmp(line, "saturate", 8) == 0 && SaturationBenchmark::parse(line + 8, mix))
+    {
+      runSaturationBenchmark(mix);
+    }
+    else
+    {
+      Serial.println("Usage: saturate [taps] [deny %] [cached %] [latency ms] [cached latency ms]");
+    }
+  }
+}
+
+// Drive back-to-back simulated taps through processRFIDCard() and
+// serviceAuthorization() with the server answering locally. Everything else
+// on the path runs for real: request preparation, encryption, audit
+// entries, LCD and LED signals, and incident captures of denials. The door
+// is not moved for simulated taps and the latency histograms are left as
+// they were. Emergency commands, the exit button and power loss are still
+// handled between taps.
+void runSaturationBenchmark(const SaturationBenchmark::Mix &mix)
+{
+  LatencyHistogram saved[] = {doorOpenLatency, serverGrantLatency, networkUpLatency, serverLatency,
+                              networkDownLatency, dnsLatency};
+  const ReaderTuner::Stats &reads = readerTuner.stats();
+  uint32_t droppedBefore = droppedRequests;
+  saturation.begin(mix, reads.read ? reads.totalUs / reads.read : 0);
+  requestStorage(STORE_AUDIT, "saturate", 0, "start");
+
+  unsigned long runStart = micros();
+  for (uint16_t tap = 0; tap < mix.taps; tap++)
+  {
+    serviceBetweenTaps();
+    SaturationBenchmark::Outcome outcome = saturation.nextOutcome();
+    rfidAuth.simulateServer(outcome == SaturationBenchmark::TAP_DENY ? RFIDAuth::AUTH_DENIED
+                                                                     : RFIDAuth::AUTH_GRANTED,
+                            saturation.serverLatencyMs(outcome));
+
+    unsigned long start = micros();
+    rfidAuth.prepareRequest();
+    saturation.add(SaturationBenchmark::STAGE_PREPARE, micros() - start);
+
+    // Simulated badge BE:5A:<tap>
+    cardReadUs = saturation.simulateRead();
+    mfrc522.uid.size = 4;
+    mfrc522.uid.sak = 0x08;
+    mfrc522.uid.uidByte[0] = 0xBE;
+    mfrc522.uid.uidByte[1] = 0x5A;
+    mfrc522.uid.uidByte[2] = tap >> 8;
+    mfrc522.uid.uidByte[3] = tap & 0xFF;
+
+    start = micros();
+    simulatedTap = true;
+    {
+      TaskLock link(modemLink);
+      processRFIDCard();
+    }
+    simulatedTap = false;
+    saturation.add(SaturationBenchmark::STAGE_SUBMIT, micros() - start);
+
+    // The last poll, the one that gets the answer, handles the decision
+    start = micros();
+    unsigned long pollStart = start;
+    while (authPending)
+    {
+      pollStart = micros();
+      simulatedTap = true;
+      {
+        TaskLock link(modemLink);
+        serviceAuthorization();
+      }
+      simulatedTap = false;
+      if (authPending)
+      {
+        serviceBetweenTaps();
+        taskPause(1);
+      }
+    }
+    saturation.add(SaturationBenchmark::STAGE_SERVER, pollStart - start);
+    saturation.add(SaturationBenchmark::STAGE_DECISION, micros() - pollStart);
+  }
+
+#if USE_RTOS
+  // Captures and audit entries of the last taps are still queued
+  unsigned long drainStart = micros();
+  while (storageQueue.waiting() > 0 && micros() - drainStart < 30000000UL)
+  {
+    serviceBetweenTaps();
+    taskPause(10);
+  }
+  saturation.add(SaturationBenchmark::STAGE_STORAGE, micros() - drainStart);
+#endif
+  saturation.finish(micros() - runStart);
+
+  rfidAuth.stopSimulation();
+  doorOpenLatency = saved[0];
+  serverGrantLatency = saved[1];
+  networkUpLatency = saved[2];
+  serverLatency = saved[3];
+  networkDownLatency = saved[4];
+  dnsLatency = saved[5];
+
+  saturation.print(droppedRequests - droppedBefore);
+  char detail[64];
+  snprintf(detail, sizeof(detail), "taps=%u tpm=%lu bottleneck=%s device=%s", mix.taps,
+           (unsigned long)saturation.tapsPerMinute(), SaturationBenchmark::stageName(saturation.bottleneck(false)),
+           SaturationBenchmark::stageName(saturation.bottleneck(true)));
+  requestStorage(STORE_AUDIT, "saturate", 0, detail);
+  showMessage(idleMessage());
+}
+
+// What must not wait for the benchmark to end. In the RTOS build the door
+// and storage tasks keep running on their own.
+void serviceBetweenTaps()
+{
+  serviceLockdown();
+#if !USE_RTOS
+  servicePower();
+  serviceDoor();
+#endif
+}
+
+void serviceDoor()
+{
   // Check button
   checkButton();
 
@@ -112,17 +751,230 @@ void loop()
     stopServo();
   }
 
-  // Check if door has been open long enough and needs to auto-close
-  if (doorIsOpen && (millis() - doorOpenStartTime >= DOOR_OPEN_TIME))
+  // Check if door has been open long enough and needs to auto-close,
+  // unless it is held open by an emergency unlock
+  if (doorIsOpen && (millis() - doorOpenStartTime >= DOOR_OPEN_TIME) &&
+      lockdown.mode() != LockdownListener::MODE_UNLOCKED)
   {
     closeDoor();
 
     // After closing, show ready message on LCD
-    lcd.clear();
-    lcd.print(MSG_READY);
+    showMessage(idleMessage());
   }
 }
 
+void serviceCamera()
+{
+  // Watch frame sizes after a grant for a second person following through
+  {
+    TaskLock bus(spiBus);
+    if (tailgateMonitor.service())
+    {
+      Serial.println("Possible tailgating detected!");
+      captureIncident("tailgate", 0, false);
+    }
+  }
+
+#if LIVE_VIEW
+  // Stream to a live viewer, leaving the camera and modem to taps and probes
+  liveView.service(authPending || tailgateMonitor.isActive());
+#endif
+}
+
+void serviceMaintenance()
+{
+  // Stage firmware in the background and switch over once the door is quiet.
+  // Downloads and the benchmark round trip wait while the server sheds load.
+  bool quiet = !doorIsOpen && !authPending && (millis() - lastActivityTime >= FirmwareUpdater::QUIET_TIME_MS);
+  bool overloaded = rfidAuth.serverOverloaded();
+  {
+    TaskLock link(modemLink);
+    if (!overloaded)
+    {
+      firmwareUpdater.service();
+    }
+    if (quiet && firmwareUpdater.readyToSwitch())
+    {
+      rfidAuth.saveState();
+      firmwareUpdater.switchToStaged();
+    }
+  }
+
+  // Nightly self-benchmark, checked once a minute while the door is quiet
+  if (quiet && !overloaded && millis() - lastBenchmarkCheck >= 60000)
+  {
+    lastBenchmarkCheck = millis();
+    if (selfBenchmark.due(currentUnixTime()))
+    {
+      runSelfBenchmark();
+    }
+  }
+}
+
+// Write buffered audit lines in the background. On a power failure write
+// everything still in RAM within the hold-up time, then mark the shutdown
+// clean; a capture in progress has already closed its file at that point.
+void servicePower()
+{
+  static bool flushed = false;
+  TaskLock bus(spiBus);
+
+  if (!powerMonitor.failing())
+  {
+    auditLog.service();
+    storage.service();
+    return;
+  }
+
+  if (!flushed)
+  {
+    // Queued writes first, they make room for the audit lines
+    unsigned long start = millis();
+    bool written = storage.drain();
+    auditLog.record(currentUnixTime(), "power-fail", 0, nullptr);
+    written = auditLog.flush() && storage.drain() && written;
+    if (written)
+    {
+      powerMonitor.recordCleanShutdown(millis() - start);
+      Serial.print("Power failing, buffers flushed in ");
+      Serial.print(millis() - start);
+      Serial.println(" ms");
+    }
+    flushed = true;
+  }
+  else if (powerMonitor.restored())
+  {
+    // Only a dip, carry on
+    powerMonitor.resume();
+    flushed = false;
+    auditLog.record(currentUnixTime(), "power-restored", 0, nullptr);
+    Serial.println("Power restored");
+  }
+}
+
+void reportLastShutdown()
+{
+  char detail[32];
+  switch (powerMonitor.lastShutdownState())
+  {
+  case PowerMonitor::SHUTDOWN_CLEAN:
+    snprintf(detail, sizeof(detail), "clean %ums", powerMonitor.lastFlushTime());
+    break;
+  case PowerMonitor::SHUTDOWN_UNCLEAN:
+    Serial.println("Previous run ended without a clean shutdown, buffered data may be lost");
+    snprintf(detail, sizeof(detail), "unclean");
+    break;
+  default:
+    return;
+  }
+  auditLog.record(currentUnixTime(), "boot", 0, detail);
+}
+
+#if USE_RTOS
+// Task slots in taskMonitor
+int readerTaskSlot, doorTaskSlot, storageTaskSlot, uiTaskSlot, networkTaskSlot;
+
+// Card polling and authorization
+void readerTask(void *)
+{
+  for (;;)
+  {
+    unsigned long start = micros();
+    serviceReader();
+    taskMonitor.addActive(readerTaskSlot, micros() - start);
+    taskPause(READER_TASK_PERIOD_MS);
+  }
+}
+
+// Servo, button and door timing, answers door requests right away
+void doorTask(void *)
+{
+  for (;;)
+  {
+    DoorAction action;
+    bool requested = doorQueue.take(action, DOOR_TASK_PERIOD_MS);
+    unsigned long start = micros();
+    if (requested)
+    {
+      performDoor(action);
+    }
+    serviceDoor();
+    taskMonitor.addActive(doorTaskSlot, micros() - start);
+  }
+}
+
+// Camera captures, tailgating probes and SD card writes
+void storageTask(void *)
+{
+  for (;;)
+  {
+    StorageRequest request;
+    bool requested = storageQueue.take(request, STORAGE_TASK_PERIOD_MS);
+    unsigned long start = micros();
+    if (requested)
+    {
+      TaskLock bus(spiBus);
+      performStorage(request);
+    }
+    servicePower();
+    serviceCamera();
+    taskMonitor.addActive(storageTaskSlot, micros() - start);
+  }
+}
+
+// LCD, LEDs and buzzer
+void uiTask(void *)
+{
+  for (;;)
+  {
+    UiRequest request;
+    if (uiQueue.take(request, UI_TASK_PERIOD_MS))
+    {
+      unsigned long start = micros();
+      performUi(request);
+      taskMonitor.addActive(uiTaskSlot, micros() - start);
+    }
+  }
+}
+
+// WiFi, firmware staging, the nightly benchmark and task reports
+void networkTask(void *)
+{
+  unsigned long lastReport = millis();
+  for (;;)
+  {
+    unsigned long start = micros();
+    serviceConnection();
+    serviceMaintenance();
+    taskMonitor.addActive(networkTaskSlot, micros() - start);
+
+    if (millis() - lastReport >= TASK_REPORT_INTERVAL_MS)
+    {
+      lastReport = millis();
+      taskMonitor.report();
+    }
+    taskPause(NETWORK_TASK_PERIOD_MS);
+  }
+}
+
+// Door first so it never waits on I/O, the reader next so taps stay fast,
+// slow SD and network work last
+void startTasks()
+{
+  doorQueue.begin();
+  storageQueue.begin();
+  uiQueue.begin();
+
+  doorTaskSlot = taskMonitor.create(doorTask, "door", DOOR_TASK_STACK_WORDS, 5);
+  readerTaskSlot = taskMonitor.create(readerTask, "reader", READER_TASK_STACK_WORDS, 4);
+  uiTaskSlot = taskMonitor.create(uiTask, "ui", UI_TASK_STACK_WORDS, 3);
+  storageTaskSlot = taskMonitor.create(storageTask, "storage", STORAGE_TASK_STACK_WORDS, 2);
+  networkTaskSlot = taskMonitor.create(networkTask, "network", NETWORK_TASK_STACK_WORDS, 1);
+
+  vTaskStartScheduler();
+}
+#endif
+
 void initializeHardware()
 {
   // Initialize LCD
@@ -146,6 +998,8 @@ void initializeHardware()
 
   // Initialize MFRC522
   mfrc522.PCD_Init();
+  cardReader.begin();
+  readerTuner.begin();
 
   // Initialize ArduCAM
   uint8_t vid, pid;
@@ -206,7 +1060,7 @@ void initializeHardware()
   myCAM.set_format(JPEG);
   myCAM.InitCAM();
   myCAM.write_reg(ARDUCHIP_TIM, VSYNC_LEVEL_MASK); // VSYNC is active HIGH
-  myCAM.OV5642_set_JPEG_size(OV5642_320x240);      // Set resolution to 320x240
+  myCAM.OV5642_set_JPEG_size(PROBE_JPEG_SIZE);     // Set resolution to 320x240
 
   // Initialize servo
   doorServo.attach(SERVO_PIN);
@@ -224,6 +1078,8 @@ void setupWiFi()
 
   while (WiFi.status() != WL_CONNECTED)
   {
+    // A reconnect can take long, power loss must still be caught
+    servicePower();
     delay(500);
     Serial.print(".");
   }
@@ -264,7 +1120,8 @@ bool isDaylightSaving(int month, int day)
   return false;
 }
 
-String getTimestampFilename()
+// Path of a capture without suffix and extension, e.g. /20241103/142501
+String getTimestampPath()
 {
   RTCTime currentTime;
   RTC.getTime(currentTime);
@@ -276,14 +1133,11 @@ String getTimestampFilename()
           Month2int(currentTime.getMonth()),
           currentTime.getDayOfMonth());
 
-  if (!SD.exists(dateFolder))
-  {
-    SD.mkdir(dateFolder);
-  }
+  storage.makeDirectory(dateFolder);
 
-  // Create the full timestamp filename with path
+  // Create the full timestamp path
   char filename[64];
-  sprintf(filename, "%s/%02d%02d%02d.jpg",
+  sprintf(filename, "%s/%02d%02d%02d",
           dateFolder,
           currentTime.getHour(),
           currentTime.getMinutes(),
@@ -292,43 +1146,302 @@ String getTimestampFilename()
   return String(filename);
 }
 
+uint32_t currentUnixTime()
+{
+  RTCTime currentTime;
+  RTC.getTime(currentTime);
+  return currentTime.getUnixTime();
+}
+
 void processRFIDCard()
 {
+  // Send the authorization request first, the answer is collected by serviceAuthorization()
+  lastActivityTime = millis();
+  tapStartTime = millis();
+  pendingUid = mfrc522.uid;
+  pendingBadge = uidFingerprint.of(pendingUid);
+  provisionalGrant = false;
+
+  // During a lockdown, and for centrally revoked badges, deny without asking
+  const char *localDenial = nullptr;
+  if (lockdown.mode() == LockdownListener::MODE_LOCKDOWN)
+  {
+    localDenial = "lockdown";
+  }
+  else if (lockdown.isRevoked(pendingBadge))
+  {
+    localDenial = "revoked";
+  }
+
+  // While the server sheds load, trusted badges are decided here, and
+  // nothing is sent until its Retry-After has passed
+  bool localGrant = false;
+  if (!localDenial && rfidAuth.serverOverloaded())
+  {
+    localGrant = OVERLOAD_LOCAL_GRANTS && rfidAuth.overloadConfirmed() &&
+                 rfidAuth.hasTrustedDecision(pendingBadge, currentUnixTime());
+    if (!localGrant && rfidAuth.serverBusy())
+    {
+      localDenial = "server-busy";
+    }
+  }
+
+  authPending = !localDenial && !localGrant && rfidAuth.beginAuthorization(pendingUid, pendingBadge, cardReadUs);
+
   // Show scanning message
-  lcd.clear();
-  lcd.print("Checking Card...");
+  showMessage("Checking Card...");
 
-  // Check authorization with server
-  bool authorized = rfidAuth.checkCardAuthorization(mfrc522.uid);
+  if (localGrant)
+  {
+    Serial.println("Server overloaded, local grant for trusted badge");
+    doorOpenLatency.record(millis() - tapStartTime);
+    requestStorage(STORE_AUDIT, "local-grant", pendingBadge, "overload");
+    grantAccess();
+  }
+  else if (!authPending)
+  {
+    requestStorage(STORE_AUDIT, "deny", pendingBadge, localDenial ? localDenial : "no-server");
+    if (localDenial && strcmp(localDenial, "server-busy") == 0)
+    {
+      signalServerBusy();
+    }
+    else
+    {
+      handleAuthorization(false);
+    }
+  }
 
-  // Handle authorization result
-  if (authorized)
+  // Stop encryption on PCD and halt the PICC, the HLTA goes out while the loop runs on
+  TaskLock bus(spiBus);
+  mfrc522.PCD_StopCrypto1();
+  cardReader.halt();
+}
+
+void serviceAuthorization()
+{
+  if (!authPending)
   {
-    lcd.clear();
-    lcd.print(MSG_ACCESS_GRANTED);
-    signalAccessGranted();
-    if (!doorIsOpen)
+    return;
+  }
+
+  RFIDAuth::AuthResult result = rfidAuth.pollAuthorization(currentUnixTime());
+  if (result == RFIDAuth::AUTH_PENDING)
+  {
+#if PROVISIONAL_GRANTS
+    // Server missed the SLO, let a badge with a recent signed grant through,
+    // unless a lockdown or revocation arrived since the tap
+    if (!provisionalGrant && millis() - tapStartTime >= DECISION_SLO_MS &&
+        lockdown.mode() != LockdownListener::MODE_LOCKDOWN && !lockdown.isRevoked(pendingBadge) &&
+        rfidAuth.hasTrustedDecision(pendingBadge, currentUnixTime()))
     {
-      // Only open if door is closed
-      openDoor();
+      Serial.println("Server slow, provisional grant for trusted badge");
+      provisionalGrant = true;
+      doorOpenLatency.record(millis() - tapStartTime);
+      requestStorage(STORE_AUDIT, "provisional", pendingBadge, nullptr);
+      grantAccess();
     }
+#endif
+    return;
+  }
+
+  authPending = false;
+  unsigned long latency = millis() - tapStartTime;
+  bool authorized = result == RFIDAuth::AUTH_GRANTED;
+
+  // An overloaded server that could not decide leaves trusted badges to the local policy
+  bool localGrant = result == RFIDAuth::AUTH_FAILED && !provisionalGrant && OVERLOAD_LOCAL_GRANTS &&
+                    rfidAuth.overloadConfirmed() && rfidAuth.hasTrustedDecision(pendingBadge, currentUnixTime());
+  if (localGrant)
+  {
+    Serial.println("Server overloaded, local grant for trusted badge");
+    authorized = true;
+  }
+
+  // A lockdown or revocation that arrived while the server was deciding wins
+  if (authorized && (lockdown.mode() == LockdownListener::MODE_LOCKDOWN || lockdown.isRevoked(pendingBadge)))
+  {
+    Serial.println("Server grant overridden by emergency command");
+    authorized = false;
+    result = RFIDAuth::AUTH_DENIED;
+  }
+
+  // Audit detail: latency, trace ID, and the round trip split when the
+  // server reported its time
+  const RFIDAuth::RequestTrace &trace = rfidAuth.lastTrace();
+  char detail[64];
+  dnsLatency.record(trace.dnsMs);
+  if (trace.hasServerTiming)
+  {
+    networkUpLatency.record(trace.upMs);
+    serverLatency.record(trace.serverMs);
+    networkDownLatency.record(trace.downMs);
+    snprintf(detail, sizeof(detail), "%lums t=%s up=%lu srv=%lu dn=%lu", latency, trace.id, trace.upMs,
+             trace.serverMs, trace.downMs);
   }
   else
   {
-    lcd.clear();
-    lcd.print(MSG_ACCESS_DENIED);
-    signalAccessDenied();
+    snprintf(detail, sizeof(detail), "%lums t=%s", latency, trace.id);
   }
+  const char *event = authorized ? (localGrant ? "local-grant" : "grant")
+                                 : (result == RFIDAuth::AUTH_FAILED ? "fail" : (provisionalGrant ? "revoke" : "deny"));
+  requestStorage(STORE_AUDIT, event, pendingBadge, detail);
 
-  // Halt PICC and stop encryption on PCD
-  mfrc522.PICC_HaltA();
-  mfrc522.PCD_StopCrypto1();
+  if (provisionalGrant)
+  {
+    // Record the late answer, a late denial takes the entry back
+    Serial.print("Late server answer after ");
+    Serial.print(latency);
+    Serial.println(authorized ? " ms: granted" : " ms: not granted");
+    if (authorized)
+    {
+      serverGrantLatency.record(latency);
+    }
+    else if (result == RFIDAuth::AUTH_DENIED)
+    {
+      revokeProvisionalGrant();
+    }
+  }
+  else
+  {
+    if (authorized)
+    {
+      doorOpenLatency.record(latency);
+      if (!localGrant)
+      {
+        serverGrantLatency.record(latency);
+      }
+    }
+
+    if (!authorized && result == RFIDAuth::AUTH_FAILED && rfidAuth.serverOverloaded())
+    {
+      signalServerBusy();
+    }
+    else
+    {
+      handleAuthorization(authorized);
+    }
+  }
+
+  // Pick up a firmware offer piggybacked on the response
+  uint16_t offeredVersion;
+  char offeredUrl[FirmwareUpdater::URL_SIZE];
+  uint8_t offeredDigest[FirmwareUpdater::DIGEST_SIZE];
+  if (rfidAuth.firmwareOffer(offeredVersion, offeredUrl, sizeof(offeredUrl), offeredDigest))
+  {
+    firmwareUpdater.offer(offeredVersion, offeredUrl, offeredDigest);
+  }
+
+  reportLatency();
 }
 
-void capturePhotoToSD()
+void handleAuthorization(bool authorized)
 {
-  String filename = getTimestampFilename();
-  byte buf[256];
+  if (authorized)
+  {
+    grantAccess();
+  }
+  else
+  {
+    showMessage(MSG_ACCESS_DENIED);
+    signalAccessDenied(pendingBadge);
+  }
+}
+
+void grantAccess()
+{
+  requestUi(UI_GRANTED, MSG_ACCESS_GRANTED);
+  requestDoor(DOOR_OPEN);
+  if (!simulatedTap)
+  {
+    requestStorage(TAILGATE_START, nullptr, 0, nullptr);
+  }
+}
+
+void revokeProvisionalGrant()
+{
+  Serial.println("ALERT: server denied a provisionally granted badge, entry revoked");
+  showMessage(MSG_ACCESS_REVOKED);
+  requestDoor(DOOR_CLOSE);
+  signalAccessDenied(pendingBadge);
+}
+
+void reportLatency()
+{
+  Serial.print("Door-open latency p99: ");
+  Serial.print(doorOpenLatency.percentile(99));
+  Serial.print(" ms (without provisional grants: ");
+  Serial.print(serverGrantLatency.percentile(99));
+  Serial.println(" ms)");
+
+  Serial.print("Round trip p99: dns ");
+  Serial.print(dnsLatency.percentile(99));
+  Serial.print(" ms, network up ");
+  Serial.print(networkUpLatency.percentile(99));
+  Serial.print(" ms, server ");
+  Serial.print(serverLatency.percentile(99));
+  Serial.print(" ms, network down ");
+  Serial.print(networkDownLatency.percentile(99));
+  Serial.println(" ms");
+
+  readerTuner.printStats();
+  cardReader.printTimings();
+  storage.printStats();
+  for (uint8_t type = 0; type < CARD_TYPE_COUNT; type++)
+  {
+    const CardReadTime &time = cardReadTimes[type];
+    if (time.reads == 0)
+    {
+      continue;
+    }
+    Serial.print("Card read ");
+    Serial.print(CARD_TYPE_NAMES[type]);
+    Serial.print(": avg ");
+    Serial.print(time.totalUs / time.reads);
+    Serial.print(" us, max ");
+    Serial.print(time.maxUs);
+    Serial.print(" us over ");
+    Serial.print(time.reads);
+    Serial.println(" reads");
+  }
+}
+
+void runSelfBenchmark()
+{
+  // The benchmark uses every shared resource
+  uint8_t degraded;
+  {
+    TaskLock link(modemLink);
+    TaskLock bus(spiBus);
+    TaskLock display(displayLock);
+
+    // The benchmark takes its own camera frame, and times the SD card
+    // without queued writes in the way
+    tailgateMonitor.abortCapture();
+#if LIVE_VIEW
+    liveView.abortFrame();
+#endif
+    storage.drain();
+    degraded = selfBenchmark.run(currentUnixTime());
+  }
+
+  const SelfBenchmark::Result &result = selfBenchmark.latest();
+  char detail[64];
+  snprintf(detail, sizeof(detail), "sd=%lu fifo=%lu aes=%lu rtt=%lu lcd=%lu degraded=%u",
+           (unsigned long)result.sdWriteUs, (unsigned long)result.fifoBytesPerMs,
+           (unsigned long)result.aesNsPerBlock, (unsigned long)result.roundTripMs,
+           (unsigned long)result.lcdUs, degraded);
+  requestStorage(STORE_AUDIT, "benchmark", 0, detail);
+  showMessage(idleMessage());
+}
+
+// Take one frame into the camera FIFO, returns its length or 0 on error
+uint32_t captureFrame()
+{
+  // This capture reuses the FIFO, drop any pending probe or live frame
+  tailgateMonitor.abortCapture();
+#if LIVE_VIEW
+  liveView.abortFrame();
+#endif
 
   // Prepare camera
   myCAM.flush_fifo();
@@ -338,9 +1451,16 @@ void capturePhotoToSD()
   Serial.println(F("Starting Capture..."));
   myCAM.start_capture();
 
-  // Wait for capture to complete
+  // Wait for capture to complete, the reader may use the bus meanwhile
   while (!myCAM.get_bit(ARDUCHIP_TRIG, CAP_DONE_MASK))
-    ;
+  {
+    if (powerMonitor.failing())
+    {
+      Serial.println(F("Capture abandoned, power failing"));
+      return 0;
+    }
+    spiBus.yield();
+  }
   Serial.println(F("Capture Done."));
 
   uint32_t length = myCAM.read_fifo_length();
@@ -348,15 +1468,54 @@ void capturePhotoToSD()
   if (length >= MAX_FIFO_SIZE || length == 0)
   {
     Serial.println(F("Capture size error"));
-    return;
+    return 0;
   }
+  return length;
+}
+
+// Read just enough of the frame in the FIFO to fingerprint it, then rewind
+// the FIFO so the frame can still be streamed
+uint32_t fingerprintFrame(uint32_t length)
+{
+  FrameFingerprint fingerprint;
+  fingerprint.begin();
 
-  // Open file
-  File outFile = SD.open(filename, O_WRITE | O_CREAT | O_TRUNC);
-  if (!outFile)
+  myCAM.CS_LOW();
+  myCAM.set_fifo_burst();
+  while (length-- && !fingerprint.feed(SPI.transfer(0x00)))
+    ;
+  myCAM.CS_HIGH();
+
+  myCAM.write_reg(ARDUCHIP_FIFO, FIFO_RDPTR_RST_MASK);
+  return fingerprint.hash();
+}
+
+// Queue a chunk for the SD card, giving the storage service time while it
+// has no room
+bool storeChunk(const char *path, const uint8_t *data, size_t length)
+{
+  while (!storage.append(path, data, length))
   {
-    Serial.println(F("File open failed"));
-    return;
+    if (storage.depth() == 0)
+    {
+      return false;
+    }
+    storage.service();
+  }
+  return true;
+}
+
+// Stream the frame in the camera FIFO to a file through the storage
+// service, returns the bytes queued
+uint32_t streamFrameToSD(const String &filename, uint32_t length)
+{
+  byte buf[CAPTURE_BUFFER_SIZE];
+  const char *path = filename.c_str();
+
+  if (!storage.create(path))
+  {
+    Serial.println(F("Storage queue full"));
+    return 0;
   }
 
   // Read and save image data
@@ -365,7 +1524,8 @@ void capturePhotoToSD()
 
   bool is_header = false;
   int i = 0;
-  uint8_t temp, temp_last = 0;
+  uint8_t temp = 0, temp_last = 0;
+  uint32_t written = 0;
 
   while (length--)
   {
@@ -377,25 +1537,34 @@ void capturePhotoToSD()
     {
       buf[i++] = temp;
       myCAM.CS_HIGH();
-      outFile.write(buf, i);
-      outFile.close();
+      written += storeChunk(path, buf, i) ? i : 0;
+      storage.close(path);
       Serial.print(F("Image saved as "));
       Serial.println(filename);
-      break;
+      return written;
     }
 
     if (is_header)
     {
-      if (i < 256)
+      if (i < CAPTURE_BUFFER_SIZE)
       {
         buf[i++] = temp;
       }
       else
       {
         myCAM.CS_HIGH();
-        outFile.write(buf, 256);
+        written += storeChunk(path, buf, CAPTURE_BUFFER_SIZE) ? CAPTURE_BUFFER_SIZE : 0;
         i = 0;
         buf[i++] = temp;
+
+        // Close what is on the card, the emergency flush needs the bus
+        if (powerMonitor.failing())
+        {
+          storage.close(path);
+          Serial.println(F("Image cut short by power failure"));
+          return written;
+        }
+        spiBus.yield();
         myCAM.CS_LOW();
         myCAM.set_fifo_burst();
       }
@@ -407,6 +1576,85 @@ void capturePhotoToSD()
       buf[i++] = temp;
     }
   }
+
+  // No end-of-image marker, keep what was received
+  myCAM.CS_HIGH();
+  written += storeChunk(path, buf, i) ? i : 0;
+  storage.close(path);
+  Serial.println(F("Image truncated"));
+  return written;
+}
+
+// Capture a preview and an evidence frame of an incident and index them
+// together. When a badge is given, a preview matching a recent capture of the
+// same badge is recorded as a reference in the audit log instead, marked
+// simulated like the other audit lines of a simulated tap.
+void captureIncident(const char *reason, uint64_t badge, bool simulated)
+{
+  // The hold-up time is kept for the emergency flush
+  if (powerMonitor.failing())
+  {
+    return;
+  }
+
+  String basePath = getTimestampPath();
+
+  // Preview first, it is what alerting and uploads use
+  myCAM.OV5642_set_Compress_quality(low_quality);
+  myCAM.OV5642_set_JPEG_size(PREVIEW_JPEG_SIZE);
+  uint32_t previewLength = captureFrame();
+
+  if (badge && previewLength > 0)
+  {
+    uint32_t scanHash = fingerprintFrame(previewLength);
+    const char *original = captureDeduplicator.findDuplicate(badge, previewLength, scanHash, millis());
+    if (original)
+    {
+      Serial.print(F("Duplicate capture, referencing "));
+      Serial.println(original);
+      char detail[64];
+      snprintf(detail, sizeof(detail), simulated ? "simulated %s" : "%s", original);
+      auditLog.record(currentUnixTime(), "capture-ref", badge, detail);
+      myCAM.OV5642_set_Compress_quality(default_quality);
+      myCAM.OV5642_set_JPEG_size(PROBE_JPEG_SIZE);
+      return;
+    }
+    captureDeduplicator.remember(badge, previewLength, scanHash, millis(), basePath.c_str());
+  }
+
+  uint32_t previewBytes = previewLength > 0 ? streamFrameToSD(basePath + "P.jpg", previewLength) : 0;
+
+  // Then the larger frame kept for evidence only
+  myCAM.OV5642_set_Compress_quality(default_quality);
+  myCAM.OV5642_set_JPEG_size(EVIDENCE_JPEG_SIZE);
+  uint32_t evidenceLength = captureFrame();
+  uint32_t evidenceBytes = evidenceLength > 0 ? streamFrameToSD(basePath + "E.jpg", evidenceLength) : 0;
+
+  // Back to the probe resolution
+  myCAM.OV5642_set_JPEG_size(PROBE_JPEG_SIZE);
+
+  appendCaptureIndex(basePath, reason, previewBytes, evidenceBytes);
+}
+
+// Add a line to INDEX.CSV in the date folder:
+// time,reason,preview file,preview bytes,evidence file,evidence bytes
+void appendCaptureIndex(const String &basePath, const char *reason, uint32_t previewBytes, uint32_t evidenceBytes)
+{
+  int slash = basePath.lastIndexOf('/');
+  String folder = basePath.substring(0, slash);
+  String name = basePath.substring(slash + 1);
+
+  String path = folder + "/INDEX.CSV";
+
+  char line[80];
+  int length = snprintf(line, sizeof(line), "%s,%s,%sP.jpg,%lu,%sE.jpg,%lu\r\n",
+                        name.c_str(), reason, name.c_str(), (unsigned long)previewBytes,
+                        name.c_str(), (unsigned long)evidenceBytes);
+  if (!storeChunk(path.c_str(), (const uint8_t *)line, min(length, (int)sizeof(line) - 1)) ||
+      !storage.close(path.c_str()))
+  {
+    Serial.println(F("Capture index not queued"));
+  }
 }
 
 void checkButton()
@@ -427,6 +1675,7 @@ void checkButton()
     if (buttonState == LOW && (millis() - lastDoorAction >= DOOR_MOVE_TIME))
     {
       Serial.println("Button pressed");
+      lastActivityTime = millis();
       if (!doorIsOpen)
       {
         // Only open if door is closed
@@ -457,6 +1706,7 @@ void closeDoor()
   doorServo.write(SERVO_CLOSE_SPEED); // Rotate back to closed position
   doorIsOpen = false;
   lastDoorAction = millis();
+  requestStorage(TAILGATE_STOP, nullptr, 0, nullptr);
   digitalWrite(GREEN_LED, LOW);
   // tone(BUZZER, 1000, 200);
 }
@@ -472,22 +1722,162 @@ void signalAccessGranted()
   tone(BUZZER, 2000, 200);
 }
 
-void signalAccessDenied()
+void signalAccessDenied(uint64_t badge)
 {
   digitalWrite(RED_LED, HIGH);
 
-  // Capture photo of unauthorized access attempt
-  capturePhotoToSD();
+  // Capture photos of unauthorized access attempt, then sound the alarm
+  requestStorage(STORE_INCIDENT, "denied", badge, nullptr);
+  requestUi(UI_DENIED, nullptr);
+}
+
+// A tap the server was too busy to decide is not an incident, so no photo
+// is taken while it recovers
+void signalServerBusy()
+{
+  digitalWrite(RED_LED, HIGH);
+  requestUi(UI_DENIED, MSG_SERVER_BUSY);
+}
 
-  for (int i = 0; i < 3; i++)
+void requestDoor(DoorAction action)
+{
+  if (simulatedTap)
   {
-    tone(BUZZER, 500, 200);
-    delay(300);
+    return;
   }
+#if USE_RTOS
+  if (!doorQueue.post(action))
+  {
+    droppedRequests++;
+    Serial.println("Door queue full, request dropped");
+  }
+#else
+  performDoor(action);
+#endif
+}
 
-  digitalWrite(RED_LED, LOW);
+void performDoor(DoorAction action)
+{
+  // Only open a closed door and close an open one
+  if (action == DOOR_OPEN && !doorIsOpen)
+  {
+    openDoor();
+  }
+  else if (action == DOOR_CLOSE && doorIsOpen)
+  {
+    closeDoor();
+  }
+}
 
-  delay(2000);
+void requestStorage(StorageAction action, const char *name, uint64_t badge, const char *detail)
+{
+  StorageRequest request;
+  request.action = action;
+  request.name = name;
+  request.badge = badge;
+  request.time = currentUnixTime();
+  request.simulated = simulatedTap;
+  if (simulatedTap && action == STORE_AUDIT)
+  {
+    snprintf(request.detail, sizeof(request.detail), detail ? "simulated %s" : "simulated", detail);
+  }
+  else
+  {
+    snprintf(request.detail, sizeof(request.detail), "%s", detail ? detail : "");
+  }
+
+#if USE_RTOS
+  if (!storageQueue.post(request))
+  {
+    droppedRequests++;
+    Serial.println("Storage queue full, request dropped");
+  }
+#else
+  performStorage(request);
+#endif
+}
+
+void performStorage(const StorageRequest &request)
+{
+  switch (request.action)
+  {
+  case STORE_AUDIT:
+    auditLog.record(request.time, request.name, request.badge, request.detail[0] ? request.detail : nullptr);
+    break;
+  case STORE_INCIDENT:
+    captureIncident(request.name, request.badge, request.simulated);
+    break;
+  case TAILGATE_START:
+    tailgateMonitor.start();
+    break;
+  case TAILGATE_STOP:
+    tailgateMonitor.stop();
+    break;
+  }
+}
+
+void requestUi(UiAction action, const char *message)
+{
+  UiRequest request = {action, message};
+#if USE_RTOS
+  if (!uiQueue.post(request))
+  {
+    droppedRequests++;
+    Serial.println("UI queue full, request dropped");
+  }
+#else
+  performUi(request);
+#endif
+}
+
+void performUi(const UiRequest &request)
+{
+  if (request.message)
+  {
+    drawMessage(request.message);
+  }
+
+  if (request.action == UI_GRANTED)
+  {
+    signalAccessGranted();
+  }
+  else if (request.action == UI_DENIED)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      tone(BUZZER, 500, 200);
+      taskPause(300);
+    }
+
+    digitalWrite(RED_LED, LOW);
+
+    taskPause(2000);
+    drawMessage(idleMessage());
+  }
+}
+
+void showMessage(const char *message)
+{
+  requestUi(UI_MESSAGE, message);
+}
+
+void drawMessage(const char *message)
+{
+  TaskLock display(displayLock);
   lcd.clear();
-  lcd.print(MSG_READY);
-}
\ No newline at end of file
+  lcd.print(message);
+}
+
+void printMemoryMap()
+{
+  Serial.println("Static RAM budget (used / limit bytes):");
+  for (const MemoryBudget::Entry &entry : memoryMap)
+  {
+    Serial.print("  ");
+    Serial.print(entry.subsystem);
+    Serial.print(": ");
+    Serial.print(entry.used);
+    Serial.print(" / ");
+    Serial.println(entry.limit);
+  }
+}
@@ -0,0 +1,110 @@
+#include <Arduino.h>
+#include <WiFiS3.h>
+
+#include "arduino_secrets.h"
+#include "AuthProxy.h"
+#include "MemoryBudget.h"
+
+// Caching authorization proxy for a floor of doors, built instead of the door
+// firmware by the uno_r4_wifi_proxy environment. SERVER_ADDRESS and
+// SERVER_PORT name the real server here; the doors point theirs at this
+// device and PROXY_PORT.
+
+const unsigned long STATS_INTERVAL_MS = 60000;
+
+AuthProxy authProxy(SERVER_ADDRESS, SERVER_PORT, PROXY_PORT);
+
+// Static RAM, checked against MemoryBudget.h at compile time
+RAM_BUDGET(Proxy, BUDGET_PROXY_RAM, sizeof(AuthProxy));
+
+// Memory map printed at boot and by the build (scripts/memory_map.py)
+constexpr MemoryBudget::Entry memoryMap[] = {
+    BUDGET_ENTRY(Proxy),
+};
+static_assert(MemoryBudget::totalLimit(memoryMap) <= BUDGET_TOTAL_RAM, "Subsystem RAM budgets exceed BUDGET_TOTAL_RAM");
+
+unsigned long lastStatsReport = 0;
+
+void setupWiFi();
+void printStats();
+void printMemoryMap();
+
+void setup()
+{
+  // Initialize serial communication
+  Serial.begin(115200);
+  delay(2000);
+
+  setupWiFi();
+  authProxy.begin();
+
+  Serial.println("RFID Authorization Proxy");
+  Serial.print("Listening on port ");
+  Serial.println(PROXY_PORT);
+  printMemoryMap();
+}
+
+void loop()
+{
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    setupWiFi();
+  }
+
+  authProxy.service();
+
+  if (millis() - lastStatsReport >= STATS_INTERVAL_MS)
+  {
+    lastStatsReport = millis();
+    printStats();
+  }
+}
+
+void setupWiFi()
+{
+  Serial.print("Connecting to WiFi");
+  WiFi.begin(WIFI_SSID, WIFI_PASS);
+
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+    Serial.print(".");
+  }
+
+  Serial.println("\nWiFi connected!");
+  Serial.print("IP address: ");
+  Serial.println(WiFi.localIP());
+}
+
+void printStats()
+{
+  const AuthProxy::Stats &stats = authProxy.statistics();
+  Serial.print("Proxy requests: ");
+  Serial.print(stats.requests);
+  Serial.print(", cache hits: ");
+  Serial.print(stats.cacheHits);
+  Serial.print(", merged: ");
+  Serial.print(stats.merged);
+  Serial.print(", upstream: ");
+  Serial.print(stats.upstream);
+  Serial.print(", refreshed: ");
+  Serial.print(stats.refreshed);
+  Serial.print(", shed: ");
+  Serial.print(stats.shed);
+  Serial.print(", failed: ");
+  Serial.println(stats.failed);
+}
+
+void printMemoryMap()
+{
+  Serial.println("Static RAM budget (used / limit bytes):");
+  for (const MemoryBudget::Entry &entry : memoryMap)
+  {
+    Serial.print("  ");
+    Serial.print(entry.subsystem);
+    Serial.print(": ");
+    Serial.print(entry.used);
+    Serial.print(" / ");
+    Serial.println(entry.limit);
+  }
+}